@@ -15,44 +15,19 @@
 #include "parammm/parammm.hh"
 #include "misc.hh"
 #include "image_disk_access.hh"
+#include "disk_sum.hh"
+#include "annuli.hh"
 
 using std::string;
 using std::cout;
 using std::sqrt;
 
-struct Point
-{
-  Point(int _x, int _y) : x(_x), y(_y) {}
-  int x, y;
-};
-
-typedef std::vector<Point> PointVec;
-typedef std::vector<PointVec> PointVecVec;
-
-PointVecVec cachePVV(int xw, int yw)
-{
-  // cache delta x, y for each r-squared
-  const int maxrad = int(sqrt(xw*yw));
-  PointVecVec pvv;
-  for(int y=-maxrad; y<=maxrad; ++y)
-    for(int x=-maxrad; x<=maxrad; ++x)
-      {
-        unsigned r2 = unsigned(x*x + y*y);
-        if(r2 <= maxrad*maxrad)
-          {
-            while(pvv.size() <= r2)
-              pvv.push_back(PointVec());
-            pvv[r2].push_back(Point(x,y));
-          }
-      }
-  return pvv;
-}
-
 void construct_scale_thread(const image_float& inimg, const image_short& maskimg,
                             const image_float* bkgimg,
                             double minsn,
                             image_long& scaleimg,
-                            const PointVecVec& pvv,
+                            const annuli_table* annuli,
+                            const disk_sum* sums, unsigned long maxrad2,
                             std::vector<unsigned>& rows)
 {
   static std::mutex mut;
@@ -77,38 +52,81 @@ void construct_scale_thread(const image_float& inimg, const image_short& maskimg
           if(maskimg(x,y) < 1 && maskimg(x,y) != -2)
             continue;
 
+          if(sums != nullptr)
+            {
+              // search for the radius using the prefix sums
+              auto done = [&](const double* s) -> bool
+                {
+                  double sn = (bkgimg==nullptr) ? sqrt(s[0]) : (s[0]-s[1]) / sqrt(s[0]);
+                  return sn >= minsn;
+                };
+              double s[disk_sum::max_planes];
+              scaleimg(x,y) = long( sums->find_radius2(x, y, maxrad2, done, s) );
+              continue;
+            }
+
           double sum = 0;
           double sum_bg = 0;
-          size_t r2;
-          for(r2=0; r2<pvv.size(); ++r2)
+          unsigned long r2;
+          for(r2=0; r2<=maxrad2; ++r2)
             {
-              for(auto pt : pvv[r2])
+              annuli->for_each_radius2(r2, [&](int dx, int dy)
                 {
-                  int xi = int(x)+pt.x;
-                  int yi = int(y)+pt.y;
+                  int xi = int(x)+dx;
+                  int yi = int(y)+dy;
                   if(xi>=0 && yi>=0 && xi<int(inimg.xw()) && yi<int(inimg.yw()) && maskimg(xi,yi)>0)
                     {
                       sum += double(inimg(xi,yi));
                       if(bkgimg != nullptr)
                         sum_bg += double((*bkgimg)(xi,yi));
                     }
-                }
+                });
               double sn = (bkgimg==nullptr) ? sqrt(sum) : (sum-sum_bg) / sqrt(sum);
               if(sn >= minsn)
                 break;
             }
 
-          scaleimg(x,y) = long( std::min(pvv.size()-1, r2) );
+          scaleimg(x,y) = long( std::min(maxrad2, r2) );
         }
     }
 }
 
+// make prefix sums of the unmasked input (and background) images
+// (counts, background) or (counts, number of pixels) if no background
+disk_sum* make_sums(const image_float& inimg, const image_short& maskimg,
+                    const image_float* bkgimg, smooth_mode mode)
+{
+  disk_sum* sums = new disk_sum(inimg.xw(), inimg.yw(),
+                                mode == smooth_box ? disk_sum::box : disk_sum::disk);
+  sums->add_plane( [&](unsigned x, unsigned y) -> double
+                   { return maskimg(x,y)>0 ? double(inimg(x,y)) : 0.; } );
+  if(bkgimg != nullptr)
+    sums->add_plane( [&](unsigned x, unsigned y) -> double
+                     { return maskimg(x,y)>0 ? double((*bkgimg)(x,y)) : 0.; } );
+  else
+    sums->add_plane( [&](unsigned x, unsigned y) -> double
+                     { return maskimg(x,y)>0 ? 1. : 0.; } );
+  return sums;
+}
+
 void construct_scale(const image_float& inimg, const image_short& maskimg,
                      const image_float* bkgimg,
                      double sn,
-                     image_long& scaleimg, int nthreads)
+                     image_long& scaleimg, int nthreads,
+                     smooth_mode mode)
 {
-  const PointVecVec pvv(cachePVV(inimg.xw(), inimg.yw()));
+  // the annuli are only needed if not using prefix sums
+  delete_ptr<annuli_table> annuli;
+  delete_ptr<disk_sum> sums;
+  if(mode == smooth_annuli)
+    annuli = new annuli_table;
+  else
+    sums = make_sums(inimg, maskimg, bkgimg, mode);
+
+  // largest radius squared in annuli (limited by the annuli table)
+  const unsigned maxrad = std::min( unsigned(sqrt(double(inimg.xw())*inimg.yw())),
+                                    unsigned(annuli_table::max_radius) );
+  const unsigned long maxrad2 = (unsigned long)(maxrad)*maxrad;
 
   // make list of rows, in reverse order
   std::vector<unsigned> rows;
@@ -123,7 +141,8 @@ void construct_scale(const image_float& inimg, const image_short& maskimg,
                                     std::cref(inimg), std::cref(maskimg),
                                     bkgimg,
                                     sn, std::ref(scaleimg),
-                                    std::cref(pvv), std::ref(rows)));
+                                    annuli.ptr(), sums.ptr(), maxrad2,
+                                    std::ref(rows)));
     }
 
   // now wait for them
@@ -135,7 +154,8 @@ void construct_scale(const image_float& inimg, const image_short& maskimg,
 void apply_scale_thread(const image_float& inimg, const image_short& maskimg,
                         const image_long& scaleimg,
                         image_float& outimg,
-                        const PointVecVec& pvv,
+                        const annuli_table* annuli,
+                        const disk_sum* sums, unsigned long maxrad2,
                         std::vector<unsigned>& rows)
 {
   static std::mutex mut;
@@ -160,20 +180,29 @@ void apply_scale_thread(const image_float& inimg, const image_short& maskimg,
           if(maskimg(x,y) < 1 && maskimg(x,y) != -2)
             continue;
 
+          if(sums != nullptr)
+            {
+              // sums are (counts, number of pixels)
+              double s[disk_sum::max_planes];
+              sums->sum_radius2(x, y, scaleimg(x,y), s);
+              outimg(x,y) = s[0] / s[1];
+              continue;
+            }
+
           double sum = 0;
           unsigned npix = 0;
-          for(int r2=0; r2<=scaleimg(x,y) && r2<int(pvv.size()); ++r2)
+          for(long r2=0; r2<=scaleimg(x,y) && r2<=long(maxrad2); ++r2)
             {
-              for(auto pt : pvv[r2])
+              annuli->for_each_radius2(r2, [&](int dx, int dy)
                 {
-                  int xi = int(x)+pt.x;
-                  int yi = int(y)+pt.y;
+                  int xi = int(x)+dx;
+                  int yi = int(y)+dy;
                   if(xi>=0 && yi>=0 && xi<int(inimg.xw()) && yi<int(inimg.yw()) && maskimg(xi,yi)>0)
                     {
                       ++npix;
                       sum += double(inimg(xi,yi));
                     }
-                }
+                });
             }
           outimg(x,y) = sum / npix;
         }
@@ -182,9 +211,19 @@ void apply_scale_thread(const image_float& inimg, const image_short& maskimg,
 
 void apply_scale(const image_float& inimg, const image_short& maskimg,
                  const image_long& scaleimg, image_float& outimg,
-                 int nthreads)
+                 int nthreads, smooth_mode mode)
 {
-  const PointVecVec pvv(cachePVV(inimg.xw(), inimg.yw()));
+  delete_ptr<annuli_table> annuli;
+  delete_ptr<disk_sum> sums;
+  if(mode == smooth_annuli)
+    annuli = new annuli_table;
+  else
+    sums = make_sums(inimg, maskimg, nullptr, mode);
+
+  // largest radius squared in annuli (limited by the annuli table)
+  const unsigned maxrad = std::min( unsigned(sqrt(double(inimg.xw())*inimg.yw())),
+                                    unsigned(annuli_table::max_radius) );
+  const unsigned long maxrad2 = (unsigned long)(maxrad)*maxrad;
 
   // make list of rows, in reverse order
   std::vector<unsigned> rows;
@@ -198,7 +237,8 @@ void apply_scale(const image_float& inimg, const image_short& maskimg,
       threads.push_back(std::thread(apply_scale_thread,
                                     std::cref(inimg), std::cref(maskimg),
                                     std::cref(scaleimg), std::ref(outimg),
-                                    std::cref(pvv), std::ref(rows)));
+                                    annuli.ptr(), sums.ptr(), maxrad2,
+                                    std::ref(rows)));
     }
 
   // now wait for them
@@ -317,6 +357,7 @@ int main(int argc, char* argv[])
   int threads = 1;
   bool apply_mode = false;
   bool apply_gaussian = false;
+  string smoothmode = "annuli";
 
   parammm::param params(argc, argv);
   params.add_switch( parammm::pswitch( "apply", 'a',
@@ -351,6 +392,10 @@ int main(int argc, char* argv[])
 				      parammm::pint_opt(&threads),
 				      "set number of threads (default 1)",
 				      "VAL"));
+  params.add_switch( parammm::pswitch("smoothmode", 0,
+				      parammm::pstring_opt(&smoothmode),
+				      "annuli (def), disk or box",
+				      "MODE"));
   params.set_autohelp("Usage: accumulate_counts [OPTIONS] file.fits\n"
 		      "Measure smoothing scale from count data, to be applied later to other data.\n"
 		      "Written by Jeremy Sanders 2020.",
@@ -368,6 +413,7 @@ int main(int argc, char* argv[])
     }
 
   const string filename = params.args()[0];
+  const smooth_mode mode = parse_smooth_mode(smoothmode);
   image_float* in_image;
 
   load_image( filename, nullptr, &in_image);
@@ -392,7 +438,7 @@ int main(int argc, char* argv[])
     {
       image_long* scale_img = new image_long(in_image->xw(), in_image->yw(), -1);
 
-      construct_scale(*in_image, *mask_image, bkg_image, sn, *scale_img, threads);
+      construct_scale(*in_image, *mask_image, bkg_image, sn, *scale_img, threads, mode);
 
       write_image(scale_file, *scale_img);
     }
@@ -407,7 +453,7 @@ int main(int argc, char* argv[])
       if(apply_gaussian)
         apply_scale_gaussian(*in_image, *mask_image, *scale_img, *out_img, threads);
       else
-        apply_scale(*in_image, *mask_image, *scale_img, *out_img, threads);
+        apply_scale(*in_image, *mask_image, *scale_img, *out_img, threads, mode);
 
       write_image(app_file, *out_img);
     }
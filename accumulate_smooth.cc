@@ -4,6 +4,7 @@
 
 #include <iostream>
 #include <string>
+#include <cstdlib>
 
 #include "parammm/parammm.hh"
 #include "flux_estimator.hh"
@@ -18,6 +19,8 @@ int main(int argc, char* argv[])
   string back_file, mask_file;
   string out_file = "acsmooth.fits";
   double sn = 15;
+  int threads = 1;
+  string smoothmode = "annuli";
 
   parammm::param params(argc, argv);
   params.add_switch( parammm::pswitch( "bg", 'b',
@@ -36,6 +39,14 @@ int main(int argc, char* argv[])
 				      parammm::pdouble_opt(&sn),
 				      "set signal:noise threshold (def 15)",
 				      "VAL"));
+  params.add_switch( parammm::pswitch("threads", 't',
+				      parammm::pint_opt(&threads),
+				      "set number of threads (default 1)",
+				      "VAL"));
+  params.add_switch( parammm::pswitch("smoothmode", 0,
+				      parammm::pstring_opt(&smoothmode),
+				      "annuli (def), disk or box",
+				      "MODE"));
   params.set_autohelp("Usage: accumulate_smooth [OPTIONS] file.fits\n"
 		      "Accumulate smoothing program.\n"
 		      "Written by Jeremy Sanders 2004.",
@@ -51,6 +62,11 @@ int main(int argc, char* argv[])
     {
       params.show_autohelp();
     }
+  if( threads < 1 )
+    {
+      std::cerr << "(!) --threads must be at least 1\n";
+      std::exit(1);
+    }
 
   const string filename = params.args()[0];
 
@@ -85,7 +101,8 @@ int main(int argc, char* argv[])
   const image_float bg_exp(in_image->xw(), in_image->yw(), bg_exposure);
 
   flux_estimator fe( in_image, bg_image, mask_image,
-		     &fg_exp, &bg_exp, 0, sn);
+		     &fg_exp, &bg_exp, 0, sn, threads);
+  fe.set_smooth_mode( parse_smooth_mode(smoothmode) );
   image_float out = fe();
 
   write_image(out_file, out);
@@ -13,20 +13,13 @@
 
 #include "misc.hh"
 #include "fitsio_simple.hh"
+#include "annuli.hh"
 
 namespace
 {
 
   template <typename T> T sqr(T v) { return v*v; }
 
-  struct point
-  {
-    point(int xp, int yp) : x(xp), y(yp) {}
-    int x, y;
-  };
-  typedef std::vector<point> point_vec;
-  typedef std::vector<point_vec> point_vec_vec;
-
   // retains more precision that a standard summation
   class KahanSum
   {
@@ -66,16 +59,12 @@ namespace
         out_image(ct_image.xw(), ct_image.yw(),
                   std::numeric_limits<double>::quiet_NaN())
     {
-      precalculate_circles();
-      precalculate_shifts();
       reset_state();
     }
 
     void smooth_all();
 
   private:
-    void precalculate_circles();
-    void precalculate_shifts();
     void reset_state();
     void add_shift(int x, int y, int r, int sign, bool doiny, bool mirror);
     void new_pixel(int x, int y);
@@ -83,11 +72,10 @@ namespace
     // this is a template to speed up the inner loop as VAL only equals -1 and 1
     template <int VAL> void add_or_remove_circle(int x, int y, int r)
     {
-      const point_vec& circ(_circles[r]);
-      for(point_vec::const_iterator i = circ.begin(); i != circ.end(); ++i)
+      _annuli.for_each(r, [&](int dx, int dy)
         {
-          int nx = x + i->x;
-          int ny = y + i->y;
+          int nx = x + dx;
+          int ny = y + dy;
         
           if( nx >= 0 and nx < _xw and ny >= 0 and ny < _yw and _mask_image(nx, ny) )
             {
@@ -95,7 +83,7 @@ namespace
               _tot_expcorr += VAL*_expcorr_image(nx, ny);
               _tot_pix += VAL;
             }
-        }
+        });
     }
 
     // calculate signal to noise squared
@@ -109,8 +97,8 @@ namespace
     const int _yw;
     const double _target_sn2;
 
-    point_vec_vec _circles;
-    point_vec_vec _shift_incl;
+    // pixels included as a function of radius in circle
+    annuli_table _annuli;
 
     int _radius;
     int _tot_ct;
@@ -125,39 +113,6 @@ namespace
 
 }
 
-// precalculate pixels included as a function of radius in circle
-void Smoother::precalculate_circles()
-{
-  int maxrad = int(sqrt(double( sqr(_xw)+sqr(_yw) ))) + 1;
-  _circles.resize(maxrad);
-
-  for(int y=-(_yw-1); y<_yw; ++y)
-    for(int x=-(_xw-1); x<_xw; ++x)
-      {
-        int r = int( sqrt(double( sqr(x)+sqr(y) )) );
-        _circles[r].push_back( point(x, y) );
-      }
-}
-
-// precalculate pixels included when a circle is shifted to the right
-void Smoother::precalculate_shifts()
-{
-  int maxrad = int(sqrt(double( sqr(_xw)+sqr(_yw) ))) + 1;
-  _shift_incl.resize(maxrad);
-
-  for(int y=-(_yw-1); y<_yw; ++y)
-    for(int x=-(_xw-1); x<_xw; ++x)
-      {
-        int r1 = int( sqrt(double(sqr(x) + sqr(y))) );
-        int r2 = int( sqrt(double(sqr(x+1) + sqr(y))) );
-
-        if( r1 < r2 )
-          {
-            _shift_incl[r1].push_back( point(x, y) );
-          }
-      }
-}
-
 void Smoother::reset_state()
 {
   _radius = 0;
@@ -174,11 +129,12 @@ void Smoother::reset_state()
 // mirror: shift to left, not right
 void Smoother::add_shift(int x, int y, int r, int sign, bool doiny, bool mirror)
 {
-  const point_vec& shift(_shift_incl[r]);
-  for(point_vec::const_iterator i = shift.begin(); i != shift.end(); ++i)
+  // the pixels included when a circle is shifted to the right are
+  // the last pixels in each row of the circle
+  for(int row = -r; row <= r; ++row)
     {
-      int dx = i->x;
-      int dy = i->y;
+      int dx = annuli_table::row_halfwidth(r, row);
+      int dy = row;
 
       if(mirror)
         dx = -dx;
@@ -12,6 +12,8 @@
 
 #include "misc.hh"
 #include "fitsio_simple.hh"
+#include "disk_sum.hh"
+#include "annuli.hh"
 
 using namespace std;
 
@@ -21,24 +23,16 @@ public:
   flux_estimator(const image_float* const in_image,
 		 const image_float* const expmap_image,
 		 const image_short* const mask_image,
-		 const double minsn );
+		 const double minsn,
+		 const smooth_mode mode = smooth_annuli );
 
   const image_float& operator()();
 
-  struct _point
-  {
-    _point(int xp, int yp) : x(xp), y(yp) {}
-    int x, y;
-  };
-  typedef std::vector<_point> _point_vec;
-  typedef std::vector<_point_vec> _point_vec_vec;
-
 private:
   void do_estimation();
 
-  // work out which points are in which annuli
-  void precalculate_annuli();
   void smooth();
+  void smooth_sums();
 
   void bin();
 
@@ -46,14 +40,15 @@ private:
 
   const unsigned _xw, _yw; // dimensions of images
   const double _minsn; // minimum signal:noise
+  const smooth_mode _mode;
 
   const image_float* const _in_image;
   const image_float* const _expmap_image;
   const image_short* const _mask_image;
 
-  // precalculated list of which points are in which annuli
+  // list of which points are in which annuli
   const unsigned _max_annuli;
-  _point_vec_vec _annuli_points;
+  annuli_table _annuli;
 
   bool _done;
 
@@ -66,19 +61,20 @@ private:
 // work out integerised radius
 inline static unsigned unsigned_radius(int x, int y)
 {
-  return unsigned( sqrt( double(x*x + y*y) ) );
+  return unsigned( sqrt( double(x)*x + double(y)*y ) );
 }
 
 flux_estimator::flux_estimator( const image_float* const in_image,
 				const image_float* const expmap_image,
 				const image_short* const mask_image,
-				const double minsn = 10  )
+				const double minsn,
+				const smooth_mode mode )
   : _xw( in_image->xw() ), _yw( in_image->yw() ),
-    _minsn( minsn ),
+    _minsn( minsn ), _mode( mode ),
     _in_image(in_image), _expmap_image(expmap_image),
     _mask_image(mask_image),
-    _max_annuli( unsigned_radius(_xw, _yw)+1 ),
-    _annuli_points( _max_annuli ),
+    _max_annuli( std::min( unsigned_radius(_xw, _yw)+1,
+			   annuli_table::max_radius+1 ) ),
     _done( false ),
     _out_image( _xw, _yw ),
     _estimated_errors( _xw, _yw )
@@ -88,25 +84,10 @@ flux_estimator::flux_estimator( const image_float* const in_image,
   assert( mask_image->xw() == _xw && mask_image->yw() == _yw );
 }
 
-void flux_estimator::precalculate_annuli()
-{
-  for(int y=-(_yw-1); y<int(_yw); ++y)
-    {
-      for(int x=-(_xw-1); x<int(_xw); ++x)
-	{
-	  const unsigned r = unsigned_radius(x, y);
-	  
-	  // add pixel to appropriate radius
-	  _annuli_points[r].push_back( _point(x, y) );
-	}
-    }
-}
-
 const image_float& flux_estimator::operator()()
 {
   if( ! _done )
     {
-      precalculate_annuli();
       do_estimation();
       _done = true;
     }
@@ -116,7 +97,10 @@ const image_float& flux_estimator::operator()()
 
 void flux_estimator::do_estimation()
 {
-  smooth();
+  if( _mode == smooth_annuli )
+    smooth();
+  else
+    smooth_sums();
 }
 
 static inline double _square(const double d)
@@ -161,20 +145,17 @@ void flux_estimator::smooth()
 		     < SN_2 )) )
 	    {
 	      // iterate over points in radius
-	      const _point_vec::const_iterator e =
-		_annuli_points[radius].end();
-	      for( _point_vec::const_iterator i =
-		     _annuli_points[radius].begin(); i != e; ++i )
+	      _annuli.for_each(radius, [&](int dx, int dy)
 		{
-		  const int xp = int(x) + i->x;
-		  const int yp = int(y) + i->y;
+		  const int xp = int(x) + dx;
+		  const int yp = int(y) + dy;
 		  // skip pixels we don't have
 		  if( xp < 0 || yp < 0 || xp >= int(_xw) || yp >= int(_yw) )
-		    continue;
+		    return;
 		  
 		  // skip masked pixels
 		  if( (*_mask_image)(xp, yp) < 1 )
-		    continue;
+		    return;
 
 		  const double corrected = (*_in_image)(xp, yp);
 		  const double expmap = (*_expmap_image)(xp, yp);
@@ -184,7 +165,7 @@ void flux_estimator::smooth()
 		  noise_2 += in;
 		  sum_corrected += corrected;
 		  count++;
-		}
+		});
 	      
 // 	      if( radius > 20 && lastcount == count )
 // 		break;
@@ -203,6 +184,56 @@ void flux_estimator::smooth()
   std::cout << '\n'; c++;
 }
 
+// smooth using prefix sums of the foreground counts, corrected image
+// and number of pixels
+void flux_estimator::smooth_sums()
+{
+  const image_short& mask = *_mask_image;
+  const image_float& in = *_in_image;
+  const image_float& expmap = *_expmap_image;
+
+  disk_sum sums( _xw, _yw, _mode == smooth_box ?
+		 disk_sum::box : disk_sum::disk );
+  sums.add_plane( [&](unsigned x, unsigned y) -> double
+		  { return mask(x, y) < 1 ? 0. :
+		      double(in(x, y)) * double(expmap(x, y)); } );
+  sums.add_plane( [&](unsigned x, unsigned y) -> double
+		  { return mask(x, y) < 1 ? 0. : double(in(x, y)); } );
+  sums.add_plane( [&](unsigned x, unsigned y) -> double
+		  { return mask(x, y) < 1 ? 0. : 1.; } );
+
+  // noise squared is the same as the foreground counts
+  const double SN_2 = _minsn*_minsn;
+  auto done = [&](const double* s) -> bool
+    {
+      return s[0] != 0. && _square(s[0]) / s[0] >= SN_2;
+    };
+
+  for(unsigned y=0; y != _yw; ++y)
+    {
+      if( y % (_yw/10) == 0 )
+	{
+	  std::cout << y / (_yw/10) << ' ';
+	  std::cout.flush();
+	}
+
+      for(unsigned x=0; x != _xw; ++x)
+	{
+	  // skip masked pixels
+	  if( mask(x, y) < 1 )
+	    continue;
+
+	  double s[disk_sum::max_planes];
+	  sums.find_radius(x, y, _max_annuli-1, done, s);
+
+	  _out_image(x, y) = s[1]/s[2];
+	  _estimated_errors(x, y) = sqrt( s[0] ) / s[2];
+	}
+    }
+
+  std::cout << '\n';
+}
+
 ////////////////////////////////////////////////////////////////////////////
 
 // accumulate smoothing
@@ -225,6 +256,7 @@ int main(int argc, char* argv[])
   string back_file, mask_file;
   string out_file = "acsmooth.fits";
   double sn = 15;
+  string smoothmode = "annuli";
 
   parammm::param params(argc, argv);
   params.add_switch( parammm::pswitch( "mask", 'm',
@@ -239,6 +271,10 @@ int main(int argc, char* argv[])
 				      parammm::pdouble_opt(&sn),
 				      "set signal:noise threshold (def 15)",
 				      "VAL"));
+  params.add_switch( parammm::pswitch("smoothmode", 0,
+				      parammm::pstring_opt(&smoothmode),
+				      "annuli (def), disk or box",
+				      "MODE"));
   params.set_autohelp("Usage: accumulate_smooth_expmap [OPTIONS] expcorrect.fits expmap.fits\n"
 		      "Accumulate smoothing program (exposure map).\n"
 		      "Written by Jeremy Sanders 2004.",
@@ -271,7 +307,8 @@ int main(int argc, char* argv[])
       load_image( mask_file, &mask_image );
     }
 
-  flux_estimator fe( in_image, expmap_image, mask_image, sn);
+  flux_estimator fe( in_image, expmap_image, mask_image, sn,
+		     parse_smooth_mode(smoothmode) );
   image_float out = fe();
 
   write_image(out_file, out);
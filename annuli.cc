@@ -0,0 +1,122 @@
+// table of pixel offsets in annuli of integer radius
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#include <cmath>
+#include <cassert>
+
+#include "annuli.hh"
+
+annuli_table::annuli_table()
+  : _no_radii(0)
+{
+  for(unsigned i=0; i != no_blocks; ++i)
+    _blocks[i] = 0;
+}
+
+annuli_table::~annuli_table()
+{
+  for(unsigned i=0; i != no_blocks; ++i)
+    delete[] _blocks[i];
+}
+
+unsigned long annuli_table::isqrt(const unsigned long v)
+{
+  unsigned long r = (unsigned long)( std::sqrt( double(v) ) );
+  // correct for any rounding in the floating point square root
+  while( r*r > v )
+    --r;
+  while( (r+1)*(r+1) <= v )
+    ++r;
+  return r;
+}
+
+int annuli_table::row_halfwidth(const unsigned r, const int dy)
+{
+  const long rad2 = long(r+1)*long(r+1) - 1 - long(dy)*long(dy);
+  if( rad2 < 0 )
+    return -1;
+  return int( isqrt(rad2) );
+}
+
+unsigned long annuli_table::annulus_area(const unsigned r) const
+{
+  const offset_vec& oct = octant(r);
+
+  unsigned long area = 0;
+  for(offset_vec::const_iterator i = oct.begin(); i != oct.end(); ++i)
+    {
+      if( i->dx == 0 )
+	area += 1;
+      else if( i->dy == 0 || i->dx == i->dy )
+	area += 4;
+      else
+	area += 8;
+    }
+  return area;
+}
+
+// sort offsets by radius squared, then row
+static bool compare_offsets(const annuli_table::offset& a,
+			    const annuli_table::offset& b)
+{
+  const unsigned long ra = annuli_table::offset_radius2(a);
+  const unsigned long rb = annuli_table::offset_radius2(b);
+  return ra < rb || ( ra == rb && a.dy < b.dy );
+}
+
+void annuli_table::grow(const unsigned r) const
+{
+  assert( r <= max_radius );
+
+  std::lock_guard<std::mutex> lock(_grow_mutex);
+
+  // another thread may have grown the table
+  const unsigned oldsize = _no_radii.load(std::memory_order_relaxed);
+  if( r < oldsize )
+    return;
+
+  // grow only to the radius requested, rounded up to a whole step, so
+  // the table is not grown for every radius
+  unsigned newsize = (r + grow_step) / grow_step * grow_step;
+  if( newsize > max_radius+1 )
+    newsize = max_radius+1;
+
+  for(unsigned rad = oldsize; rad != newsize; ++rad)
+    {
+      offset_vec*& block = _blocks[rad >> block_bits];
+      if( block == 0 )
+	block = new offset_vec[block_size];
+      offset_vec& oct = block[rad & block_mask];
+
+      // pixels with rad^2 <= dx^2+dy^2 < (rad+1)^2 and 0 <= dy <= dx
+      const unsigned long inner2 = (unsigned long)(rad)*rad;
+      const unsigned long outer2 = (unsigned long)(rad+1)*(rad+1) - 1;
+      for(unsigned long dy = 0; 2*dy*dy <= outer2; ++dy)
+	{
+	  unsigned long dxmin = dy;
+	  if( dy*dy < inner2 )
+	    {
+	      // smallest dx with dx^2 >= inner2 - dy^2
+	      const unsigned long rem = inner2 - dy*dy;
+	      unsigned long s = isqrt(rem);
+	      if( s*s < rem )
+		++s;
+	      dxmin = std::max(dxmin, s);
+	    }
+	  const unsigned long dxmax = isqrt(outer2 - dy*dy);
+
+	  for(unsigned long dx = dxmin; dx <= dxmax; ++dx)
+	    {
+	      offset o;
+	      o.dx = (unsigned short)dx;
+	      o.dy = (unsigned short)dy;
+	      oct.push_back(o);
+	    }
+	}
+
+      std::sort(oct.begin(), oct.end(), compare_offsets);
+    }
+
+  _no_radii.store(newsize, std::memory_order_release);
+}
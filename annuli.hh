@@ -0,0 +1,141 @@
+// table of pixel offsets in annuli of integer radius
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#ifndef ANNULI_HH
+#define ANNULI_HH
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+// Keeps the pixel offsets lying in each annulus, where the annulus of
+// radius r contains the pixels with int(sqrt(dx^2+dy^2)) == r.
+//
+// Only the offsets in the first octant (0 <= dy <= dx) are stored, as
+// 16 bit values, and the other octants are generated when iterating.
+// The table is grown when a radius is first requested, only as far as
+// that radius (rounded up to grow_step radii). Growing is thread safe,
+// so a single table can be shared between threads.
+class annuli_table
+{
+public:
+  // offset within the first octant
+  struct offset
+  {
+    unsigned short dx, dy;
+  };
+  typedef std::vector<offset> offset_vec;
+
+  // largest radius which can be stored
+  static const unsigned max_radius = 65534;
+
+  annuli_table();
+  ~annuli_table();
+
+  // get the octant offsets for radius r, sorted by radius squared
+  const offset_vec& octant(const unsigned r) const
+  {
+    if( r >= _no_radii.load(std::memory_order_acquire) )
+      grow(r);
+    return _blocks[r >> block_bits][r & block_mask];
+  }
+
+  // call fn(dx, dy) for each pixel in the annulus of radius r
+  template<class F> void for_each(const unsigned r, F fn) const
+  {
+    const offset_vec& oct = octant(r);
+    const offset_vec::const_iterator e = oct.end();
+    for(offset_vec::const_iterator i = oct.begin(); i != e; ++i)
+      expand(*i, fn);
+  }
+
+  // call fn(dx, dy) for each pixel with dx^2+dy^2 == rad2
+  template<class F> void for_each_radius2(const unsigned long rad2,
+					  F fn) const;
+
+  // number of pixels in the annulus of radius r
+  unsigned long annulus_area(const unsigned r) const;
+
+  // call fn(dx, dy) for each distinct reflection of an octant offset
+  template<class F> static void expand(const offset& o, F fn);
+
+  // largest dx in row dy of the disk of pixels with radius <= r
+  // (-1 if row is outside disk)
+  static int row_halfwidth(const unsigned r, const int dy);
+
+  // integer square root
+  static unsigned long isqrt(const unsigned long v);
+
+  // radius squared of an offset
+  static unsigned long offset_radius2(const offset& o)
+  {
+    return (unsigned long)(o.dx)*o.dx + (unsigned long)(o.dy)*o.dy;
+  }
+
+private:
+  // make sure radii up to and including r are in the table
+  void grow(const unsigned r) const;
+
+  // number of radii added at a time when growing
+  static const unsigned grow_step = 16;
+
+  // radii are stored in blocks which do not move once allocated
+  static const unsigned block_bits = 8;
+  static const unsigned block_size = 1u << block_bits;
+  static const unsigned block_mask = block_size - 1;
+  static const unsigned no_blocks = (max_radius >> block_bits) + 1;
+
+  mutable std::mutex _grow_mutex;
+  mutable std::atomic<unsigned> _no_radii;
+  mutable offset_vec* _blocks[no_blocks];
+};
+
+////////////////////////////////////////////////////////////////////////
+// template implementation
+
+template<class F> void annuli_table::expand(const offset& o, F fn)
+{
+  const int dx = o.dx;
+  const int dy = o.dy;
+
+  if( dx == 0 )
+    {
+      // centre pixel
+      fn(0, 0);
+    }
+  else if( dy == 0 )
+    {
+      fn(dx, 0); fn(-dx, 0);
+      fn(0, dx); fn(0, -dx);
+    }
+  else if( dx == dy )
+    {
+      fn(dx, dy); fn(-dx, dy);
+      fn(dx, -dy); fn(-dx, -dy);
+    }
+  else
+    {
+      fn(dx, dy); fn(-dx, dy);
+      fn(dx, -dy); fn(-dx, -dy);
+      fn(dy, dx); fn(-dy, dx);
+      fn(dy, -dx); fn(-dy, -dx);
+    }
+}
+
+template<class F> void annuli_table::for_each_radius2(const unsigned long rad2,
+						      F fn) const
+{
+  // octant is sorted by radius squared, so find the offsets with rad2
+  const offset_vec& oct = octant( unsigned(isqrt(rad2)) );
+  offset_vec::const_iterator i =
+    std::lower_bound( oct.begin(), oct.end(), rad2,
+		      [](const offset& o, unsigned long v)
+		      { return offset_radius2(o) < v; } );
+
+  for( ; i != oct.end() && offset_radius2(*i) == rad2; ++i )
+    expand(*i, fn);
+}
+
+#endif
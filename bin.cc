@@ -7,13 +7,14 @@
 #include "point.hh"
 #include "misc.hh"
 #include "bin.hh"
+#include "checkpoint.hh"
 
 namespace
 {
   // work out integerised radius
   inline unsigned unsigned_radius(const int x, const int y)
   {
-    return unsigned( std::sqrt( double(x*x + y*y) ) );
+    return unsigned( std::sqrt( double(x)*x + double(y)*y ) );
   }
 }
 
@@ -35,7 +36,10 @@ bin_helper::bin_helper( const image_float* in_image,
     _expmap_image( 0 ),
     _bg_expmap_image( 0 ),
     _noisemap_image( 0 ),
-    _mask_image( _xw, _yw, 1 ),
+    _mask_image( _xw, _yw, 1, 1, 0 ),
+
+    _point_slots( 0, 0 ),
+    _edge_slots( _xw, _yw, -1 ),
 
     _max_annuli( unsigned_radius(_xw, _yw) + 1 ),
     _bin_counter( 0 ),
@@ -43,56 +47,91 @@ bin_helper::bin_helper( const image_float* in_image,
     _constrain_fill( false ),
     _constrain_val( 4 ),
     
-    _scrub_large_bins( -1 )
+    _scrub_large_bins( -1 ),
+    _bulk_scrub( false ),
+    _hilbert_order( false ),
+    _scrub_threads( 0 ),
+    _verbose( true )
 
 {
-  precalculate_annuli();
   precalculate_areas();
 }
 
-void bin_helper::precalculate_annuli()
+void bin_helper::precalculate_areas()
 {
-  _annuli_points.clear();
-  _annuli_points.resize( _max_annuli );
+  // count the offsets within the image size at each integerised
+  // radius, using the symmetry of the four quadrants
+  _areas.assign( _max_annuli, 0 );
 
-  // identify which pixels lie at a particular radius
-  for(int y=-int(_yw-1); y<int(_yw); ++y)
+  for(unsigned dy=0; dy<_yw; ++dy)
     {
-      for(int x=-int(_xw-1); x<int(_xw); ++x)
-        {
-          const unsigned r = unsigned_radius(x, y);
+      const unsigned wy = dy == 0 ? 1 : 2;
+      const unsigned long dy2 = (unsigned long)(dy)*dy;
 
-          // add pixel to appropriate radius
-          _annuli_points[r].emplace_back(x, y);
-        }
+      // radius increases along the row, so step it without a sqrt
+      unsigned r = dy;
+      for(unsigned dx=0; dx<_xw; ++dx)
+	{
+	  const unsigned long d2 = (unsigned long)(dx)*dx + dy2;
+	  while( (unsigned long)(r+1)*(r+1) <= d2 )
+	    ++r;
+	  _areas[r] += dx == 0 ? wy : 2*wy;
+	}
     }
-}
 
-void bin_helper::precalculate_areas()
-{
-  _areas.resize( _max_annuli );
-
-  unsigned total = 0;
+  // convert to the total area within each radius
+  unsigned long total = 0;
   for(unsigned radius=0; radius<_max_annuli; ++radius)
     {
-      const unsigned area = _annuli_points[radius].size();
-      total += area;
+      total += _areas[radius];
       _areas[radius] = total;
     }
 }
 
 ///////////////////////////////////////////////////////////////////////
 
+// Growing bins use these buffers, rather than allocating their own,
+// so they only need to grow when a bigger bin than before is made.
+struct bin::arena
+{
+  _Pt_container all_points, edge_points;
+  std::vector<unsigned> edge_order;
+  _frontier_vector frontier, failed;
+};
+
+bin::arena& bin::thread_arena()
+{
+  static thread_local arena a;
+  return a;
+}
+
+// copy vec into storage of the right size, and return its old storage
+// (emptied) to buffer
+template<class V> static void return_to_arena(V& vec, V& buffer)
+{
+  V exact( vec.begin(), vec.end() );
+  vec.swap( exact );
+  exact.clear();
+  buffer.swap( exact );
+}
+
 // find an initial pixel for the bin
 // search for the nearest pixel with the highest flux
 
 bin::bin( bin_helper* helper )
   : _helper(helper),
     _bin_no( _helper->bin_counter() ),
+    _edge_counter( 0 ),
+    _edge_holes( 0 ),
+    _store_index( -1 ),
+    _packed( false ),
     _aimval( -1 ),
     _fg_sum(0), _bg_sum(0),
     _bg_sum_weight(0), _noisemap_2_sum(0),_expratio_sum_2(0),
-    _centroid_sum(0, 0), _centroid_weight(0), _count(0)
+    _centroid_sum(0, 0), _centroid_weight(0), _count(0),
+    _win_x0(0), _win_y0(0),
+    _win_x1(int(helper->xw())-1), _win_y1(int(helper->yw())-1),
+    _overflowed(false)
 {
 }
 
@@ -108,28 +147,108 @@ void bin::drop_bin( )
   _centroid_sum.y() = 0;
   _centroid_weight = 0;
   _count = 0;
+
+  if( _packed )
+    {
+      _store_index = _helper->store()->set( _store_index, _Pt_container(),
+					    _Pt_container() );
+      return;
+    }
+
   _all_points.clear();
+
+  image_int& edge_slots = *_helper->edge_slots();
+  for( _Pt_container::const_iterator i = _edge_points.begin();
+       i != _edge_points.end(); ++i )
+    {
+      if( ! is_edge_hole(*i) )
+	edge_slots(i->x(), i->y()) = -1;
+    }
+  _edge_points.clear();
+  _edge_order.clear();
+  _edge_holes = 0;
 }
 
-void bin::remove_point( const int x, const int y )
+void bin::rollback()
 {
-  // get rid of point from lists
-  {
-    const point_int P(x,y);
+  assert( ! _packed );
+  image_long& bins_image = *_helper->bins_image();
+  image_int* point_slots = _helper->point_slots();
+  for( _Pt_container::const_iterator i = _all_points.begin();
+       i != _all_points.end(); ++i )
+    {
+      bins_image(i->x(), i->y()) = -1;
+      if( point_slots != 0 )
+	(*point_slots)(i->x(), i->y()) = -1;
+    }
+  drop_bin();
+}
+
+void bin::add_edge_point( const int x, const int y )
+{
+  image_int& edge_slots = *_helper->edge_slots();
+  if( edge_slots(x, y) < 0 )
+    {
+      edge_slots(x, y) = _edge_points.size();
+      _edge_points.emplace_back(x, y);
+      _edge_order.push_back( _edge_counter++ );
+    }
+}
+
+void bin::remove_edge_point( const size_t index )
+{
+  point_int& p = _edge_points[index];
+  assert( ! is_edge_hole(p) );
 
-    _Pt_container::iterator pt = std::find( _all_points.begin(),
-					    _all_points.end(),
-					    P );
-    assert( pt != _all_points.end() );
-    _all_points.erase( pt );
+  (*_helper->edge_slots())(p.x(), p.y()) = -1;
+  p = point_int(-1, -1);
+  ++_edge_holes;
+}
+
+void bin::compact_edge_points()
+{
+  if( _edge_holes*2 <= _edge_points.size() )
+    return;
 
+  // move points down over the holes, keeping their order
+  image_int& edge_slots = *_helper->edge_slots();
+  size_t out = 0;
+  for( size_t i = 0; i != _edge_points.size(); ++i )
     {
-      _Pt_container::iterator ept = std::find( _edge_points.begin(),
-					       _edge_points.end(),
-					       P );
-      if( ept != _edge_points.end() )
-	  _edge_points.erase( ept );
+      const point_int p = _edge_points[i];
+      if( ! is_edge_hole(p) )
+	{
+	  edge_slots(p.x(), p.y()) = out;
+	  _edge_order[out] = _edge_order[i];
+	  _edge_points[out++] = p;
+	}
     }
+  _edge_points.resize(out);
+  _edge_order.resize(out);
+  _edge_holes = 0;
+}
+
+void bin::remove_point( const int x, const int y )
+{
+  assert( ! compacted() );
+
+  // get rid of point from lists
+  {
+    assert( _helper->point_slots() != 0 );
+    image_int& point_slots = *_helper->point_slots();
+
+    // move last point into the slot of this one
+    const int slot = point_slots(x, y);
+    assert( slot >= 0 && _all_points[slot] == point_int(x, y) );
+    const point_int last = _all_points.back();
+    _all_points[slot] = last;
+    point_slots(last.x(), last.y()) = slot;
+    _all_points.pop_back();
+    point_slots(x, y) = -1;
+
+    const int edge_slot = (*_helper->edge_slots())(x, y);
+    if( edge_slot >= 0 )
+      remove_edge_point(edge_slot);
   }
 
   image_long* const bins_image = _helper->bins_image();
@@ -159,9 +278,6 @@ void bin::remove_point( const int x, const int y )
   // add points that are on the edge of this point in this bin into the
   // edge list
 
-  const int xw = _helper->xw();
-  const int yw = _helper->yw();
-
   for(size_t n = 0; n != bin_no_neigh; ++n)
     {
       const int xp = x + bin_neigh_x[n];
@@ -169,23 +285,22 @@ void bin::remove_point( const int x, const int y )
 
       // if neighbour is in this bin, mark as edge
       // if not already marked so
-      if( xp >= 0 && yp >= 0 && xp < xw && yp < yw &&
-	  (*bins_image)(xp, yp) == _bin_no )
+      if( (*bins_image)(xp, yp) == _bin_no )
 	{
-	  if( std::find( _edge_points.begin(), _edge_points.end(),
-			 point_int(xp, yp) ) == _edge_points.end() )
-	    {
-	      _edge_points.emplace_back(xp, yp);
-	    }
+	  add_edge_point(xp, yp);
 	}
     } // loop over neighbours
+
+  compact_edge_points();
 }
 
 void bin::add_point(const int x, const int y)
 {
-  point_int pt(x, y);
-
-  _all_points.push_back(pt);
+  assert( ! compacted() );
+  image_int* point_slots = _helper->point_slots();
+  if( point_slots != 0 )
+    (*point_slots)(x, y) = _all_points.size();
+  _all_points.emplace_back(x, y);
 
   double signal = (*_helper->in_image())(x, y);
   _fg_sum += signal;
@@ -218,92 +333,323 @@ void bin::add_point(const int x, const int y)
   }
 
   // put into edge (it might not be, but it will get flushed out)
-  if( std::find(_edge_points.begin(), _edge_points.end(), pt) ==
-      _edge_points.end() )
-    {
-      _edge_points.push_back(pt);
-    }
+  add_edge_point(x, y);
+  compact_edge_points();
 }
 
 // paint bin onto bins_image
 void bin::paint_bins_image() const
 {
   image_long& bins_image = * _helper->bins_image();
+  const long no = _bin_no;
+
+  for_each_point( [&bins_image, no](int x, int y)
+		  {
+		    bins_image(x, y) = no;
+		  } );
+}
+
+void bin::compact()
+{
+  if( _packed )
+    return;
+
+  _store_index = _helper->store()->set( _store_index, _all_points,
+					_edge_points );
+  if( _store_index < 0 )
+    return;
+
+  _Pt_container().swap( _all_points );
+  _Pt_container().swap( _edge_points );
+  std::vector<unsigned>().swap( _edge_order );
+  _frontier_vector().swap( _frontier );
+  _edge_counter = 0;
+  _edge_holes = 0;
+  _packed = true;
+}
+
+// Only the order of the edge points matters (when scrubbing), so they
+// are numbered again from zero, without the holes.
+void bin::unpack_lists(_Pt_container& points, _Pt_container& edge_points,
+		       std::vector<unsigned>& edge_order) const
+{
+  const bin_store& store = *_helper->store();
+
+  points.clear();
+  points.reserve( store.count(_store_index) );
+  store.for_each_point( _store_index, [&points](int x, int y)
+			{
+			  points.emplace_back(x, y);
+			} );
+
+  edge_points.clear();
+  edge_points.reserve( store.edge_count(_store_index) );
+  store.for_each_edge_point( _store_index, [&edge_points](int x, int y)
+			     {
+			       edge_points.emplace_back(x, y);
+			     } );
+
+  edge_order.resize( edge_points.size() );
+  for( size_t i = 0; i != edge_order.size(); ++i )
+    edge_order[i] = i;
+}
+
+void bin::expand()
+{
+  if( ! _packed )
+    return;
+
+  unpack_lists( _all_points, _edge_points, _edge_order );
+  _edge_counter = _edge_points.size();
+  _edge_holes = 0;
+  _packed = false;
 
-  typedef _Pt_container::const_iterator CI; 
-  const CI e = _all_points.end();
-  for( CI pix = _all_points.begin(); pix != e; ++pix )
+  index_points();
+}
+
+void bin::index_points()
+{
+  assert( ! _packed );
+
+  image_int* point_slots = _helper->point_slots();
+  image_int& edge_slots = *_helper->edge_slots();
+  for( size_t i = 0; i != _all_points.size(); ++i )
     {
-      bins_image( pix->x(), pix->y() ) = _bin_no;
+      const point_int& p = _all_points[i];
+      if( point_slots != 0 )
+	(*point_slots)(p.x(), p.y()) = i;
+      edge_slots(p.x(), p.y()) = -1;
     }
+  for( size_t i = 0; i != _edge_points.size(); ++i )
+    if( ! is_edge_hole(_edge_points[i]) )
+      edge_slots( _edge_points[i].x(), _edge_points[i].y() ) = i;
 }
 
-// adds the next pixel to the bin!
-bool bin::add_next_pixel()
+long bin_store::set( long i, const std::vector<point_int>& points,
+		     const std::vector<point_int>& edge_points )
+{
+  typedef std::vector<point_int>::const_iterator CI;
+
+  // the old pixels of the entry are no longer needed
+  if( i >= 0 )
+    {
+      entry& old = _entries[i];
+      _garbage += old.points + old.edges;
+      old.points = old.edges = 0;
+    }
+
+  // bounding box
+  int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+  if( ! points.empty() )
+    {
+      x0 = x1 = points[0].x();
+      y0 = y1 = points[0].y();
+    }
+  for( CI p = points.begin(); p != points.end(); ++p )
+    {
+      x0 = std::min( x0, p->x() );
+      x1 = std::max( x1, p->x() );
+      y0 = std::min( y0, p->y() );
+      y1 = std::max( y1, p->y() );
+    }
+
+  const unsigned long long xw = (unsigned long long)(x1 - x0) + 1;
+  const unsigned long long yw = (unsigned long long)(y1 - y0) + 1;
+  if( xw*yw > (unsigned long long)(UINT32_MAX) + 1 )
+    return -1;
+
+  size_t no_edges = 0;
+  for( CI p = edge_points.begin(); p != edge_points.end(); ++p )
+    if( p->x() >= 0 )
+      ++no_edges;
+
+  if( _garbage > block_size && _garbage*2 > _used )
+    collect_garbage();
+
+  // add blocks until the pixels fit
+  const size_t end = _used + points.size() + no_edges;
+  while( (_blocks.size() << block_bits) < end )
+    _blocks.push_back( std::vector<uint32_t>(block_size) );
+
+  if( i < 0 )
+    {
+      i = _entries.size();
+      _entries.push_back( entry() );
+    }
+  entry& e = _entries[i];
+  e.offset = _used;
+  e.points = points.size();
+  e.edges = no_edges;
+  e.x0 = x0;
+  e.y0 = y0;
+  e.xw = unsigned(xw);
+
+  for( CI p = points.begin(); p != points.end(); ++p )
+    pixel(_used++) = uint32_t( (unsigned long long)(p->y() - y0)*xw +
+			       (p->x() - x0) );
+  for( CI p = edge_points.begin(); p != edge_points.end(); ++p )
+    if( p->x() >= 0 )
+      pixel(_used++) = uint32_t( (unsigned long long)(p->y() - y0)*xw +
+				 (p->x() - x0) );
+
+  return i;
+}
+
+void bin_store::collect_garbage()
+{
+  // entries in the order they are stored
+  std::vector<size_t> order;
+  for( size_t i = 0; i != _entries.size(); ++i )
+    if( _entries[i].points + _entries[i].edges != 0 )
+      order.push_back( i );
+  std::sort( order.begin(), order.end(),
+	     [this](size_t a, size_t b)
+	     { return _entries[a].offset < _entries[b].offset; } );
+
+  size_t out = 0;
+  for( std::vector<size_t>::const_iterator i = order.begin();
+       i != order.end(); ++i )
+    {
+      entry& e = _entries[*i];
+      const size_t n = e.points + e.edges;
+      for( size_t j = 0; j != n; ++j )
+	pixel(out+j) = pixel(e.offset+j);
+      e.offset = out;
+      out += n;
+    }
+
+  _used = out;
+  _garbage = 0;
+  _blocks.resize( (_used + block_size - 1) >> block_bits );
+}
+
+void bin::write_state(checkpoint_file& file) const
+{
+  file.put( _bin_no );
+  if( _packed )
+    {
+      // save as if expanded
+      _Pt_container points, edge_points;
+      std::vector<unsigned> edge_order;
+      unpack_lists( points, edge_points, edge_order );
+      file.put_vector( points );
+      file.put_vector( edge_points );
+      file.put_vector( edge_order );
+      file.put( unsigned(edge_points.size()) );
+      file.put( size_t(0) );
+    }
+  else
+    {
+      file.put_vector( _all_points );
+      file.put_vector( _edge_points );
+      file.put_vector( _edge_order );
+      file.put( _edge_counter );
+      file.put( _edge_holes );
+    }
+  file.put( _aimval );
+  file.put( _fg_sum );
+  file.put( _bg_sum );
+  file.put( _bg_sum_weight );
+  file.put( _noisemap_2_sum );
+  file.put( _expratio_sum_2 );
+  file.put( _centroid_sum );
+  file.put( _centroid_weight );
+  file.put( _count );
+}
+
+void bin::read_state(checkpoint_file& file)
+{
+  file.get( &_bin_no );
+  file.get_vector( &_all_points );
+  file.get_vector( &_edge_points );
+  file.get_vector( &_edge_order );
+  file.get( &_edge_counter );
+  file.get( &_edge_holes );
+  file.get( &_aimval );
+  file.get( &_fg_sum );
+  file.get( &_bg_sum );
+  file.get( &_bg_sum_weight );
+  file.get( &_noisemap_2_sum );
+  file.get( &_expratio_sum_2 );
+  file.get( &_centroid_sum );
+  file.get( &_centroid_weight );
+  file.get( &_count );
+
+  // put the pixels back into the images
+  paint_bins_image();
+  index_points();
+}
+
+// add the free neighbours of a newly added pixel to the frontier
+void bin::add_to_frontier(const int x, const int y, const unsigned seq)
 {
-  // easier access to images
-  const int xw = _helper->xw();
-  const int yw = _helper->yw();
   const image_short& mask_image = *_helper->mask_image();
   const image_long& bins_image = *_helper->bins_image();
   const image_float& smoothed_image = *_helper->smoothed_image();
+
+  for( size_t n = 0; n != bin_no_neigh; ++n )
+    {
+      const int xp = x + bin_neigh_x[n];
+      const int yp = y + bin_neigh_y[n];
+
+      // (pixels in the border are masked)
+      if( bins_image(xp, yp) < 0 && mask_image(xp, yp) == 1 )
+	{
+	  frontier_point fp;
+	  fp.delta = fabs( smoothed_image(xp, yp) - _aimval );
+	  fp.seq = seq;
+	  fp.n = n;
+	  fp.x = xp; fp.y = yp;
+
+	  _frontier.push_back(fp);
+	  std::push_heap( _frontier.begin(), _frontier.end(),
+			  frontier_later );
+	}
+    }
+}
+
+// adds the next pixel to the bin!
+// This picks the same pixel as scanning the neighbours of the edge
+// points in order for the one nearest in value to aimval, as the
+// frontier is ordered by the value, then the position in the scan.
+bool bin::add_next_pixel()
+{
+  const image_long& bins_image = *_helper->bins_image();
   const bool constrain_fill = _helper->constrain_fill();
 
-  // find pixel nearest in value to aimval, looking around the edge pixels
-  // of the bin
-  double delta = 1e99;
+  // pixels which fail the constraint now, but might pass later
+  _frontier_vector& failed = thread_arena().failed;
+  failed.clear();
+
   int bestx = -1;
   int besty = -1;
-
-  // iterate over the proper edge points
-  //const bool toolarge = calc_length_ratio() > constrain_val;
-  size_t pix = 0;
-  while( pix < _edge_points.size() )
+  while( ! _frontier.empty() )
     {
-      // where the pixel is
-      const int x = _edge_points[pix].x();
-      const int y = _edge_points[pix].y();
+      std::pop_heap( _frontier.begin(), _frontier.end(), frontier_later );
+      const frontier_point fp = _frontier.back();
+      _frontier.pop_back();
 
-      // check whether point is edge
-      bool is_edge = false;
+      // pixel was taken since it was added
+      if( bins_image(fp.x, fp.y) >= 0 )
+	continue;
 
-      // iterate over neighbours, looking for any better than we have
-      for( size_t n = 0; n != bin_no_neigh; ++n )
+      if( constrain_fill && ! check_constraint(fp.x, fp.y) )
 	{
-	  const int xp = x + bin_neigh_x[n];
-	  const int yp = y + bin_neigh_y[n];
-
-	  if( xp >= 0 && yp >= 0 && xp < xw && yp < yw )
-	    {
-	      const long bin = bins_image(xp, yp);
-	      if( bin != _bin_no )
-		is_edge = true;
-
-	      // this pixel isn't taken
-	      if( bin < 0 && mask_image(xp, yp) == 1 )
-		{
-		  if ( ! constrain_fill || check_constraint(xp, yp) )
-		    {
-		      const double newdelta = fabs( smoothed_image(xp, yp) -
-						    _aimval );
-		      if( newdelta < delta )
-			{
-			  delta = newdelta;
-			  bestx = xp; besty = yp;
-			}
-		    }
-		} // pixel not taken
-	    } // if in image
-
-	} // loop over neighbours
-
-      // go to next point (removing current point if not edge)
-      if( is_edge )
-	++pix;
-      else
-        _edge_points.erase(_edge_points.begin() + pix);
+	  failed.push_back(fp);
+	  continue;
+	}
+
+      bestx = fp.x; besty = fp.y;
+      break;
+    }
 
-    } // loop over edge pixels in bin
+  // put back the ones which failed
+  for( _frontier_vector::const_iterator i = failed.begin();
+       i != failed.end(); ++i )
+    {
+      _frontier.push_back(*i);
+      std::push_heap( _frontier.begin(), _frontier.end(), frontier_later );
+    }
 
   // we didn't find any nice neighbours
   if( bestx == -1 )
@@ -311,26 +657,109 @@ bool bin::add_next_pixel()
       return false;
     }
 
+  // the bin has grown out of its window
+  if( bestx < _win_x0 || bestx > _win_x1 ||
+      besty < _win_y0 || besty > _win_y1 )
+    {
+      _overflowed = true;
+      return false;
+    }
+
   // update stuff
   add_point( bestx, besty );
+  add_to_frontier( bestx, besty, _all_points.size()-1 );
 
   return true;
 }
 
+// remove points which are not on the edge of the bin from the edge
+// list. If last_added is set, treat that point as not in the bin yet,
+// so the list is the same as if it was pruned before adding it.
+void bin::prune_edge_points(const point_int* last_added)
+{
+  const image_long& bins_image = *_helper->bins_image();
+
+  for( size_t i = 0; i != _edge_points.size(); ++i )
+    {
+      const point_int pix = _edge_points[i];
+      if( is_edge_hole(pix) )
+	continue;
+
+      bool is_edge = last_added != 0 && pix == *last_added;
+
+      for( size_t n = 0; n != bin_no_neigh && ! is_edge; ++n )
+	{
+	  const int xp = pix.x() + bin_neigh_x[n];
+	  const int yp = pix.y() + bin_neigh_y[n];
+
+	  // pixels outside the image do not make an edge
+	  const long nbin = bins_image(xp, yp);
+	  if( ( nbin != _bin_no && nbin != bin_border ) ||
+	      ( last_added != 0 && point_int(xp, yp) == *last_added ) )
+	    is_edge = true;
+	}
+
+      if( ! is_edge )
+	remove_edge_point(i);
+    }
+
+  compact_edge_points();
+}
+
 // do the binning until the threshold reached
 void bin::do_binning(const unsigned x, const unsigned y)
 {
+  // take the empty buffers from the arena to grow into
+  arena& a = thread_arena();
+  _all_points.swap( a.all_points );
+  _edge_points.swap( a.edge_points );
+  _edge_order.swap( a.edge_order );
+  _frontier.swap( a.frontier );
+
   _aimval = (*_helper->smoothed_image())(x, y);
   add_point(x, y);
 
   const double sn_threshold_2 = _helper->threshold()*_helper->threshold();
-
-  // keep adding pixels until add_next_pixel complains, or s/n reached
-  while( sn_2() < sn_threshold_2 )
+  if( sn_2() < sn_threshold_2 )
     {
-      if( ! add_next_pixel() )
-	break;
+      add_to_frontier(x, y, 0);
+
+      // keep adding pixels until add_next_pixel complains, or s/n reached
+      bool added = true;
+      while( sn_2() < sn_threshold_2 )
+	{
+	  added = add_next_pixel();
+	  if( ! added )
+	    break;
+	}
+
+      // drop the edge points which are now inside the bin
+      if( added )
+	{
+	  const point_int last = _all_points.back();
+	  prune_edge_points(&last);
+	}
+      else
+	{
+	  prune_edge_points(0);
+	}
     }
+
+  // keep the lists in compact storage, and give the buffers back
+  _frontier.clear();
+  _frontier.swap( a.frontier );
+  return_to_arena( _all_points, a.all_points );
+  return_to_arena( _edge_points, a.edge_points );
+  return_to_arena( _edge_order, a.edge_order );
+}
+
+void bin::set_points(const _Pt_container& points)
+{
+  for( _Pt_container::const_iterator p = points.begin();
+       p != points.end(); ++p )
+    add_point( p->x(), p->y() );
+
+  prune_edge_points(0);
 }
 
 // is the constraint still satisfied if we add this pixel?
@@ -3,10 +3,14 @@
 
 #include <list>
 #include <vector>
+#include <cassert>
+#include <cstdint>
 
 #include "misc.hh"
 #include "point.hh"
 
+class checkpoint_file;
+
 // const size_t bin_no_neigh = 8;
 // const int bin_neigh_x[bin_no_neigh] = {  0, -1, 1, 0, 1, 1, -1, -1 };
 // const int bin_neigh_y[bin_no_neigh] = { -1,  0, 0, 1, 1,-1, 1, -1  };
@@ -15,6 +19,12 @@ const size_t bin_no_neigh = 4;
 const int bin_neigh_x[bin_no_neigh] = {  0, -1, 1, 0 };
 const int bin_neigh_y[bin_no_neigh] = { -1,  0, 0, 1 };
 
+// The bins image and mask have a border of one pixel, so the
+// neighbours of any pixel can be looked at without checking whether
+// they are in the image. The border of the bins image has this value,
+// and the border of the mask is 0.
+const long bin_border = -2;
+
 // simple squaring function
 template<class T> inline T square(T v)
 {
@@ -28,6 +38,105 @@ inline double error_sqd_est(double c)
   return square( 1. + sqrt(c + 0.75) );
 }
 
+// sums over the pixels of a bin (or of a group of bins), from which
+// the signal and noise are found
+struct bin_sums
+{
+  bin_sums()
+    : fg(0), bg(0), bg_weight(0), noisemap_2(0), expratio_2(0), count(0)
+  {
+  }
+
+  bin_sums& operator+=(const bin_sums& o)
+  {
+    fg += o.fg; bg += o.bg; bg_weight += o.bg_weight;
+    noisemap_2 += o.noisemap_2; expratio_2 += o.expratio_2;
+    count += o.count;
+    return *this;
+  }
+
+  double signal() const { return fg - bg_weight; }
+
+  double fg;          // foreground counts
+  double bg;          // background counts
+  double bg_weight;   // sum of the background*expratio
+  double noisemap_2;  // sum of square of values from noisemap
+  double expratio_2;  // sum of expratio^2
+  unsigned long count;
+};
+
+// Pixels of bins which are not being changed, packed together. Each
+// bin has an entry with a 64 bit offset into the pixel array, where
+// its points and then its edge points are kept in order, each as a 32
+// bit index within the bounding box of the bin. This is half the size
+// of lists of points. The array is made of blocks, so storing more bins
+// does not copy the ones already there. When a bin is stored again,
+// its old pixels are left as garbage, which is cleared out once there
+// is more garbage than pixels in use.
+class bin_store
+{
+public:
+  bin_store() : _used(0), _garbage(0) {}
+
+  // Store the points and edge points (without holes) of a bin in entry
+  // i, or a new entry if i < 0, and return the entry. If the bounding
+  // box has too many pixels for 32 bit indices, entry i is emptied and
+  // -1 returned.
+  long set( long i, const std::vector<point_int>& points,
+	    const std::vector<point_int>& edge_points );
+
+  size_t count( const size_t i ) const { return _entries[i].points; }
+  size_t edge_count( const size_t i ) const { return _entries[i].edges; }
+
+  // call fn(x, y) for each point of entry i
+  template<class F> void for_each_point( const size_t i, F fn ) const
+  {
+    const entry& e = _entries[i];
+    for_each_pixel( e, e.offset, e.offset+e.points, fn );
+  }
+  // call fn(x, y) for each edge point of entry i, in order
+  template<class F> void for_each_edge_point( const size_t i, F fn ) const
+  {
+    const entry& e = _entries[i];
+    for_each_pixel( e, e.offset+e.points, e.offset+e.points+e.edges, fn );
+  }
+
+private:
+  struct entry
+  {
+    size_t offset, points, edges;
+    int x0, y0;
+    unsigned xw;
+  };
+
+  static const unsigned block_bits = 18;
+  static const size_t block_size = size_t(1) << block_bits;
+
+  uint32_t& pixel( const size_t j )
+  {
+    return _blocks[j >> block_bits][j & (block_size-1)];
+  }
+
+  template<class F> void for_each_pixel( const entry& e, size_t j,
+					 const size_t end, F fn ) const
+  {
+    for( ; j != end; ++j )
+      {
+	const uint32_t p = _blocks[j >> block_bits][j & (block_size-1)];
+	fn( e.x0 + int(p % e.xw), e.y0 + int(p / e.xw) );
+      }
+  }
+
+  // move the entries down over the garbage
+  void collect_garbage();
+
+private:
+  std::vector<entry> _entries;
+  std::vector< std::vector<uint32_t> > _blocks;
+  size_t _used;     // end of the pixels written
+  size_t _garbage;  // pixels before this not in an entry
+};
+
 // keep track of the parameters for the bin class
 class bin_helper
 {
@@ -53,7 +162,19 @@ public:
 
   void set_mask( const image_short* mask_image )
   {
-    _mask_image = *mask_image;
+    // copy inside the border
+    for( unsigned y = 0; y != _yw; ++y )
+      for( unsigned x = 0; x != _xw; ++x )
+	_mask_image(x, y) = (*mask_image)(x, y);
+  }
+
+  // mask out the pixels where region is zero
+  void restrict_mask( const image_short& region )
+  {
+    for( unsigned y = 0; y != _yw; ++y )
+      for( unsigned x = 0; x != _xw; ++x )
+	if( region(x, y) == 0 )
+	  _mask_image(x, y) = 0;
   }
 
   void set_constrain_fill( bool constrain_fill, double constrain_val )
@@ -67,9 +188,28 @@ public:
     _scrub_large_bins = fraction;
   }
 
-public:
-  typedef std::vector<point_int> point_vec;
-  typedef std::vector<point_vec> point_vec_vec;
+  void set_bulk_scrub( bool bulk_scrub )
+  {
+    _bulk_scrub = bulk_scrub;
+  }
+
+  // number bins along a Hilbert curve when renumbering
+  void set_hilbert_order( bool hilbert_order )
+  {
+    _hilbert_order = hilbert_order;
+  }
+
+  // scrub independent bins in batches using threads (0 is serial)
+  void set_scrub_threads( unsigned threads )
+  {
+    _scrub_threads = threads;
+  }
+
+  // show progress while binning and scrubbing
+  void set_verbose( bool verbose )
+  {
+    _verbose = verbose;
+  }
 
 public:
   // accessors
@@ -91,26 +231,126 @@ public:
   bool constrain_fill() const { return _constrain_fill; }
   double constrain_val() const { return _constrain_val; }
   double scrub_large_bins() const { return _scrub_large_bins; }
+  bool bulk_scrub() const { return _bulk_scrub; }
+  bool hilbert_order() const { return _hilbert_order; }
+  unsigned scrub_threads() const { return _scrub_threads; }
+  bool verbose() const { return _verbose; }
 
-  // get the pixels at a particular radius
-  const point_vec& points_at_annuli(const unsigned r) const
-  { return _annuli_points[r]; }
+  // sums for the pixel at x, y (as added by bin::add_point)
+  bin_sums pixel_sums( const int x, const int y ) const
+  {
+    return pixel_sums( *_in_image, _back_image, _expmap_image,
+		       _bg_expmap_image, _noisemap_image, x, y );
+  }
+  // the same for any set of images (e.g. another band), where back,
+  // noisemap and expmap may be 0 (an expmap of 0 is taken as 1, and
+  // bg_expmap is needed if there is a background)
+  static bin_sums pixel_sums( const image_float& in,
+			      const image_float* back,
+			      const image_float* expmap,
+			      const image_float* bg_expmap,
+			      const image_float* noisemap,
+			      const int x, const int y )
+  {
+    bin_sums s;
+    s.fg = in(x, y);
+    s.count = 1;
+    if( back != 0 )
+      {
+	const double bs = ( expmap != 0 ? (*expmap)(x, y) : 1. ) /
+	  (*bg_expmap)(x, y);
+	s.bg = (*back)(x, y);
+	s.bg_weight = s.bg*bs;
+	s.expratio_2 = bs*bs;
+      }
+    if( noisemap != 0 )
+      s.noisemap_2 = square( (*noisemap)(x, y) );
+    return s;
+  }
+
+  // noise squared and signal:noise squared of pixels with these sums
+  double noise_2( const bin_sums& s ) const
+  {
+    return noise_2( s, _back_image != 0, _noisemap_image != 0 );
+  }
+  double sn_2( const bin_sums& s ) const
+  {
+    return sn_2( s, _back_image != 0, _noisemap_image != 0 );
+  }
+  // the same, with a background image if has_bg and a noisemap if
+  // has_noisemap
+  static double noise_2( const bin_sums& s, const bool has_bg,
+			 const bool has_noisemap )
+  {
+    if( ! has_noisemap )
+      {
+	// using background image
+	return counts_noise_2( s, has_bg );
+      }
+    else
+      {
+	// using noisemap
+	return s.noisemap_2;
+      }
+  }
+  // noise squared of counts with these sums, with a background if
+  // has_bg (not using the noisemap)
+  static double counts_noise_2( const bin_sums& s, const bool has_bg )
+  {
+    double n = error_sqd_est(s.fg);
+
+    if( has_bg )
+      n += (s.expratio_2 / s.count) * error_sqd_est(s.bg);
+
+    return n;
+  }
+  static double sn_2( const bin_sums& s, const bool has_bg,
+		      const bool has_noisemap )
+  {
+    const double csignal = s.signal();
+    const double cnoise_2 = noise_2( s, has_bg, has_noisemap );
+
+    if( cnoise_2 < 1e-7 )
+      return 1e-7;
+    else
+      return csignal*csignal / cnoise_2;
+  }
 
   // return the next number for a bin
   long bin_counter() { const long t = _bin_counter; ++_bin_counter; return t; }
 
   // return how many bins have been processed
   long no_bins() const { return _bin_counter; }
+  // forget bins numbered no and above (which have been rolled back)
+  void set_no_bins(const long no) { _bin_counter = no; }
+
+  // index of each binned pixel in its bin's list of points, which is
+  // only made once bins can lose pixels (0 before then)
+  image_int* point_slots()
+  {
+    return _point_slots.xw() == 0 ? 0 : &_point_slots;
+  }
+  void make_point_slots() { _point_slots = image_int( _xw, _yw, -1 ); }
+  // index of each pixel in its bin's list of edge points (or -1)
+  image_int* edge_slots() { return &_edge_slots; }
+  // free the slot images, once bins are no longer changed
+  void release_slots()
+  {
+    _point_slots = image_int(0, 0);
+    _edge_slots = image_int(0, 0);
+  }
 
-  unsigned get_radius_for_area(unsigned area) const
+  // pixels of the bins which have been compacted
+  bin_store* store() { return &_store; }
+  const bin_store* store() const { return &_store; }
+
+  unsigned get_radius_for_area(unsigned long area) const
   {
     return std::upper_bound(_areas.begin(), _areas.end(), area) -
       _areas.begin();
   }
 
 private:
-  // store whichs pixels line in an annuli with a particular radius
-  void precalculate_annuli();
   // areas corresponding to each radius
   void precalculate_areas();
 
@@ -129,15 +369,22 @@ private:
   const image_float* _noisemap_image;
   image_short _mask_image;
 
+  image_int _point_slots;
+  image_int _edge_slots;
+  bin_store _store;
+
   const unsigned _max_annuli;
-  point_vec_vec _annuli_points;
-  std::vector<unsigned> _areas;
+  std::vector<unsigned long> _areas;
 
   long _bin_counter;
 
   bool _constrain_fill;
   double _constrain_val;
   double _scrub_large_bins;
+  bool _bulk_scrub;
+  bool _hilbert_order;
+  unsigned _scrub_threads;
+  bool _verbose;
 };
 
 ////////////////////////////////////////////////////////////////////////////
@@ -153,8 +400,30 @@ public:
   // start bin with the specified pixel
   void do_binning(const unsigned x, const unsigned y);
 
+  // Only allow pixels in the box x0..x1, y0..y1 to be added. If the
+  // bin needs to grow outside, binning stops and overflowed() is set.
+  // The bin then only looks at pixels inside the box and next to it.
+  void set_window(const int x0, const int y0, const int x1, const int y1)
+  {
+    _win_x0 = x0; _win_y0 = y0; _win_x1 = x1; _win_y1 = y1;
+  }
+  bool overflowed() const { return _overflowed; }
+
+  // remove bin from the images, as if it had not been grown
+  void rollback();
+
   // return number of counts binned
-  unsigned count() const { return _count; }
+  unsigned long count() const { return _count; }
+
+  // sums over the pixels in the bin
+  bin_sums sums() const
+  {
+    bin_sums s;
+    s.fg = _fg_sum; s.bg = _bg_sum; s.bg_weight = _bg_sum_weight;
+    s.noisemap_2 = _noisemap_2_sum; s.expratio_2 = _expratio_sum_2;
+    s.count = _count;
+    return s;
+  }
 
   // get signal in bin
   double signal() const
@@ -165,33 +434,13 @@ public:
   // get noise in bin
   double noise_2() const
   {
-    if( _helper->noisemap_image() == 0 )
-      {
-	// using background image
-	double n = error_sqd_est(_fg_sum);
-
-	if( _helper->back_image() != 0 )
-	  n += (_expratio_sum_2 / _count) * error_sqd_est(_bg_sum);
-
-	return n;
-      }
-    else
-      {
-	// using noisemap
-	return _noisemap_2_sum;
-      }
+    return _helper->noise_2( sums() );
   }
 
   // get signal : noise squared
   double sn_2() const
   {
-    const double csignal = signal();
-    const double cnoise_2 = noise_2();
-
-    if( cnoise_2 < 1e-7 )
-      return 1e-7;
-    else
-      return csignal*csignal / cnoise_2;
+    return _helper->sn_2( sums() );
   }
 
   // calculate ratio of edge length / a circle of same area
@@ -203,10 +452,61 @@ public:
   typedef _point_vector _Pt_container;
 
   // get list of all pojnts in bin
-  _Pt_container& get_all_points() { return _all_points; }
+  const _Pt_container& get_all_points() const
+  {
+    assert( ! compacted() );
+    return _all_points;
+  }
+
+  // call fn(x, y) for each point in bin, even if compacted
+  template<class F> void for_each_point( F fn ) const
+  {
+    if( compacted() )
+      _helper->store()->for_each_point( _store_index, fn );
+    else
+      for( _Pt_container::const_iterator p = _all_points.begin();
+	   p != _all_points.end(); ++p )
+	fn( p->x(), p->y() );
+  }
+
+  // Move the points and edge points of a bin which is not changing
+  // into the bin store of the helper, freeing its lists. Points cannot
+  // be added or removed until it is expanded again. Bins too large for
+  // the store keep their lists.
+  void compact();
+  bool compacted() const { return _packed; }
+  // get the lists back from the store (which keeps the old entry
+  // until the bin is compacted again)
+  void expand();
+  // entry of the bin in the store (or -1)
+  long store_index() const { return _store_index; }
+
+  // set the slots of the points and edge points in the helper
+  void index_points();
 
   // get list of all points on edge of bin
-  _Pt_container& get_edge_points() { return _edge_points; }
+  // (removed points are left as holes, with negative coordinates)
+  const _Pt_container& get_edge_points() const
+  {
+    assert( ! compacted() );
+    return _edge_points;
+  }
+
+  // is an entry in the edge list a hole?
+  static bool is_edge_hole(const point_int& p) { return p.x() < 0; }
+
+  // remove point from the edge list, leaving a hole (so the indices
+  // of the other edge points do not change)
+  void remove_edge_point(const size_t index);
+
+  // order of an edge point in the edge list, which is unchanged when
+  // the list is compacted
+  unsigned edge_order(const int x, const int y) const
+  {
+    const int slot = (*_helper->edge_slots())(x, y);
+    assert( slot >= 0 );
+    return _edge_order[slot];
+  }
 
   // get bin number
   long bin_no() const { return _bin_no; }
@@ -217,11 +517,53 @@ public:
   void add_point( const int x, const int y );
   void remove_point( const int x, const int y );
 
+  // make the bin from these pixels, rather than growing it
+  void set_points( const _Pt_container& points );
+
   // paint bin onto bins image
   void paint_bins_image() const;
 
+  // save the state of a grown bin to a checkpoint, or restore it
+  // (including its pixels in the bins image)
+  void write_state(checkpoint_file& file) const;
+  void read_state(checkpoint_file& file);
+
 private:
+  // candidate pixel next to a growing bin, found from the neighbour
+  // n of the bin pixel which was added seq'th
+  struct frontier_point
+  {
+    double delta;
+    unsigned seq, n;
+    int x, y;
+  };
+  typedef std::vector<frontier_point> _frontier_vector;
+
+  // heap order: smallest delta first, then in order of edge scan
+  static bool frontier_later(const frontier_point& a,
+			     const frontier_point& b)
+  {
+    if( a.delta != b.delta ) return a.delta > b.delta;
+    if( a.seq != b.seq ) return a.seq > b.seq;
+    return a.n > b.n;
+  }
+
   bool add_next_pixel();
+  void add_to_frontier(const int x, const int y, const unsigned seq);
+  void prune_edge_points(const point_int* last_added);
+
+  void add_edge_point(const int x, const int y);
+  // remove holes in edge list if there are too many
+  void compact_edge_points();
+
+  // get the lists of a compacted bin from the store, numbering the
+  // edge points in order
+  void unpack_lists(_Pt_container& points, _Pt_container& edge_points,
+		    std::vector<unsigned>& edge_order) const;
+
+  // buffers reused by the bins grown in each thread
+  struct arena;
+  static arena& thread_arena();
 
 private:
   // helper things for binning
@@ -232,8 +574,18 @@ private:
 
   // keep track of points on the edge of the bin
   _Pt_container _edge_points;
+  std::vector<unsigned> _edge_order;
+  unsigned _edge_counter;
+  size_t _edge_holes;
   // keep track of all the points
   _Pt_container _all_points;
+  // entry in the bin store (-1 if none), and whether the lists are
+  // kept there
+  long _store_index;
+  bool _packed;
+
+  // heap of unbinned pixels next to the bin while growing
+  _frontier_vector _frontier;
 
   // pixel value we try to aim for
   double _aimval;
@@ -248,7 +600,11 @@ private:
   // centroid
   point_dbl _centroid_sum;
   double _centroid_weight;
-  unsigned _count;
+  unsigned long _count;
+
+  // box pixels can be added in, and whether we tried to leave it
+  int _win_x0, _win_y0, _win_x1, _win_y1;
+  bool _overflowed;
 };
 
 typedef std::vector<bin> bin_vector;
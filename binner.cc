@@ -2,9 +2,15 @@
 #include <string>
 #include <iomanip>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <map>
 #include <algorithm>
+#include <limits>
 #include <cassert>
 #include <iostream>
+#include <atomic>
+#include <thread>
 
 #include "binner.hh"
 #include "scrubber.hh"
@@ -17,81 +23,108 @@ binner::binner( const image_float* in_image,
 		const image_float* smoothed_image,
 		double threshold )
   : _xw(in_image->xw()), _yw(in_image->yw()),
-    _bins_image( _xw, _yw, -1 ),
+    _bins_image( _xw, _yw, -1, 1, bin_border ),
     _binned_image( _xw, _yw ),
     _sn_image( _xw, _yw ),
 
     _bin_helper( in_image, smoothed_image, &_bins_image, threshold ),
-    _bin_counter( 0 )
+    _bin_counter( 0 ),
+    _threads( 1 ),
+    _sorted_down( true ),
+    _bin_down( true ),
+    _incremental( false ),
+    _next_number( 0 ),
+    _numbered( false ),
+    _resumed( false ),
+    _resume_stage( stage_binning ),
+    _resume_posn( 0 )
 {
 }
 
-// class sorts pixels in reverse order (or order)
-// based on their value in an image
-class _flux_sort_points
+namespace
 {
-public:
-  _flux_sort_points(const image_float& im, bool bindown = true)
-    : _im(im), _bindown(bindown)
+  // pixel with its smoothed value, so the sort does not look up the
+  // image for each comparison
+  struct sort_item
   {
-  }
+    float val;
+    point_int pix;
+  };
 
-  bool operator() ( const point_ushort p1,
-		    const point_ushort p2 ) const
+  // sorts items in reverse order (or order) of their values
+  class _flux_sort_items
   {
-    const float a = _im(p1.x(), p1.y());
-    const float b = _im(p2.x(), p2.y());
-
-    // order according to binning direction
-    if( _bindown )
-      return a > b;
-    else
-      return a < b;
-  }
+  public:
+    _flux_sort_items(bool bindown = true)
+      : _bindown(bindown)
+    {
+    }
 
-private:
-  const image_float& _im;
-  const bool _bindown;
-};
+    bool operator() ( const sort_item& i1, const sort_item& i2 ) const
+    {
+      // order according to binning direction
+      if( _bindown )
+	return i1.val > i2.val;
+      else
+	return i1.val < i2.val;
+    }
+
+  private:
+    const bool _bindown;
+  };
+}
 
 // sort pixels into reverse flux order
 void binner::sort_pixels(const bool bin_down)
 {
-  std::cout << "(i) Sorting pixels, binning from ";
-  if(bin_down)
-    std::cout << "top";
-  else
-    std::cout << "bottom";
-  std::cout << "...";
-  std::cout.flush();
-
-  // add all pixels in image
+  const bool verbose = _bin_helper.verbose();
+  if( verbose )
+    {
+      std::cout << "(i) Sorting pixels, binning from ";
+      if(bin_down)
+	std::cout << "top";
+      else
+	std::cout << "bottom";
+      std::cout << "...";
+      std::cout.flush();
+    }
+
+  // add all pixels in image, with their values
   const image_short& in_mask = *_bin_helper.mask_image();
-  _sorted_pixels.clear();
+  const image_float& smoothed = *_bin_helper.smoothed_image();
+  std::vector<sort_item> items;
 
   for(unsigned y=0; y != _yw; ++y)
     for(unsigned x=0; x != _xw; ++x)
       {
 	if( in_mask(x, y) >= 1 )
-	  _sorted_pixels.push_back( point_ushort(x, y) );
+	  {
+	    sort_item item;
+	    item.val = smoothed(x, y);
+	    item.pix = point_int(x, y);
+	    items.push_back( item );
+	  }
       }
 
   // sort in reverse flux order
-  std::sort( _sorted_pixels.begin(), _sorted_pixels.end(),
-	     _flux_sort_points(*_bin_helper.smoothed_image(), bin_down) );
+  std::sort( items.begin(), items.end(), _flux_sort_items(bin_down) );
 
-  // this is where we are in the list of sorted pixels
-  _sorted_pix_posn = _sorted_pixels.begin();
+  std::shared_ptr<_Pt_sorted_vec> sorted( new _Pt_sorted_vec( items.size() ) );
+  for( size_t i = 0; i != items.size(); ++i )
+    (*sorted)[i] = items[i].pix;
+  _sorted_pixels = sorted;
+  _sorted_down = bin_down;
 
-  std::cout << " Done.\n";
+  if( verbose )
+    std::cout << " Done.\n";
 }
 
 // get number of unmasked pixels
-unsigned binner::no_unmasked_pixels() const
+unsigned long binner::no_unmasked_pixels() const
 {
   const image_short& in_mask = *_bin_helper.mask_image();
 
-  unsigned no_unmasked = 0;
+  unsigned long no_unmasked = 0;
   for(unsigned y=0; y<_yw; ++y)
     for(unsigned x=0; x<_xw; ++x)
       {
@@ -107,14 +140,14 @@ point_int binner::find_next_pixel()
   const image_long& in_bins = *_bin_helper.bins_image();
 
   // iterate through sorted list until there are no pixels
-  while( _sorted_pix_posn != _sorted_pixels.end() )
+  while( _sorted_pix_posn != _sorted_pixels->end() )
     {
-      point_ushort p( *_sorted_pix_posn );
+      const point_int p( *_sorted_pix_posn );
 
       // is pixel unbinned?
       if( in_bins(p.x(), p.y()) < 0 )
 	{
-	  return point_int( p.x(), p.y() );
+	  return p;
 	}
 
       ++ _sorted_pix_posn;
@@ -123,13 +156,151 @@ point_int binner::find_next_pixel()
   return point_int(-1, -1);
 }
 
+// show the number of bins made so far
+static void show_progress(const long counter, const double percent)
+{
+  if( counter % 10 == 0 && counter > 0)
+    {
+      std::cout << std::setw(5) << counter << ' ';
+      std::cout.flush();
+      if( counter % 100 == 0 )
+	{
+	  std::cout.setf(std::ios::fixed);
+	  std::cout << " [" << std::setprecision(1)
+		    << percent
+		    << "%]\n";
+	}
+    }
+}
+
+// Grow bins from the next seed pixels at the same time. Seeds are
+// taken in order until one is too close to those already taken. Each
+// bin is only allowed to grow inside a window around its seed, and
+// the windows do not overlap, so the bins cannot affect each other.
+// The bins are kept in order until one grows out of its window. That
+// bin and the ones after are rolled back, as growing that bin further
+// could change the others. This gives the same bins as growing them
+// one by one.
+bool binner::grow_bins_parallel(unsigned long& pix_counter,
+				const unsigned long no_unmasked)
+{
+  const image_long& in_bins = *_bin_helper.bins_image();
+
+  // make the windows several times the size of recent bins
+  unsigned long maxcount = 1;
+  for( size_t i = _bins.size() > 16 ? _bins.size()-16 : 0;
+       i < _bins.size(); ++i )
+    maxcount = std::max( maxcount, _bins[i].count() );
+  const int halfw = int( 2*std::sqrt(double(maxcount)) ) + 2;
+
+  // find the seeds, which need windows (plus their borders) apart
+  std::vector<point_int> seeds;
+  const size_t maxseeds = 8*size_t(_threads);
+  for( _Pt_sorted_vec::const_iterator i = _sorted_pix_posn;
+       i != _sorted_pixels->end() && seeds.size() != maxseeds; ++i )
+    {
+      if( in_bins(i->x(), i->y()) >= 0 )
+	continue;
+
+      bool close = false;
+      for( std::vector<point_int>::const_iterator s = seeds.begin();
+	   s != seeds.end() && ! close; ++s )
+	close = std::abs( s->x() - i->x() ) <= 2*halfw &&
+	  std::abs( s->y() - i->y() ) <= 2*halfw;
+      if( close )
+	break;
+
+      seeds.push_back( *i );
+    }
+
+  if( seeds.size() < 2 )
+    return false;
+
+  // make the bins in order, so they are numbered as if grown serially
+  const long first_no = _bin_helper.no_bins();
+  bin_vector newbins;
+  newbins.reserve( seeds.size() );
+  for( std::vector<point_int>::const_iterator s = seeds.begin();
+       s != seeds.end(); ++s )
+    {
+      newbins.push_back( bin(&_bin_helper) );
+      newbins.back().set_window( s->x()-halfw+1, s->y()-halfw+1,
+				 s->x()+halfw-1, s->y()+halfw-1 );
+    }
+
+  // grow them
+  {
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+      {
+	for( size_t i = next++; i < seeds.size(); i = next++ )
+	  newbins[i].do_binning( seeds[i].x(), seeds[i].y() );
+      };
+
+    // this thread does some of the work too
+    const size_t nthreads = std::min( size_t(_threads), seeds.size() );
+    std::vector<std::thread> threads;
+    for( size_t t = 1; t < nthreads; ++t )
+      threads.push_back( std::thread(worker) );
+    worker();
+    for( auto& t : threads )
+      t.join();
+  }
+
+  // keep the bins up to the first which left its window
+  for( size_t i = 0; i != newbins.size(); ++i )
+    {
+      if( newbins[i].overflowed() )
+	{
+	  for( size_t j = i; j != newbins.size(); ++j )
+	    newbins[j].rollback();
+	  _bin_helper.set_no_bins( first_no + i );
+	  return false;
+	}
+
+      if( _bin_helper.verbose() )
+	show_progress( first_no + i, pix_counter*100./no_unmasked );
+      pix_counter += newbins[i].count();
+      add_bin( newbins[i] );
+    }
+
+  return true;
+}
+
 void binner::do_binning(const bool bin_down)
 {
+  if( _resumed )
+    {
+      if( bin_down != _bin_down )
+	{
+	  std::cerr << "(!) Checkpoint was made binning in the other "
+	    "direction (--binup)\n";
+	  std::exit(1);
+	}
+      if( _resume_stage != stage_binning )
+	{
+	  if( _bin_helper.verbose() )
+	    std::cout << "(i) Binning restored from checkpoint ("
+		      << _bin_counter << " bins)\n";
+	  return;
+	}
+    }
+  _bin_down = bin_down;
+
+  const bool verbose = _bin_helper.verbose();
+
   // so we can interrupt binning
-  terminal T;
+  delete_ptr<terminal> T;
+  if( verbose )
+    T = new terminal;
 
-  // sort pixels into flux order to find starting pixels
-  sort_pixels(bin_down);
+  // sort pixels into flux order to find starting pixels, unless this
+  // has been done already
+  if( ! _sorted_pixels || _sorted_down != bin_down )
+    sort_pixels(bin_down);
+  _sorted_pix_posn = _sorted_pixels->begin();
+  if( _resumed )
+    _sorted_pix_posn += _resume_posn;
 
   const image_float* in_image = _bin_helper.in_image();
   const image_float* in_back = _bin_helper.back_image();
@@ -141,90 +312,880 @@ void binner::do_binning(const bool bin_down)
   assert( _sn_image.xw()==_xw && _sn_image.yw()==_yw );
   assert( _binned_image.xw()==_xw && _binned_image.yw()==_yw );
 
-  std::cout << "(i) Starting binning\n";
+  if( verbose )
+    std::cout << "(i) Starting binning\n";
 
-  if( T.is_terminal() )
+  if( verbose && T->is_terminal() )
     {
       std::cout << "(i)  Press Esc to abort binning\n";
     }
 
-  unsigned pix_counter = 0; // how many pixels processed
-  const unsigned no_unmasked = no_unmasked_pixels();
+  unsigned long pix_counter = 0; // how many pixels processed
+  const unsigned long no_unmasked = no_unmasked_pixels();
+  for( bin_vector::const_iterator b = _bins.begin(); b != _bins.end(); ++b )
+    pix_counter += b->count();
 
   // get next pixel
   point_int nextpoint = find_next_pixel();
-  assert( nextpoint.x() >= 0 && nextpoint.y() >= 0 );
+  assert( _resumed || _incremental ||
+	  ( nextpoint.x() >= 0 && nextpoint.y() >= 0 ) );
+
+  _checkpoint_timer.reset();
+
+  // whether the next bin is grown on its own
+  bool serial = true;
 
   // repeat binnings, adding centroids and weights of bins
   // to above variables
   while( nextpoint.x() >= 0 && nextpoint.y() >= 0 )
     {
       // ESC pressed
-      if( T.get_char() == 27 )
+      if( verbose && T->get_char() == 27 )
 	{
 	  cerr << "\nEsc pressed: aborting binning\n";
+
+	  // save the state so binning can be resumed, and stop any more
+	  // checkpoints replacing it
+	  if( ! _checkpoint_fname.empty() )
+	    {
+	      write_checkpoint( stage_binning, 0 );
+	      cerr << "(i) Use --resume to continue binning\n";
+	      _checkpoint_fname.clear();
+	      _checkpoint_timer = checkpoint_timer();
+	    }
 	  break;
 	}
 
-      // progress counter
-      const long counter = _bin_helper.no_bins();
-      if( counter % 10 == 0 && counter > 0)
+      const long bins_before = _bin_helper.no_bins();
+
+      if( _threads > 1 && ! serial )
 	{
-	  std::cout << std::setw(5) << counter << ' ';
-	  std::cout.flush();
-	  if( counter % 100 == 0 )
-	    {
-	      std::cout.setf(std::ios::fixed);
-	      std::cout << " [" << std::setprecision(1)
-			<< pix_counter*100./no_unmasked
-			<< "%]\n";
-	    }
+	  serial = ! grow_bins_parallel( pix_counter, no_unmasked );
 	}
+      else
+	{
+	  // progress counter
+	  if( verbose )
+	    show_progress( _bin_helper.no_bins(), pix_counter*100./no_unmasked );
 
-      // make the new bin and do the binning
-      bin newbin( &_bin_helper );
-      newbin.do_binning( nextpoint.x(), nextpoint.y() );
-      _bins.push_back( newbin );
+	  // make the new bin and do the binning
+	  bin newbin( &_bin_helper );
+	  newbin.do_binning( nextpoint.x(), nextpoint.y() );
+	  // keep track of all the pixels binned
+	  pix_counter += newbin.count();
 
-      // keep track of all the pixels binned
-      pix_counter += newbin.count();
+	  add_bin( newbin );
+	  serial = false;
+	}
 
       // find the next pixel
       nextpoint = find_next_pixel();
+
+      if( _checkpoint_timer.step( _bin_helper.no_bins() - bins_before ) )
+	write_checkpoint( stage_binning, 0 );
     }
 
   _bin_counter = _bin_helper.no_bins();
 
-  std::cout << " [100.0%]\n";
+  if( verbose )
+    {
+      std::cout << " [100.0%]\n";
+      std::cout << "(i) Done binning (" << _bin_counter << " bins)\n";
+    }
+}
+
+void binner::do_binning_tree(const bool bin_down)
+{
+  _bin_down = bin_down;
+  const bool verbose = _bin_helper.verbose();
+
+  if( ! _sorted_pixels || _sorted_down != bin_down )
+    sort_pixels(bin_down);
+
+  if( verbose )
+    {
+      std::cout << "(i) Starting binning (component tree)... ";
+      std::cout.flush();
+    }
+
+  const size_t none = size_t(-1);
+  const size_t npix = size_t(_xw) * _yw;
+  const double sn_2 = square( _bin_helper.threshold() );
+
+  // union-find forest of the pixels added so far which are not in a
+  // bin (none if not added)
+  std::vector<size_t> parent( npix, none );
+  auto find = [&parent](size_t i)
+    {
+      while( parent[i] != i )
+	{
+	  parent[i] = parent[parent[i]];
+	  i = parent[i];
+	}
+      return i;
+    };
+
+  // each region (at its root) keeps its sums and a list of its pixels,
+  // linked through next
+  struct region
+  {
+    bin_sums sums;
+    size_t head, tail;
+  };
+  std::vector<region> regions;
+  std::vector<size_t> free_regions;
+  std::vector<size_t> region_of( npix, none );
+  std::vector<size_t> next( npix, none );
+
+  auto make_bin = [&](const region& reg)
+    {
+      bin::_Pt_container points;
+      points.reserve( reg.sums.count );
+      for( size_t i = reg.head; i != none; i = next[i] )
+	points.push_back( point_int( int(i % _xw), int(i / _xw) ) );
+
+      bin newbin( &_bin_helper );
+      newbin.set_points( points );
+      add_bin( newbin );
+    };
+
+  const _Pt_sorted_vec& sorted = *_sorted_pixels;
+  for( _Pt_sorted_vec::const_iterator p = sorted.begin();
+       p != sorted.end(); ++p )
+    {
+      const int x = p->x();
+      const int y = p->y();
+      const size_t i = size_t(y)*_xw + x;
+
+      size_t r;
+      if( free_regions.empty() )
+	{
+	  r = regions.size();
+	  regions.push_back( region() );
+	}
+      else
+	{
+	  r = free_regions.back();
+	  free_regions.pop_back();
+	}
+      regions[r].sums = _bin_helper.pixel_sums( x, y );
+      regions[r].head = regions[r].tail = i;
+      parent[i] = i;
+      region_of[i] = r;
+
+      // join the regions of the neighbours not in bins, keeping the
+      // root of the larger
+      for( size_t n = 0; n != bin_no_neigh; ++n )
+	{
+	  const int xp = x + bin_neigh_x[n];
+	  const int yp = y + bin_neigh_y[n];
+	  if( xp < 0 || yp < 0 || xp >= int(_xw) || yp >= int(_yw) )
+	    continue;
+	  const size_t j = size_t(yp)*_xw + xp;
+	  if( parent[j] == none || _bins_image(xp, yp) >= 0 )
+	    continue;
+
+	  size_t ri = find(i), rj = find(j);
+	  if( ri == rj )
+	    continue;
+	  if( regions[region_of[ri]].sums.count <
+	      regions[region_of[rj]].sums.count )
+	    std::swap( ri, rj );
+
+	  region& big = regions[region_of[ri]];
+	  const region& small = regions[region_of[rj]];
+	  parent[rj] = ri;
+	  big.sums += small.sums;
+	  next[big.tail] = small.head;
+	  big.tail = small.tail;
+	  free_regions.push_back( region_of[rj] );
+	}
 
-  std::cout << "(i) Done binning (" << _bin_counter << " bins)\n";
+      // make a bin when there are enough counts
+      const size_t root = find(i);
+      if( _bin_helper.sn_2( regions[region_of[root]].sums ) >= sn_2 )
+	{
+	  make_bin( regions[region_of[root]] );
+	  free_regions.push_back( region_of[root] );
+	}
+    }
+
+  // bin the regions left over, for scrubbing
+  for( _Pt_sorted_vec::const_iterator p = sorted.begin();
+       p != sorted.end(); ++p )
+    {
+      const size_t i = size_t(p->y())*_xw + p->x();
+      if( parent[i] == i && _bins_image(p->x(), p->y()) < 0 )
+	make_bin( regions[region_of[i]] );
+    }
+
+  _bin_counter = _bin_helper.no_bins();
+
+  if( verbose )
+    std::cout << "Done (" << _bin_counter << " bins)\n";
 }
 
 void binner::do_scrub()
 {
+  // the pixel order is only needed for binning
+  _sorted_pixels.reset();
+  make_point_slots();
+
   scrubber scrub( _bin_helper, _bins );
+  if( _resumed && _resume_stage == stage_scrubbing )
+    scrub.set_waiting( _resume_waiting );
+
+  if( _incremental )
+    {
+      // only scrub the new bins, as smoothed values are only known
+      // around them
+      const double sn_2 = square( _bin_helper.threshold() );
+      std::vector<bool> waiting( _bins.size(), false );
+      for( size_t i = _prev_numbers.size(); i != _bins.size(); ++i )
+	waiting[i] = _bins[i].sn_2() < sn_2;
+      scrub.set_waiting( waiting );
+    }
+
+  if( _checkpoint_timer.enabled() )
+    {
+      _checkpoint_timer.reset();
+      scrub.set_checkpoint
+	( [this](unsigned long no_dissolved, const std::vector<bool>& waiting)
+	  {
+	    if( _checkpoint_timer.step(no_dissolved) )
+	      write_checkpoint( stage_scrubbing, &waiting );
+	  } );
+    }
+
   scrub.scrub();
 
   if( _bin_helper.scrub_large_bins() > 0. )
     scrub.scrub_large_bins( _bin_helper.scrub_large_bins() );
 
-  scrub.renumber();
+  // (bins are renumbered in calc_outputs if rebinning)
+  if( ! _incremental )
+    scrub.renumber( &_orig_numbers );
+}
+
+void binner::find_rebin_footprint( const image_long& prev_binmap,
+				   const image_short& changed,
+				   image_short* footprint,
+				   image_short* smooth,
+				   const std::vector<char>* fixed )
+{
+  const unsigned xw = prev_binmap.xw();
+  const unsigned yw = prev_binmap.yw();
+  const long no_prev = std::max( prev_binmap.max() + 1, 0L );
+
+  // bins the changed pixels are in or next to
+  std::vector<char> touched( no_prev, 0 );
+  for( unsigned y = 0; y != yw; ++y )
+    for( unsigned x = 0; x != xw; ++x )
+      {
+	if( changed(x, y) == 0 )
+	  continue;
+
+	if( prev_binmap(x, y) >= 0 )
+	  touched[ prev_binmap(x, y) ] = 1;
+	for( size_t n = 0; n != bin_no_neigh; ++n )
+	  {
+	    const int xp = x + bin_neigh_x[n];
+	    const int yp = y + bin_neigh_y[n];
+	    if( xp >= 0 && yp >= 0 && xp < int(xw) && yp < int(yw) &&
+		prev_binmap(xp, yp) >= 0 )
+	      touched[ prev_binmap(xp, yp) ] = 1;
+	  }
+      }
+  if( fixed != 0 )
+    for( size_t b = 0; b != touched.size() && b != fixed->size(); ++b )
+      if( (*fixed)[b] )
+	touched[b] = 0;
+
+  // add the bins next to those
+  std::vector<char> rebin( touched );
+  for( unsigned y = 0; y != yw; ++y )
+    for( unsigned x = 0; x != xw; ++x )
+      {
+	const long b = prev_binmap(x, y);
+	if( b < 0 || ! touched[b] )
+	  continue;
+
+	for( size_t n = 0; n != bin_no_neigh; ++n )
+	  {
+	    const int xp = x + bin_neigh_x[n];
+	    const int yp = y + bin_neigh_y[n];
+	    if( xp >= 0 && yp >= 0 && xp < int(xw) && yp < int(yw) &&
+		prev_binmap(xp, yp) >= 0 )
+	      rebin[ prev_binmap(xp, yp) ] = 1;
+	  }
+      }
+  if( fixed != 0 )
+    for( size_t b = 0; b != rebin.size() && b != fixed->size(); ++b )
+      if( (*fixed)[b] )
+	rebin[b] = 0;
+
+  *footprint = image_short( xw, yw, short(0) );
+  for( unsigned y = 0; y != yw; ++y )
+    for( unsigned x = 0; x != xw; ++x )
+      {
+	const long b = prev_binmap(x, y);
+	if( changed(x, y) != 0 || ( b >= 0 && rebin[b] ) )
+	  (*footprint)(x, y) = 1;
+      }
+
+  // smoothed values are needed next to the footprint when scrubbing
+  *smooth = *footprint;
+  for( unsigned y = 0; y != yw; ++y )
+    for( unsigned x = 0; x != xw; ++x )
+      {
+	if( (*footprint)(x, y) == 0 )
+	  continue;
+	for( size_t n = 0; n != bin_no_neigh; ++n )
+	  {
+	    const int xp = x + bin_neigh_x[n];
+	    const int yp = y + bin_neigh_y[n];
+	    if( xp >= 0 && yp >= 0 && xp < int(xw) && yp < int(yw) )
+	      (*smooth)(xp, yp) = 1;
+	  }
+      }
+}
+
+void binner::set_previous_bins( const image_long& prev_binmap,
+				const image_short& footprint,
+				const long next_number )
+{
+  assert( prev_binmap.xw() == _xw && prev_binmap.yw() == _yw );
+  assert( footprint.xw() == _xw && footprint.yw() == _yw );
+
+  _bin_helper.restrict_mask( footprint );
+
+  // collect the pixels of the old bins outside the footprint
+  const long no_prev = std::max( prev_binmap.max() + 1, 0L );
+  std::vector<bin::_Pt_container> points( no_prev );
+  std::vector<char> removed( no_prev, 0 );
+  for( unsigned y = 0; y != _yw; ++y )
+    for( unsigned x = 0; x != _xw; ++x )
+      {
+	const long b = prev_binmap(x, y);
+	if( b < 0 )
+	  continue;
+	if( footprint(x, y) != 0 )
+	  removed[b] = 1;
+	else
+	  points[b].push_back( point_int(x, y) );
+      }
+
+  // keep them in their old order, as the first bins
+  _prev_numbers.clear();
+  _free_numbers.clear();
+  for( long b = 0; b != no_prev; ++b )
+    {
+      if( removed[b] )
+	{
+	  _free_numbers.push_back( b );
+	  continue;
+	}
+      if( points[b].empty() )
+	continue;
+
+      bin newbin( &_bin_helper );
+      newbin.set_points( points[b] );
+      add_bin( newbin );
+      _prev_numbers.push_back( b );
+    }
+
+  _incremental = true;
+  _next_number = next_number >= 0 ? next_number : no_prev;
+
+  if( _bin_helper.verbose() )
+    std::cout << "(i) Keeping " << _prev_numbers.size()
+	      << " bins, rebinning " << _free_numbers.size() << '\n';
+}
+
+void binner::set_binmap( const image_long& binmap )
+{
+  assert( binmap.xw() == _xw && binmap.yw() == _yw );
+
+  const long no_old = std::max( binmap.max() + 1, 0L );
+
+  // split the bins into connected pieces (a block of a preview can
+  // join pixels on both sides of a masked gap narrower than it)
+  image_long piece( _xw, _yw, -1L );
+  std::vector<long> piece_bin;
+  std::vector<unsigned long> piece_size;
+  std::vector<point_int> stack;
+  for( unsigned y = 0; y != _yw; ++y )
+    for( unsigned x = 0; x != _xw; ++x )
+      {
+	const long b = binmap(x, y);
+	if( b < 0 || piece(x, y) >= 0 )
+	  continue;
+
+	const long p = piece_bin.size();
+	unsigned long size = 0;
+	piece(x, y) = p;
+	stack.push_back( point_int(x, y) );
+	while( ! stack.empty() )
+	  {
+	    const point_int pt = stack.back();
+	    stack.pop_back();
+	    ++size;
+	    for( size_t n = 0; n != bin_no_neigh; ++n )
+	      {
+		const int nx = pt.x() + bin_neigh_x[n];
+		const int ny = pt.y() + bin_neigh_y[n];
+		if( nx >= 0 && ny >= 0 && nx < int(_xw) && ny < int(_yw) &&
+		    binmap(nx, ny) == b && piece(nx, ny) < 0 )
+		  {
+		    piece(nx, ny) = p;
+		    stack.push_back( point_int(nx, ny) );
+		  }
+	      }
+	  }
+	piece_bin.push_back( b );
+	piece_size.push_back( size );
+      }
+
+  // the largest piece of each bin keeps it
+  const size_t no_pieces = piece_bin.size();
+  std::vector<long> largest( no_old, -1 );
+  for( size_t p = 0; p != no_pieces; ++p )
+    {
+      long& l = largest[ piece_bin[p] ];
+      if( l < 0 || piece_size[p] > piece_size[l] )
+	l = p;
+    }
+  std::vector<long> dest( no_pieces, -1 );
+  for( long b = 0; b != no_old; ++b )
+    if( largest[b] >= 0 )
+      dest[ largest[b] ] = b;
+
+  // the other pieces join the bin they share the most edge with,
+  // repeating for pieces which only touch other moved pieces
+  for(;;)
+    {
+      std::vector< std::map<long, unsigned long> > edges( no_pieces );
+      for( unsigned y = 0; y != _yw; ++y )
+	for( unsigned x = 0; x != _xw; ++x )
+	  {
+	    const long p = piece(x, y);
+	    if( p < 0 || dest[p] >= 0 )
+	      continue;
+	    for( size_t n = 0; n != bin_no_neigh; ++n )
+	      {
+		const int nx = int(x) + bin_neigh_x[n];
+		const int ny = int(y) + bin_neigh_y[n];
+		if( nx >= 0 && ny >= 0 && nx < int(_xw) && ny < int(_yw) &&
+		    piece(nx, ny) >= 0 && dest[ piece(nx, ny) ] >= 0 )
+		  ++edges[p][ dest[ piece(nx, ny) ] ];
+	      }
+	  }
+
+      bool changed = false;
+      for( size_t p = 0; p != no_pieces; ++p )
+	{
+	  unsigned long most = 0;
+	  for( const auto& e : edges[p] )
+	    if( e.second > most )
+	      {
+		most = e.second;
+		dest[p] = e.first;
+		changed = true;
+	      }
+	}
+      if( ! changed )
+	break;
+    }
+
+  // pieces touching no other bin become bins of their own
+  long no_new = no_old;
+  for( size_t p = 0; p != no_pieces; ++p )
+    if( dest[p] < 0 )
+      dest[p] = no_new++;
+
+  std::vector<bin::_Pt_container> points( no_new );
+  for( unsigned y = 0; y != _yw; ++y )
+    for( unsigned x = 0; x != _xw; ++x )
+      if( piece(x, y) >= 0 )
+	points[ dest[ piece(x, y) ] ].push_back( point_int(x, y) );
+
+  for( long b = 0; b != no_new; ++b )
+    {
+      if( points[b].empty() )
+	continue;
+
+      bin newbin( &_bin_helper );
+      newbin.set_points( points[b] );
+      add_bin( newbin );
+    }
+}
+
+// the eight pixels around a pixel, going round in order
+namespace
+{
+  const int ring_x[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+  const int ring_y[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+}
+
+bool binner::stays_connected( const int x, const int y, const long b ) const
+{
+  bool in[8];
+  for( unsigned i = 0; i != 8; ++i )
+    in[i] = _bins_image( x+ring_x[i], y+ring_y[i] ) == b;
+
+  // count the groups of side neighbours in the bin, where neighbours
+  // are joined if the corner pixel between them is also in the bin
+  // (if all are joined, there are no groups)
+  unsigned groups = 0;
+  for( unsigned i = 0; i != 8; i += 2 )
+    {
+      const unsigned prev = (i + 6) % 8;
+      const unsigned corner = (i + 7) % 8;
+      if( in[i] && ! ( in[prev] && in[corner] ) )
+	++groups;
+    }
+
+  return groups <= 1;
+}
+
+void binner::refine_bins( const unsigned passes )
+{
+  const image_float& smoothed_image = *_bin_helper.smoothed_image();
+  const double sn_2 = square( _bin_helper.threshold() );
+
+  make_point_slots();
+
+  // mean smoothed value of each bin (bins are numbered in order)
+  std::vector<double> aim( _bins.size() );
+  for( size_t i = 0; i != _bins.size(); ++i )
+    {
+      assert( _bins[i].bin_no() == long(i) );
+      double sum = 0;
+      _bins[i].for_each_point( [&sum, &smoothed_image](int x, int y)
+			       {
+				 sum += smoothed_image(x, y);
+			       } );
+      aim[i] = sum / _bins[i].count();
+    }
+
+  unsigned long total_moved = 0;
+  for( unsigned pass = 0; pass != passes; ++pass )
+    {
+      // pixels on the boundaries between bins
+      std::vector<point_int> boundary;
+      for( unsigned y = 0; y != _yw; ++y )
+	for( unsigned x = 0; x != _xw; ++x )
+	  {
+	    const long a = _bins_image(x, y);
+	    if( a < 0 )
+	      continue;
+	    for( size_t n = 0; n != bin_no_neigh; ++n )
+	      {
+		const long b = _bins_image( x+bin_neigh_x[n],
+					    y+bin_neigh_y[n] );
+		if( b >= 0 && b != a )
+		  {
+		    boundary.push_back( point_int(x, y) );
+		    break;
+		  }
+	      }
+	  }
+
+      unsigned long moved = 0;
+      for( std::vector<point_int>::const_iterator p = boundary.begin();
+	   p != boundary.end(); ++p )
+	{
+	  const int x = p->x();
+	  const int y = p->y();
+	  const long a = _bins_image(x, y);
+	  const double val = smoothed_image(x, y);
+
+	  long best = a;
+	  double bestdelta = std::fabs( val - aim[a] );
+	  for( size_t n = 0; n != bin_no_neigh; ++n )
+	    {
+	      const long b = _bins_image( x+bin_neigh_x[n],
+					  y+bin_neigh_y[n] );
+	      if( b < 0 || b == a )
+		continue;
+	      const double delta = std::fabs( val - aim[b] );
+	      if( delta < bestdelta )
+		{
+		  bestdelta = delta;
+		  best = b;
+		}
+	    }
+
+	  bin& from = _bins[a];
+	  if( best == a || from.count() <= 1 || ! stays_connected(x, y, a) )
+	    continue;
+
+	  from.expand();
+	  from.remove_point( x, y );
+	  if( from.sn_2() < sn_2 )
+	    {
+	      // put it back, as the bin would drop below the threshold
+	      from.add_point( x, y );
+	      continue;
+	    }
+	  _bins[best].expand();
+	  _bins[best].add_point( x, y );
+	  ++moved;
+	}
+
+      // pack the bins which changed again
+      for( bin_vector::iterator b = _bins.begin(); b != _bins.end(); ++b )
+	b->compact();
+
+      total_moved += moved;
+      if( moved == 0 )
+	break;
+    }
+
+  if( _bin_helper.verbose() )
+    std::cout << "(i) Refined bins, moving " << total_moved
+	      << " boundary pixels\n";
+}
+
+// kept bins take their old numbers, and new bins take the numbers of
+// the removed bins, then numbers after the old ones
+void binner::renumber_incremental()
+{
+  bin_vector numbered;
+  size_t next_free = 0;
+  for( size_t i = 0; i != _bins.size(); ++i )
+    {
+      bin& b = _bins[i];
+      if( b.count() == 0 )
+	continue;
+
+      if( i < _prev_numbers.size() )
+	b.set_bin_no( _prev_numbers[i] );
+      else if( next_free != _free_numbers.size() )
+	b.set_bin_no( _free_numbers[next_free++] );
+      else
+	b.set_bin_no( _next_number++ );
+
+      numbered.push_back( std::move(b) );
+    }
+  _bins.swap( numbered );
+
+  _bins_image.set_all( -1 );
+  for( bin_vector::const_iterator b = _bins.begin(); b != _bins.end(); ++b )
+    b->paint_bins_image();
+
+  _incremental = false;
+}
+
+namespace
+{
+  // checkpoint files start with this, then the header below
+  const char checkpoint_magic[8] = "CBCKPT2";
+
+  struct checkpoint_header
+  {
+    unsigned xw, yw;
+    double threshold;
+    char bin_down;
+    int stage;
+  };
+
+  void read_checkpoint_header(checkpoint_file& file, checkpoint_header* hdr)
+  {
+    char magic[8];
+    file.get( &magic );
+    if( std::memcmp( magic, checkpoint_magic, sizeof(magic) ) != 0 )
+      {
+	std::cerr << "(!) " << file.filename()
+		  << " is not a contbin checkpoint file\n";
+	std::exit(1);
+      }
+
+    file.get( &hdr->xw );
+    file.get( &hdr->yw );
+    file.get( &hdr->threshold );
+    file.get( &hdr->bin_down );
+    file.get( &hdr->stage );
+  }
+}
+
+// The checkpoint holds the smoothed image, where binning had got to,
+// and the full state of every bin, so that carrying on gives the same
+// bins as an uninterrupted run.
+void binner::write_checkpoint(const stage_type stage,
+			      const std::vector<bool>* waiting)
+{
+  if( _bin_helper.verbose() )
+    std::cout << "\n(i) Writing checkpoint " << _checkpoint_fname << '\n';
+
+  checkpoint_file file( _checkpoint_fname, checkpoint_file::write_mode );
+  file.put( checkpoint_magic );
+
+  checkpoint_header hdr;
+  hdr.xw = _xw;
+  hdr.yw = _yw;
+  hdr.threshold = _bin_helper.threshold();
+  hdr.bin_down = _bin_down;
+  hdr.stage = stage;
+  file.put( hdr.xw );
+  file.put( hdr.yw );
+  file.put( hdr.threshold );
+  file.put( hdr.bin_down );
+  file.put( hdr.stage );
+
+  file.put_image( *_bin_helper.smoothed_image() );
+
+  const unsigned long long posn = stage == stage_binning
+    ? _sorted_pix_posn - _sorted_pixels->begin() : 0;
+  file.put( posn );
+  file.put( _bin_helper.no_bins() );
+
+  file.put( (unsigned long long)(_bins.size()) );
+  for( bin_vector::const_iterator b = _bins.begin(); b != _bins.end(); ++b )
+    b->write_state( file );
+
+  std::vector<char> waiting_flags;
+  if( waiting != 0 )
+    waiting_flags.assign( waiting->begin(), waiting->end() );
+  file.put_vector( waiting_flags );
+
+  file.commit();
+  _checkpoint_timer.reset();
+}
+
+void binner::resume(const std::string& filename)
+{
+  if( _bin_helper.verbose() )
+    std::cout << "(i) Resuming from checkpoint " << filename << '\n';
+
+  checkpoint_file file( filename, checkpoint_file::read_mode );
+  checkpoint_header hdr;
+  read_checkpoint_header( file, &hdr );
+  if( hdr.xw != _xw || hdr.yw != _yw )
+    {
+      std::cerr << "(!) Checkpoint does not match input image shape\n";
+      std::exit(1);
+    }
+  if( hdr.threshold != _bin_helper.threshold() )
+    {
+      std::cerr << "(!) Checkpoint was made with a different signal "
+	"to noise threshold (" << hdr.threshold << ")\n";
+      std::exit(1);
+    }
+
+  // skip the smoothed image (see read_checkpoint_smoothed)
+  {
+    image_float smoothed( _xw, _yw );
+    file.get_image( &smoothed );
+  }
+
+  unsigned long long posn, no_bins;
+  long bin_counter;
+  file.get( &posn );
+  file.get( &bin_counter );
+  file.get( &no_bins );
+
+  _bins.clear();
+  _bins.reserve( no_bins );
+  for( unsigned long long i = 0; i != no_bins; ++i )
+    {
+      bin b( &_bin_helper );
+      b.read_state( file );
+      add_bin( b );
+    }
+
+  // making the bins above used up bin numbers
+  _bin_helper.set_no_bins( bin_counter );
+  _bin_counter = bin_counter;
+
+  std::vector<char> waiting_flags;
+  file.get_vector( &waiting_flags );
+  _resume_waiting.assign( waiting_flags.begin(), waiting_flags.end() );
+
+  _resumed = true;
+  _resume_stage = stage_type( hdr.stage );
+  _resume_posn = posn;
+  _bin_down = hdr.bin_down != 0;
+
+  if( _bin_helper.verbose() )
+    std::cout << "(i) Restored " << no_bins << " bins ("
+	      << ( _resume_stage == stage_binning ? "binning" : "scrubbing" )
+	      << ")\n";
+}
+
+image_float* binner::read_checkpoint_smoothed(const std::string& filename)
+{
+  checkpoint_file file( filename, checkpoint_file::read_mode );
+  checkpoint_header hdr;
+  read_checkpoint_header( file, &hdr );
+
+  image_float* smoothed = new image_float( hdr.xw, hdr.yw );
+  file.get_image( smoothed );
+  return smoothed;
+}
+
+void binner::add_bin( bin& newbin )
+{
+  _bins.push_back( std::move(newbin) );
+  _bins.back().compact();
+}
+
+void binner::make_point_slots()
+{
+  if( _bin_helper.point_slots() != 0 )
+    return;
+
+  // (bins too large for the store are not compacted)
+  _bin_helper.make_point_slots();
+  for( bin_vector::iterator b = _bins.begin(); b != _bins.end(); ++b )
+    if( ! b->compacted() )
+      b->index_points();
+}
+
+void binner::compact_bins()
+{
+  for( bin_vector::iterator b = _bins.begin(); b != _bins.end(); ++b )
+    b->compact();
+
+  _bin_helper.release_slots();
+}
+
+void binner::number_bins()
+{
+  if( _numbered )
+    return;
+  _numbered = true;
+
+  if( _incremental )
+    renumber_incremental();
+  else if( _bin_helper.hilbert_order() && _orig_numbers.empty() )
+    {
+      // not renumbered by scrubbing
+      scrubber scrub( _bin_helper, _bins );
+      scrub.renumber( &_orig_numbers );
+    }
 }
 
 // create output images and make histograms of signal/noise
 void binner::calc_outputs()
 {
-  const size_t no_bins = _bins.size();
+  number_bins();
+
+  // bins are not changed from here
+  compact_bins();
+
+  // bin numbers may have gaps after rebinning
+  size_t no_bins = 0;
+  for( bin_vector::const_iterator b = _bins.begin(); b != _bins.end(); ++b )
+    no_bins = std::max( no_bins, size_t(b->bin_no()+1) );
+
   std::vector<double> signal(no_bins);
   std::vector<double> noise_2(no_bins);
-  std::vector<unsigned> pixcounts(no_bins);
+  std::vector<unsigned long> pixcounts(no_bins);
   std::vector<double> sn(no_bins);
 
-  double min_sn = 1e100, max_sn = -1e100;
-  double min_signal = 1e100, max_signal = -1e100;
-
   // iterate over bins & collect info
-  for(size_t i = 0; i != no_bins; ++i)
+  for(size_t i = 0; i != _bins.size(); ++i)
     {
       const bin& b = _bins[i];
       const long no = b.bin_no();
@@ -234,8 +1195,6 @@ void binner::calc_outputs()
       assert( no < long(no_bins) );
 
       signal[no] = b.signal();
-      max_signal = std::max( signal[no], max_signal );
-      min_signal = std::min( signal[no], min_signal );
 
       noise_2[no] = b.noise_2();
       pixcounts[no] = b.count();
@@ -247,67 +1206,154 @@ void binner::calc_outputs()
           std::cerr << "WARNING: invalid value in signal to noise. "
             "This can be caused by a negative input image.\n";
         }
-
-      max_sn = std::max( sn[no], max_sn );
-      min_sn = std::min( sn[no], min_sn );
     }
 
+  // start summaries of bins, where the positions are found below
+  _summaries.assign( no_bins, bin_summary() );
+
+  const image_float* expmap = _bin_helper.expmap_image();
+
+  // sums of the band images in each bin
+  const size_t no_bands = _band_images.size();
+  std::vector< std::vector<bin_sums> > band_sums
+    ( no_bands, std::vector<bin_sums>(no_bins) );
+
   // now make output images
   _sn_image.set_all(-1);
   _binned_image.set_all(-1);
   for(unsigned y = 0; y != _yw; ++y)
     for(unsigned x = 0; x != _xw; ++x)
       {
-	const int bin = _bins_image(x, y);
+	const long bin = _bins_image(x, y);
 	if( bin >= 0 )
 	  {
 	    _sn_image(x, y) = sn[bin];
 	    _binned_image(x, y) = signal[bin] / pixcounts[bin];
+
+	    bin_summary& s = _summaries[bin];
+	    s.add_pixel( x, y );
+	    if( expmap != 0 )
+	      s.exposure += (*expmap)(x, y);
+
+	    for( size_t i = 0; i != no_bands; ++i )
+	      band_sums[i][bin] +=
+		bin_helper::pixel_sums( *_band_images[i], _band_bg_images[i],
+					expmap, _band_bg_expmaps[i], 0,
+					x, y );
 	  }
       }
 
+  // finish summaries, leaving out unused bin numbers
+  size_t no_summaries = 0;
+  for(size_t no = 0; no != no_bins; ++no)
+    {
+      bin_summary s = _summaries[no];
+      if( s.count == 0 )
+	continue;
+
+      s.bin_no = no;
+      s.orig_bin_no = no < _orig_numbers.size() ? _orig_numbers[no] : no;
+      s.signal = signal[no];
+      s.noise = std::sqrt( noise_2[no] );
+      s.sn = sn[no];
+      s.x_cen /= s.count;
+      s.y_cen /= s.count;
+      s.exposure /= s.count;
+
+      for( size_t i = 0; i != no_bands; ++i )
+	add_band_summary( &s, band_sums[i][no], _band_bg_images[i] != 0 );
+
+      _summaries[no_summaries++] = s;
+    }
+  _summaries.resize( no_summaries );
+
   // build histogram of signal to noises
-  {
-    const unsigned no_hbins = 30;
-    const double delta_sn = (max_sn-min_sn+0.0001)/no_hbins;
-    const double delta_signal = (max_signal-min_signal+0.0001)/no_hbins;
-    std::vector<unsigned> histo_sn(no_hbins);
-    std::vector<unsigned> histo_signal(no_hbins);
+  std::vector<double> bin_sn, bin_signal;
+  for(size_t i = 0; i != _bins.size(); ++i)
+    {
+      const long bin = _bins[i].bin_no();
+      if( bin < 0 )
+	continue;
+      bin_sn.push_back( sn[bin] );
+      bin_signal.push_back( signal[bin] );
+    }
+  write_histograms( bin_sn, bin_signal, _output_suffix );
+}
 
-    for(size_t bin = 0; bin != no_bins; ++bin)
-      {
-        if( _bins[bin].bin_no() < 0 )
-          continue;
+void binner::add_band_summary( bin_summary* s, const bin_sums& bs,
+			       const bool has_bg )
+{
+  const double bnoise_2 = bin_helper::counts_noise_2( bs, has_bg );
+  s->band_counts.push_back( bs.fg );
+  s->band_signal.push_back( bs.signal() );
+  s->band_noise.push_back( std::sqrt(bnoise_2) );
+  s->band_sn.push_back( bnoise_2 < 1e-7 ? std::sqrt(1e-7) :
+			std::fabs(bs.signal()) / std::sqrt(bnoise_2) );
+}
 
-	const unsigned index_sn = unsigned( (sn[bin]-min_sn) / delta_sn );
-	const unsigned index_signal = unsigned( (signal[bin]-min_signal) /
-						delta_signal );
+void binner::write_histograms( const std::vector<double>& sn,
+			       const std::vector<double>& signal,
+			       const std::string& suffix )
+{
+  double min_sn = 1e100, max_sn = -1e100;
+  double min_signal = 1e100, max_signal = -1e100;
+  for(size_t i = 0; i != sn.size(); ++i)
+    {
+      min_sn = std::min( sn[i], min_sn );
+      max_sn = std::max( sn[i], max_sn );
+      min_signal = std::min( signal[i], min_signal );
+      max_signal = std::max( signal[i], max_signal );
+    }
 
-	assert( index_sn < no_hbins && index_signal < no_hbins );
+  const unsigned no_hbins = 30;
+  const double delta_sn = (max_sn-min_sn+0.0001)/no_hbins;
+  const double delta_signal = (max_signal-min_signal+0.0001)/no_hbins;
+  std::vector<unsigned> histo_sn(no_hbins);
+  std::vector<unsigned> histo_signal(no_hbins);
 
-	++histo_sn[index_sn];
-	++histo_signal[index_signal];
-      }
+  for(size_t i = 0; i != sn.size(); ++i)
+    {
+      const unsigned index_sn = unsigned( (sn[i]-min_sn) / delta_sn );
+      const unsigned index_signal = unsigned( (signal[i]-min_signal) /
+					      delta_signal );
 
-    // output histogram data in file
-    std::ofstream stream_sn("bin_sn_stats.qdp");
-    std::ofstream stream_signal("bin_signal_stats.qdp");
-    stream_sn <<
-      "label x Signal:Noise\n"
-      "label y Number\n"
-      "line step\n";
-    stream_signal <<
-      "label x Counts\n"
-      "label y Number\n"
-      "line step\n";
-
-    // write out histograms
-    for(unsigned h = 0; h != no_hbins; ++h)
-      {
-	stream_sn << min_sn + (h+0.5)*delta_sn << '\t'
-		  << histo_sn[h] << '\n';
-	stream_signal << min_signal + (h+0.5)*delta_signal << '\t'
-		      << histo_signal[h] << '\n';
-      }
-  }
+      assert( index_sn < no_hbins && index_signal < no_hbins );
+
+      ++histo_sn[index_sn];
+      ++histo_signal[index_signal];
+    }
+
+  // output histogram data in file
+  std::ofstream stream_sn( ("bin_sn_stats" + suffix + ".qdp").c_str() );
+  std::ofstream stream_signal( ("bin_signal_stats" + suffix +
+				".qdp").c_str() );
+  stream_sn <<
+    "label x Signal:Noise\n"
+    "label y Number\n"
+    "line step\n";
+  stream_signal <<
+    "label x Counts\n"
+    "label y Number\n"
+    "line step\n";
+
+  // write out histograms
+  for(unsigned h = 0; h != no_hbins; ++h)
+    {
+      stream_sn << min_sn + (h+0.5)*delta_sn << '\t'
+		<< histo_sn[h] << '\n';
+      stream_signal << min_signal + (h+0.5)*delta_signal << '\t'
+		    << histo_signal[h] << '\n';
+    }
+}
+
+void binner::calc_merge_tree()
+{
+  if( _bin_helper.verbose() )
+    {
+      std::cout << "(i) Making merge tree... ";
+      std::cout.flush();
+    }
+  _merge_tree.build( _bin_helper, _bins );
+  if( _bin_helper.verbose() )
+    std::cout << "Done (" << _merge_tree.nodes().size() << " nodes)\n";
 }
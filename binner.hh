@@ -4,9 +4,53 @@
 #include "misc.hh"
 #include "point.hh"
 #include "bin.hh"
+#include "checkpoint.hh"
+#include "merge_tree.hh"
 
 #include <list>
+#include <vector>
+#include <string>
+#include <memory>
+#include <limits>
 
+// properties of a bin, as written to the bin catalogue
+// (pixel coordinates count from 0)
+struct bin_summary
+{
+  // an empty bin, to which pixels are added
+  bin_summary()
+    : bin_no(-1), count(0), signal(0), noise(0), sn(0),
+      x_cen(0), y_cen(0),
+      x_min(std::numeric_limits<int>::max()),
+      y_min(std::numeric_limits<int>::max()),
+      x_max(-1), y_max(-1), exposure(0), orig_bin_no(-1)
+  {
+  }
+
+  // add the pixel at x, y to the count, position sums and bounding box
+  void add_pixel( const int x, const int y )
+  {
+    ++count;
+    x_cen += x;
+    y_cen += y;
+    x_min = std::min( x_min, x );
+    x_max = std::max( x_max, x );
+    y_min = std::min( y_min, y );
+    y_max = std::max( y_max, y );
+  }
+
+  long bin_no;
+  unsigned long count;  // number of pixels
+  double signal, noise, sn;
+  double x_cen, y_cen;  // mean position of pixels
+  int x_min, y_min, x_max, y_max;  // bounding box (inclusive)
+  double exposure;  // mean exposure over pixels (0 if no expmap)
+  long orig_bin_no;  // number if not in Hilbert order
+  // for each band image: counts, background subtracted counts, noise
+  // and signal to noise
+  std::vector<double> band_counts, band_signal, band_noise, band_sn;
+};
+typedef std::vector<bin_summary> bin_summary_vector;
 
 class binner
 {
@@ -36,6 +80,18 @@ public:
     _bin_helper.set_mask( mask_image );
   }
 
+  // Also sum each bin in another band image when making the outputs,
+  // with an optional background image and its exposure map (the
+  // exposure map of the input image is used for the band).
+  void add_band( const image_float* band_image,
+		 const image_float* band_bg_image,
+		 const image_float* band_bg_expmap )
+  {
+    _band_images.push_back( band_image );
+    _band_bg_images.push_back( band_bg_image );
+    _band_bg_expmaps.push_back( band_bg_expmap );
+  }
+
   void set_constrain_fill( bool constrain_fill, double constrain_val )
   {
     _bin_helper.set_constrain_fill( constrain_fill, constrain_val );
@@ -46,30 +102,188 @@ public:
     _bin_helper.set_scrub_large_bins( fraction );
   }
 
+  // scrub by moving whole bins at once, rather than pixel by pixel
+  void set_bulk_scrub( bool bulk_scrub )
+  {
+    _bin_helper.set_bulk_scrub( bulk_scrub );
+  }
+
+  // number the bins in the order their centres are on a Hilbert curve
+  // over the image, so bins next to each other have close numbers
+  void set_hilbert_order( bool hilbert_order )
+  {
+    _bin_helper.set_hilbert_order( hilbert_order );
+  }
+
+  // scrub bins which do not share neighbours at the same time, using
+  // this number of threads (0 to scrub one bin at a time)
+  void set_scrub_threads( unsigned threads )
+  {
+    _bin_helper.set_scrub_threads( threads );
+  }
+
+  // number of threads to grow bins with (the result is the same)
+  void set_threads( unsigned threads )
+  {
+    _threads = threads < 1 ? 1 : threads;
+  }
+
+  // show progress, and allow binning to be aborted with Esc (default
+  // on). Turn off if several binners are run at the same time.
+  void set_verbose( bool verbose )
+  {
+    _bin_helper.set_verbose( verbose );
+  }
+
+  // add this to the names of the histogram files from calc_outputs
+  void set_output_suffix( const std::string& suffix )
+  {
+    _output_suffix = suffix;
+  }
+
+  // sort the pixels into the order bins are started from (done by
+  // do_binning if needed)
+  void sort_pixels(const bool bin_down);
+
+  // use the pixel order sorted by another binner, which must have the
+  // same smoothed image and mask (the order does not depend on the
+  // threshold)
+  void share_pixel_order( const binner& other )
+  {
+    _sorted_pixels = other._sorted_pixels;
+    _sorted_down = other._sorted_down;
+  }
+
+  // write checkpoints to filename after every_bins bins are made or
+  // scrubbed, or every_secs seconds (0 to ignore either). A checkpoint
+  // is also written if binning is aborted.
+  void set_checkpoint( const std::string& filename,
+		       unsigned long every_bins, double every_secs )
+  {
+    _checkpoint_fname = filename;
+    _checkpoint_timer = checkpoint_timer( every_bins, every_secs );
+  }
+
+  // carry on from the checkpoint in filename, which should have been
+  // made with the same input images and options
+  void resume( const std::string& filename );
+
+  // read the smoothed image kept in a checkpoint file
+  static image_float* read_checkpoint_smoothed( const std::string& filename );
+
+  // Find the pixels to rebin, given the binmap from an earlier run and
+  // the pixels which have changed since (non-zero in changed). These
+  // are the pixels of the bins the changed pixels are in or next to,
+  // of the bins next to those, and the changed pixels themselves.
+  // smooth is set to these pixels and those next to them, which are
+  // the pixels where smoothed values are needed. Bins which are set in
+  // fixed (if given) are not rebinned.
+  static void find_rebin_footprint( const image_long& prev_binmap,
+				    const image_short& changed,
+				    image_short* footprint,
+				    image_short* smooth,
+				    const std::vector<char>* fixed = 0 );
+
+  // Keep the bins of prev_binmap outside footprint, so that only the
+  // pixels in footprint are binned and scrubbed. Kept bins keep their
+  // numbers. New bins take the numbers of the old bins which were
+  // removed, then the numbers after the largest old number (or from
+  // next_number if given, when prev_binmap is part of a larger
+  // binmap). Call after the images and mask have been set.
+  void set_previous_bins( const image_long& prev_binmap,
+			  const image_short& footprint,
+			  const long next_number = -1 );
+
+  // Make the bins from a binmap (e.g. one made at lower resolution),
+  // rather than by binning. Bins are numbered in order of their old
+  // numbers. Bins in several pieces keep the largest, with the others
+  // joining the bin they share the most edge with (or becoming new
+  // bins after the others if they touch none).
+  void set_binmap( const image_long& binmap );
+
+  // Move pixels on the boundaries of bins to the neighbouring bin with
+  // the closest mean smoothed value, if the bin they leave stays
+  // connected and above the threshold. This is repeated up to passes
+  // times, so boundaries can move by up to this many pixels.
+  void refine_bins( const unsigned passes );
+
   // do the binning
   // bin_down true if start at highest pixels, false at lowest
   void do_binning(const bool bin_down);
 
+  // Alternative to do_binning, which makes bins from the component
+  // tree of the smoothed image. Pixels are added in flux order, joining
+  // the regions of unbinned pixels they touch (using union-find). When
+  // a region reaches the threshold it is made into a bin. The regions
+  // left at the end are made into bins below the threshold, for
+  // scrubbing. Bins are not grown pixel by pixel, so --constrainfill
+  // is not applied.
+  void do_binning_tree(const bool bin_down);
+
   // scrub bins
   void do_scrub();
 
+  // give the bins their final numbers, without making the outputs
+  // (done by calc_outputs)
+  void number_bins();
+
   // calculate output images (returned below)
   void calc_outputs();
 
+  // add the counts, signal, noise and signal to noise of a band with
+  // sums bs to the summary of a bin
+  static void add_band_summary( bin_summary* s, const bin_sums& bs,
+				const bool has_bg );
+
+  // write histograms of the signal to noise and signal of the bins
+  // to bin_sn_stats and bin_signal_stats files with suffix
+  static void write_histograms( const std::vector<double>& sn,
+				const std::vector<double>& signal,
+				const std::string& suffix );
+
+  // work out how the bins merge for higher thresholds (after
+  // calc_outputs)
+  void calc_merge_tree();
+
   // get output image, binmap, and signal:noise image
   const image_float& get_output_image() const { return _binned_image; };
   const image_long& get_binmap_image() const { return _bins_image; };
   const image_float& get_sn_image() const { return _sn_image; };
+  // get summary of each bin, in order of bin number
+  const bin_summary_vector& get_bin_summaries() const { return _summaries; }
+  const merge_tree& get_merge_tree() const { return _merge_tree; }
 
 private:
   // find the pixel with the highest smoothed flux
   point_int find_next_pixel();
 
   // no unmasked pixels
-  unsigned no_unmasked_pixels() const;
+  unsigned long no_unmasked_pixels() const;
 
-  // sort smoothed pixels
-  void sort_pixels(const bool bin_down);
+  // write the current state to the checkpoint file, where waiting
+  // are the bins still to be scrubbed (if scrubbing)
+  enum stage_type { stage_binning, stage_scrubbing };
+  void write_checkpoint( const stage_type stage,
+			 const std::vector<bool>* waiting );
+
+  // give bins their final numbers after set_previous_bins
+  void renumber_incremental();
+
+  // keep a finished bin, packing its points into the bin store
+  void add_bin( bin& newbin );
+  // make the point slots, which are needed once bins can lose pixels
+  void make_point_slots();
+  // pack the points of all the bins into the bin store, and free the
+  // slots, once the bins are no longer changed
+  void compact_bins();
+
+  // whether bin b stays connected if the pixel at x, y is taken out
+  bool stays_connected( const int x, const int y, const long b ) const;
+
+  // grow the next few bins at the same time
+  // returns false if the next bin should be grown on its own
+  bool grow_bins_parallel(unsigned long& pix_counter,
+			  const unsigned long no_unmasked);
 
 private:
   const unsigned _xw, _yw;  // size of input images
@@ -80,13 +294,45 @@ private:
 
   bin_helper _bin_helper;
   unsigned _bin_counter;
+  unsigned _threads;
 
   bin_vector _bins; // keep all of the bins
+  bin_summary_vector _summaries; // made by calc_outputs
+  merge_tree _merge_tree; // made by calc_merge_tree
+  std::vector<long> _orig_numbers; // number before Hilbert ordering
+
+  // extra bands summed by calc_outputs
+  std::vector<const image_float*> _band_images;
+  std::vector<const image_float*> _band_bg_images;
+  std::vector<const image_float*> _band_bg_expmaps;
 
-  typedef std::vector< point_ushort >  _Pt_sorted_vec;
+  typedef std::vector< point_int >  _Pt_sorted_vec;
 
-  _Pt_sorted_vec _sorted_pixels;
+  // (shared between binners using the same order)
+  std::shared_ptr<const _Pt_sorted_vec> _sorted_pixels;
+  bool _sorted_down;
   _Pt_sorted_vec::const_iterator _sorted_pix_posn;
+
+  std::string _output_suffix;
+
+  bool _bin_down;
+
+  std::string _checkpoint_fname;
+  checkpoint_timer _checkpoint_timer;
+
+  // numbers of the bins kept by set_previous_bins (the first bins),
+  // and of the old bins which were removed
+  bool _incremental;
+  std::vector<long> _prev_numbers;
+  std::vector<long> _free_numbers;
+  long _next_number;
+  bool _numbered;  // whether number_bins has been called
+
+  // state read by resume()
+  bool _resumed;
+  stage_type _resume_stage;
+  size_t _resume_posn;
+  std::vector<bool> _resume_waiting;
 };
 
 #endif
@@ -0,0 +1,99 @@
+// checkpoint files, for resuming long runs
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#include <cstdio>
+
+#include "checkpoint.hh"
+
+checkpoint_file::checkpoint_file(const std::string& filename,
+				 const mode_type mode)
+  : _filename(filename),
+    _tmp_filename(filename + ".tmp"),
+    _mode(mode)
+{
+  if( _mode == read_mode )
+    _stream.open( _filename.c_str(), std::ios::in | std::ios::binary );
+  else
+    _stream.open( _tmp_filename.c_str(),
+		  std::ios::out | std::ios::trunc | std::ios::binary );
+
+  if( ! _stream )
+    {
+      std::cerr << "(!) Could not open checkpoint file "
+		<< ( _mode == read_mode ? _filename : _tmp_filename )
+		<< '\n';
+      std::exit(1);
+    }
+}
+
+void checkpoint_file::commit()
+{
+  _stream.close();
+  if( _stream.fail() ||
+      std::rename( _tmp_filename.c_str(), _filename.c_str() ) != 0 )
+    {
+      std::cerr << "(!) Could not write checkpoint file "
+		<< _filename << '\n';
+      std::exit(1);
+    }
+}
+
+void checkpoint_file::write(const void* data, const size_t size)
+{
+  _stream.write( static_cast<const char*>(data), size );
+  if( ! _stream )
+    {
+      std::cerr << "(!) Could not write checkpoint file "
+		<< _tmp_filename << '\n';
+      std::exit(1);
+    }
+}
+
+void checkpoint_file::read(void* data, const size_t size)
+{
+  _stream.read( static_cast<char*>(data), size );
+  if( ! _stream )
+    {
+      std::cerr << "(!) Checkpoint file " << _filename
+		<< " is truncated or unreadable\n";
+      std::exit(1);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+checkpoint_timer::checkpoint_timer(const unsigned long every_steps,
+				   const double every_secs)
+  : _every_steps(every_steps),
+    _every_secs(every_secs),
+    _steps(0),
+    _start( std::chrono::steady_clock::now() )
+{
+}
+
+bool checkpoint_timer::step(const unsigned long steps)
+{
+  if( ! enabled() )
+    return false;
+
+  _steps += steps;
+  if( _every_steps != 0 && _steps >= _every_steps )
+    return true;
+
+  if( _every_secs > 0 )
+    {
+      const std::chrono::duration<double> elapsed =
+	std::chrono::steady_clock::now() - _start;
+      if( elapsed.count() >= _every_secs )
+	return true;
+    }
+
+  return false;
+}
+
+void checkpoint_timer::reset()
+{
+  _steps = 0;
+  _start = std::chrono::steady_clock::now();
+}
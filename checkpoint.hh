@@ -0,0 +1,136 @@
+// checkpoint files, for resuming long runs
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#ifndef CHECKPOINT_HH
+#define CHECKPOINT_HH
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <iostream>
+#include <cstdlib>
+
+#include "memimage.hh"
+
+// Reads or writes a checkpoint file as a sequence of plain values,
+// vectors and images, in the byte order of this machine (so resume
+// on the same type of machine). When writing, the data go into a
+// temporary file which replaces the old checkpoint on commit(), so
+// the last checkpoint is kept if the program dies while writing.
+// Errors print a message and exit.
+class checkpoint_file
+{
+public:
+  enum mode_type { read_mode, write_mode };
+
+  checkpoint_file(const std::string& filename, const mode_type mode);
+
+  // finish writing, replacing the old checkpoint
+  void commit();
+
+  template<class T> void put(const T& val)
+  {
+    write(&val, sizeof(T));
+  }
+  template<class T> void put_vector(const std::vector<T>& vec);
+  template<class T> void put_image(const dm::memimage<T>& image);
+
+  template<class T> void get(T* val)
+  {
+    read(val, sizeof(T));
+  }
+  template<class T> void get_vector(std::vector<T>* vec);
+  // image must already have the size of the stored image
+  template<class T> void get_image(dm::memimage<T>* image);
+
+  const std::string& filename() const { return _filename; }
+
+private:
+  void write(const void* data, const size_t size);
+  void read(void* data, const size_t size);
+
+private:
+  const std::string _filename, _tmp_filename;
+  const mode_type _mode;
+  std::fstream _stream;
+};
+
+// Decides when checkpoints are due, after a number of steps (e.g. bins
+// made) or after a time in seconds, whichever comes first. Zero
+// disables either.
+class checkpoint_timer
+{
+public:
+  checkpoint_timer(const unsigned long every_steps = 0,
+		   const double every_secs = 0);
+
+  bool enabled() const { return _every_steps != 0 || _every_secs > 0; }
+
+  // count steps done, returning true if a checkpoint is due
+  bool step(const unsigned long steps = 1);
+
+  // start counting again after a checkpoint
+  void reset();
+
+private:
+  unsigned long _every_steps;
+  double _every_secs;
+  unsigned long _steps;
+  std::chrono::steady_clock::time_point _start;
+};
+
+////////////////////////////////////////////////////////////////////////
+// template implementation
+
+template<class T> void checkpoint_file::put_vector(const std::vector<T>& vec)
+{
+  put( (unsigned long long)(vec.size()) );
+  if( ! vec.empty() )
+    write( &vec[0], vec.size()*sizeof(T) );
+}
+
+template<class T> void checkpoint_file::put_image(const dm::memimage<T>& image)
+{
+  put( image.xw() );
+  put( image.yw() );
+
+  // write row by row, leaving out any border
+  std::vector<T> row( image.xw() );
+  for( unsigned y = 0; y != image.yw(); ++y )
+    {
+      for( unsigned x = 0; x != image.xw(); ++x )
+	row[x] = image(x, y);
+      if( ! row.empty() )
+	write( &row[0], row.size()*sizeof(T) );
+    }
+}
+
+template<class T> void checkpoint_file::get_vector(std::vector<T>* vec)
+{
+  unsigned long long size;
+  get( &size );
+  vec->resize( size );
+  if( size != 0 )
+    read( &(*vec)[0], size*sizeof(T) );
+}
+
+template<class T> void checkpoint_file::get_image(dm::memimage<T>* image)
+{
+  unsigned xw, yw;
+  get( &xw );
+  get( &yw );
+  if( xw != image->xw() || yw != image->yw() )
+    {
+      std::cerr << "(!) Image in checkpoint " << _filename
+		<< " has the wrong size\n";
+      std::exit(1);
+    }
+
+  // rows are contiguous, even if the image has a border
+  for( unsigned y = 0; y != yw && xw != 0; ++y )
+    read( &(*image)(0, y), size_t(xw)*sizeof(T) );
+}
+
+#endif
@@ -9,6 +9,10 @@
 #include <string>
 #include <algorithm>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <limits>
+#include <map>
 
 #include <cmath>
 #include <cassert>
@@ -29,6 +33,110 @@ using std::find;
 using std::ostringstream;
 using std::cout;
 
+// add suffix to a filename, before its extension (e.g. .fits or
+// .fits.gz)
+static string add_suffix(const string& filename, const string& suffix)
+{
+  const size_t dir = filename.rfind('/');
+  const size_t start = dir == string::npos ? 0 : dir+1;
+
+  size_t ext = filename.rfind(".fits");
+  if( ext == string::npos || ext < start )
+    ext = filename.rfind('.');
+  if( ext == string::npos || ext <= start )
+    return filename + suffix;
+
+  return filename.substr(0, ext) + suffix + filename.substr(ext);
+}
+
+// how the pixels in a block are combined by block_image
+enum block_mode { block_sum, block_mean, block_quadrature };
+
+// combine the unmasked pixels in each block of factor x factor pixels
+static image_float* block_image(const image_float& image,
+				const image_short& mask,
+				const unsigned factor,
+				const block_mode mode)
+{
+  const unsigned xw = (image.xw() + factor - 1) / factor;
+  const unsigned yw = (image.yw() + factor - 1) / factor;
+  image_float* out = new image_float(xw, yw, 0.f);
+  image_int no(xw, yw, 0);
+
+  for(unsigned y = 0; y != image.yw(); ++y)
+    for(unsigned x = 0; x != image.xw(); ++x)
+      {
+	if( mask(x, y) < 1 )
+	  continue;
+	const float v = image(x, y);
+	(*out)(x/factor, y/factor) += mode == block_quadrature ? v*v : v;
+	++no(x/factor, y/factor);
+      }
+
+  for(unsigned y = 0; y != yw; ++y)
+    for(unsigned x = 0; x != xw; ++x)
+      {
+	if( mode == block_mean && no(x, y) != 0 )
+	  (*out)(x, y) /= no(x, y);
+	else if( mode == block_quadrature )
+	  (*out)(x, y) = std::sqrt( (*out)(x, y) );
+      }
+
+  return out;
+}
+
+// a block is unmasked if any of its pixels are
+static image_short* block_mask(const image_short& mask, const unsigned factor)
+{
+  image_short* out = new image_short( (mask.xw() + factor - 1) / factor,
+				      (mask.yw() + factor - 1) / factor,
+				      short(0) );
+  for(unsigned y = 0; y != mask.yw(); ++y)
+    for(unsigned x = 0; x != mask.xw(); ++x)
+      if( mask(x, y) >= 1 )
+	(*out)(x/factor, y/factor) = 1;
+  return out;
+}
+
+// interpolate an image made by block_image back to xw x yw pixels,
+// using the unmasked blocks
+static image_float* unblock_image(const image_float& image,
+				  const image_short& mask,
+				  const unsigned factor,
+				  const unsigned xw, const unsigned yw)
+{
+  image_float* out = new image_float(xw, yw, 0.f);
+  const int bxw = image.xw(), byw = image.yw();
+  const double centre = (factor - 1) * 0.5;
+
+  for(unsigned y = 0; y != yw; ++y)
+    for(unsigned x = 0; x != xw; ++x)
+      {
+	// blocks around pixel, and distances to them
+	const double u = (x - centre) / factor;
+	const double v = (y - centre) / factor;
+	const int x0 = int(std::floor(u)), y0 = int(std::floor(v));
+	const double tx = u - x0, ty = v - y0;
+
+	double sum = 0, sumw = 0;
+	for(int j = 0; j != 2; ++j)
+	  for(int i = 0; i != 2; ++i)
+	    {
+	      const int bx = std::min( std::max(x0+i, 0), bxw-1 );
+	      const int by = std::min( std::max(y0+j, 0), byw-1 );
+	      if( mask(bx, by) < 1 )
+		continue;
+	      const double w = (i ? tx : 1-tx) * (j ? ty : 1-ty);
+	      sum += w * image(bx, by);
+	      sumw += w;
+	    }
+
+	(*out)(x, y) = sumw > 0 ? sum / sumw : image(x/factor, y/factor);
+      }
+
+  return out;
+}
+
 class program
 {
 public:
@@ -38,14 +146,92 @@ public:
 
 private:
   void auto_mask(const image_float& in_data, image_short* mask);
+  void auto_mask_window(FITSFile& indataset, image_short* mask);
   
   template<class T> void save_image(const string& filename, const T& image,
 				    FITSFile* indataset);
+  // create an empty xw x yw image, to be written a part at a time
+  template<class T> void start_image(FITSFile& dataset,
+				     const string& filename,
+				     const unsigned xw, const unsigned yw,
+				     FITSFile* indataset);
   template<class T> void load_image(const string& filename, double *exposure,
 				    T** image);
+  template<class T> void read_image(FITSFile& dataset, T** image);
+  void save_catalogue(const string& filename,
+		      const bin_summary_vector& summaries);
+  void save_tree(const string& filename, const merge_tree& tree);
+  void write_history(FITSFile* dataset, const string& filename);
+
+  // the input images (or the window of them being binned), made the
+  // same size as the input image and masked where there is no exposure
+  struct input_images
+  {
+    delete_ptr<image_float> in_image, expmap, bg_image, bg_expmap, noisemap;
+    delete_ptr<image_short> mask;
+    vector< std::unique_ptr<image_float> > bands, band_bgs, band_bg_expmaps;
+  };
+  void load_inputs(FITSFile& indataset, input_images* in,
+		   const bool verbose = true);
+
+  // apply the options to a binner
+  void setup_binner(binner& b, const input_images& in,
+		    const unsigned threads, const string& checkpoint_fname);
+
+  // make the bins with the chosen engine
+  void do_binning(binner& b) const
+  {
+    if( _engine == "tree" )
+      b.do_binning_tree(!_binup);
+    else
+      b.do_binning(!_binup);
+  }
+
+  image_long* preview_binmap(const image_float& in_image,
+			     const image_float* bg_image,
+			     const image_short& mask,
+			     const image_float& expmap,
+			     const image_float& bg_expmap,
+			     const image_float* noisemap,
+			     delete_ptr<image_float>* smoothed_image);
+
+  // pixels x0 <= x < x1, y0 <= y < y1 of shard k of an xw x yw
+  // image, with halo pixels added around it
+  void shard_range(const unsigned k, const unsigned xw, const unsigned yw,
+		   const unsigned halo, unsigned* x0, unsigned* y0,
+		   unsigned* x1, unsigned* y1) const;
+  void write_shard_keys(FITSFile& dataset);
+  void merge_shards(FITSFile& indataset);
+  long merge_shard_cores(FITSFile& binmap_file, const unsigned xw,
+			 const unsigned yw, vector<char>* crossing,
+			 vector<unsigned long>* shard_crossing);
+  void rebin_shard_edges(FITSFile& indataset, FITSFile& binmap_file,
+			 const unsigned k, const unsigned xw,
+			 const unsigned yw, vector<char>* crossing,
+			 long* next_number);
+  void write_merged_outputs(FITSFile& indataset, FITSFile& binmap_file,
+			    const unsigned xw, const unsigned yw,
+			    const long no_numbers);
+
+  // suffix for output files of shard k
+  static string shard_suffix(const unsigned k)
+  {
+    ostringstream o;
+    o << "_shard" << k;
+    return o.str();
+  }
+
+  // suffix for output files for threshold i of _sn_list
+  string sn_suffix(const size_t i) const
+  {
+    ostringstream o;
+    o << "_sn" << _sn_list[i];
+    return o.str();
+  }
 
 private:
-  string _out_fname, _sn_fname, _binmap_fname;
+  string _out_fname, _sn_fname, _binmap_fname, _cat_fname;
+  string _tree_fname;
   string _bg_fname;
   string _in_fname;
   string _mask_fname;
@@ -53,27 +239,75 @@ private:
   string _expmap_fname, _bg_expmap_fname;
   string _noisemap_fname;
   double _sn_threshold;
+  string _sn_list_str;
+  vector<double> _sn_list;
   double _smooth_sn;
+  string _smooth_mode;
   bool _do_automask;
   bool _constrain_fill;
   double _constrain_val;
   bool _noscrub;
   bool _binup;
   double _scrub_large;
+  bool _bulk_scrub;
+  bool _parallel_scrub;
+  int _threads;
+  string _checkpoint_fname;
+  int _checkpoint_bins;
+  double _checkpoint_secs;
+  bool _resume;
+  string _prev_binmap_fname;
+  string _prev_in_fname;
+  int _preview;
+  int _refine;
+  string _engine;
+  bool _hilbert;
+  string _mask_out_fname;
+
+  string _bands_str, _band_bgs_str;
+  vector<string> _band_fnames, _band_bg_fnames;
+
+  string _shards_str;
+  unsigned _nshard_x, _nshard_y;
+  int _shard;
+  int _halo;
+  bool _merge_shards;
+  // part of the images read for this shard, or the part being merged
+  // (the whole image if _win_xw is 0)
+  unsigned _win_x0, _win_y0, _win_xw, _win_yw;
 };
 
 program::program(int argc, char **argv)
   : _out_fname("contbin_out.fits"),
     _sn_fname("contbin_sn.fits"),
     _binmap_fname("contbin_binmap.fits"),
+    _cat_fname("contbin_cat.fits"),
     _sn_threshold(15.),
     _smooth_sn(15.),
+    _smooth_mode("annuli"),
     _do_automask(false),
     _constrain_fill(false),
     _constrain_val(3),
     _noscrub(false),
     _binup(false),
-    _scrub_large(-1)
+    _scrub_large(-1),
+    _bulk_scrub(false),
+    _parallel_scrub(false),
+    _threads(1),
+    _checkpoint_fname("contbin_checkpoint.dat"),
+    _checkpoint_bins(0),
+    _checkpoint_secs(0),
+    _resume(false),
+    _preview(1),
+    _refine(2),
+    _engine("grow"),
+    _hilbert(false),
+    _mask_out_fname("contbin_mask.fits"),
+    _nshard_x(0), _nshard_y(0),
+    _shard(-1),
+    _halo(64),
+    _merge_shards(false),
+    _win_x0(0), _win_y0(0), _win_xw(0), _win_yw(0)
 {
   parammm::param params(argc, argv);
   params.add_switch( parammm::pswitch("out", 'o',
@@ -88,6 +322,14 @@ program::program(int argc, char **argv)
 				      parammm::pstring_opt(&_binmap_fname),
 				      "set binmap out file (def contbin_binmap.fits)",
 				      "FILE"));
+  params.add_switch( parammm::pswitch("outcat", 0,
+				      parammm::pstring_opt(&_cat_fname),
+				      "set bin catalogue out file (def contbin_cat.fits)",
+				      "FILE"));
+  params.add_switch( parammm::pswitch("outtree", 0,
+				      parammm::pstring_opt(&_tree_fname),
+				      "set merge tree out file (def none)",
+				      "FILE"));
   params.add_switch( parammm::pswitch("bg", 'b',
 				      parammm::pstring_opt(&_bg_fname),
 				      "Set background image file (def none)",
@@ -112,11 +354,23 @@ program::program(int argc, char **argv)
 				      parammm::pstring_opt(&_noisemap_fname),
 				      "Set noise map (def none)",
 				      "FILE"));
+  params.add_switch( parammm::pswitch("bands", 0,
+				      parammm::pstring_opt(&_bands_str),
+				      "sum bins in these band images (def none)",
+				      "FILE,FILE..."));
+  params.add_switch( parammm::pswitch("bandbgs", 0,
+				      parammm::pstring_opt(&_band_bgs_str),
+				      "backgrounds for --bands (def none)",
+				      "FILE,FILE..."));
 
   params.add_switch( parammm::pswitch("sn", 's',
 				      parammm::pdouble_opt(&_sn_threshold),
 				      "set signal:noise threshold (def 15)",
 				      "VAL"));
+  params.add_switch( parammm::pswitch("snlist", 0,
+				      parammm::pstring_opt(&_sn_list_str),
+				      "bin with each of these thresholds",
+				      "VAL,VAL,..."));
 
   params.add_switch( parammm::pswitch("automask", 0,
 				      parammm::pbool_noopt(&_do_automask),
@@ -135,6 +389,10 @@ program::program(int argc, char **argv)
 				      parammm::pdouble_opt(&_smooth_sn),
 				      "set smoothing signal:noise (def 15)",
 				      "VAL"));
+  params.add_switch( parammm::pswitch("smoothmode", 0,
+				      parammm::pstring_opt(&_smooth_mode),
+				      "smoothing: annuli (def), disk or box",
+				      "MODE"));
 
   params.add_switch( parammm::pswitch("noscrub", 0,
 				      parammm::pbool_noopt(&_noscrub),
@@ -149,6 +407,80 @@ program::program(int argc, char **argv)
 				      parammm::pdouble_opt(&_scrub_large),
 				      "Scrub bins with area frac > this",
 				      "VAL"));
+  params.add_switch( parammm::pswitch("bulkscrub", 0,
+				      parammm::pbool_noopt(&_bulk_scrub),
+				      "scrub whole bins at once (quick look)",
+				      ""));
+  params.add_switch( parammm::pswitch("parallelscrub", 0,
+				      parammm::pbool_noopt(&_parallel_scrub),
+				      "scrub separated bins at same time",
+				      ""));
+  params.add_switch( parammm::pswitch("hilbert", 0,
+				      parammm::pbool_noopt(&_hilbert),
+				      "number bins along Hilbert curve",
+				      ""));
+
+  params.add_switch( parammm::pswitch("threads", 't',
+				      parammm::pint_opt(&_threads),
+				      "set number of threads (default 1)",
+				      "VAL"));
+
+  params.add_switch( parammm::pswitch("checkpoint", 0,
+				      parammm::pstring_opt(&_checkpoint_fname),
+				      "set checkpoint file (def contbin_checkpoint.dat)",
+				      "FILE"));
+  params.add_switch( parammm::pswitch("checkpointbins", 0,
+				      parammm::pint_opt(&_checkpoint_bins),
+				      "checkpoint after this many bins (def 0, never)",
+				      "VAL"));
+  params.add_switch( parammm::pswitch("checkpointtime", 0,
+				      parammm::pdouble_opt(&_checkpoint_secs),
+				      "checkpoint after this many seconds (def 0, never)",
+				      "VAL"));
+  params.add_switch( parammm::pswitch("resume", 0,
+				      parammm::pbool_noopt(&_resume),
+				      "carry on from checkpoint file",
+				      ""));
+
+  params.add_switch( parammm::pswitch("prevbinmap", 0,
+				      parammm::pstring_opt(&_prev_binmap_fname),
+				      "only rebin what changed since this binmap",
+				      "FILE"));
+  params.add_switch( parammm::pswitch("previn", 0,
+				      parammm::pstring_opt(&_prev_in_fname),
+				      "input image used for --prevbinmap",
+				      "FILE"));
+
+  params.add_switch( parammm::pswitch("engine", 0,
+				      parammm::pstring_opt(&_engine),
+				      "binning: grow (def) or tree",
+				      "MODE"));
+
+  params.add_switch( parammm::pswitch("preview", 0,
+				      parammm::pint_opt(&_preview),
+				      "bin in blocks of VALxVAL pixels first (def 1)",
+				      "VAL"));
+  params.add_switch( parammm::pswitch("refine", 0,
+				      parammm::pint_opt(&_refine),
+				      "preview boundary refinement passes (def 2)",
+				      "VAL"));
+
+  params.add_switch( parammm::pswitch("shards", 0,
+				      parammm::pstring_opt(&_shards_str),
+				      "split image into NXxNY shards",
+				      "NX,NY"));
+  params.add_switch( parammm::pswitch("shard", 0,
+				      parammm::pint_opt(&_shard),
+				      "bin only shard number VAL (from 0)",
+				      "VAL"));
+  params.add_switch( parammm::pswitch("halo", 0,
+				      parammm::pint_opt(&_halo),
+				      "pixels around each shard to bin (def 64)",
+				      "VAL"));
+  params.add_switch( parammm::pswitch("mergeshards", 0,
+				      parammm::pbool_noopt(&_merge_shards),
+				      "merge the binmaps of the shards",
+				      ""));
 
   params.set_autohelp("Usage: contbin [OPTIONS] file.fits\n"
 		      "Contour binning program\n"
@@ -166,10 +498,168 @@ program::program(int argc, char **argv)
     {
       params.show_autohelp();
     }
+  else if( _bulk_scrub && _constrain_fill )
+    {
+      std::cerr << "(!) --bulkscrub cannot be used with --constrainfill\n";
+      std::exit(1);
+    }
+  else if( _threads < 1 )
+    {
+      std::cerr << "(!) --threads must be at least 1\n";
+      std::exit(1);
+    }
   else
     {
       _in_fname = params.args()[0];
     }
+
+  if( ! _sn_list_str.empty() )
+    {
+      const vector<string> items = split_string(_sn_list_str + ',', ',');
+      for(vector<string>::const_iterator i = items.begin();
+	  i != items.end(); ++i)
+	{
+	  char* end;
+	  const double val = std::strtod(i->c_str(), &end);
+	  if( i->empty() || *end != 0 || ! (val > 0) )
+	    {
+	      std::cerr << "(!) Invalid threshold '" << *i
+			<< "' in --snlist\n";
+	      std::exit(1);
+	    }
+	  _sn_list.push_back(val);
+	}
+
+      if( _resume )
+	{
+	  std::cerr << "(!) --resume cannot be used with --snlist\n";
+	  std::exit(1);
+	}
+    }
+
+  if( ! _prev_binmap_fname.empty() && ( _resume || ! _sn_list.empty() ) )
+    {
+      std::cerr << "(!) --prevbinmap cannot be used with --resume or --snlist\n";
+      std::exit(1);
+    }
+  if( ! _prev_binmap_fname.empty() && _hilbert )
+    {
+      std::cerr << "(!) --hilbert cannot be used with --prevbinmap\n";
+      std::exit(1);
+    }
+  if( ! _prev_in_fname.empty() && _prev_binmap_fname.empty() )
+    {
+      std::cerr << "(!) --previn needs --prevbinmap\n";
+      std::exit(1);
+    }
+  // (only the rebinned region is smoothed, but the merge tree needs
+  // smoothed values across every bin boundary)
+  if( ! _tree_fname.empty() &&
+      ( ! _prev_binmap_fname.empty() || _merge_shards ) )
+    {
+      std::cerr << "(!) --outtree cannot be used with --prevbinmap or"
+	" --mergeshards\n";
+      std::exit(1);
+    }
+
+  if( _engine != "grow" && _engine != "tree" )
+    {
+      std::cerr << "(!) Invalid --engine '" << _engine << "'\n";
+      std::exit(1);
+    }
+  if( _engine == "tree" && ( _constrain_fill || _resume ) )
+    {
+      std::cerr << "(!) --engine=tree cannot be used with --constrainfill"
+	" or --resume\n";
+      std::exit(1);
+    }
+
+  if( _preview < 1 || _refine < 0 )
+    {
+      std::cerr << "(!) Invalid --preview or --refine\n";
+      std::exit(1);
+    }
+  if( _preview > 1 && ( _resume || ! _sn_list.empty() ||
+			! _prev_binmap_fname.empty() ) )
+    {
+      std::cerr << "(!) --preview cannot be used with --resume, --snlist"
+	" or --prevbinmap\n";
+      std::exit(1);
+    }
+
+  if( ! _bands_str.empty() )
+    _band_fnames = split_string(_bands_str + ',', ',');
+  if( ! _band_bgs_str.empty() )
+    _band_bg_fnames = split_string(_band_bgs_str + ',', ',');
+  if( std::count( _band_fnames.begin(), _band_fnames.end(), string() ) ||
+      std::count( _band_bg_fnames.begin(), _band_bg_fnames.end(), string() ) )
+    {
+      std::cerr << "(!) Empty filename in --bands or --bandbgs\n";
+      std::exit(1);
+    }
+  if( ! _band_bg_fnames.empty() &&
+      _band_bg_fnames.size() != _band_fnames.size() )
+    {
+      std::cerr << "(!) --bandbgs must have one file for each of --bands\n";
+      std::exit(1);
+    }
+
+  if( ! _shards_str.empty() )
+    {
+      const vector<string> items = split_string(_shards_str + ',', ',');
+      if( items.size() == 2 )
+	{
+	  _nshard_x = std::atoi(items[0].c_str());
+	  _nshard_y = std::atoi(items[1].c_str());
+	}
+      if( items.size() != 2 || int(_nshard_x) < 1 || int(_nshard_y) < 1 )
+	{
+	  std::cerr << "(!) Invalid --shards '" << _shards_str << "'\n";
+	  std::exit(1);
+	}
+      if( (_shard >= 0) == _merge_shards )
+	{
+	  std::cerr << "(!) --shards needs one of --shard or --mergeshards\n";
+	  std::exit(1);
+	}
+      if( _shard >= int(_nshard_x*_nshard_y) || _halo < 0 )
+	{
+	  std::cerr << "(!) Invalid --shard or --halo\n";
+	  std::exit(1);
+	}
+    }
+  else if( _shard >= 0 || _merge_shards )
+    {
+      std::cerr << "(!) --shard and --mergeshards need --shards\n";
+      std::exit(1);
+    }
+
+  if( _shard >= 0 && ( ! _sn_list.empty() || ! _prev_binmap_fname.empty() ) )
+    {
+      std::cerr << "(!) --shard cannot be used with --snlist or --prevbinmap\n";
+      std::exit(1);
+    }
+  if( _merge_shards && ( _resume || ! _sn_list.empty() ||
+			 ! _prev_binmap_fname.empty() || _preview > 1 ) )
+    {
+      std::cerr << "(!) --mergeshards cannot be used with --resume, --snlist,"
+	" --prevbinmap or --preview\n";
+      std::exit(1);
+    }
+
+  // each shard writes its own output files
+  if( _shard >= 0 )
+    {
+      const string suffix = shard_suffix(_shard);
+      _out_fname = add_suffix(_out_fname, suffix);
+      _sn_fname = add_suffix(_sn_fname, suffix);
+      _binmap_fname = add_suffix(_binmap_fname, suffix);
+      _cat_fname = add_suffix(_cat_fname, suffix);
+      _mask_out_fname = add_suffix(_mask_out_fname, suffix);
+      _checkpoint_fname = add_suffix(_checkpoint_fname, suffix);
+      if( ! _tree_fname.empty() )
+	_tree_fname = add_suffix(_tree_fname, suffix);
+    }
 }
 
 void program::auto_mask(const image_float& in_data, image_short* mask)
@@ -225,6 +715,36 @@ void program::auto_mask(const image_float& in_data, image_short* mask)
   cout << "Done\n";
 }
 
+// automask the window of the image being read. The blocks must lie on
+// the grid of the whole image, so the window is widened to whole
+// blocks, giving each window the mask of the whole image
+void program::auto_mask_window(FITSFile& indataset, image_short* mask)
+{
+  const unsigned blocksize = 8;
+
+  long fullxw, fullyw;
+  indataset.readKey("NAXIS1", &fullxw);
+  indataset.readKey("NAXIS2", &fullyw);
+
+  const unsigned x0 = _win_x0 - _win_x0 % blocksize;
+  const unsigned y0 = _win_y0 - _win_y0 % blocksize;
+  const unsigned x1 = std::min( unsigned(fullxw),
+				( (_win_x0 + _win_xw + blocksize - 1) /
+				  blocksize ) * blocksize );
+  const unsigned y1 = std::min( unsigned(fullyw),
+				( (_win_y0 + _win_yw + blocksize - 1) /
+				  blocksize ) * blocksize );
+
+  delete_ptr<image_float> wide;
+  indataset.readImageSection(wide.pptr(), x0, y0, x1-x0, y1-y0);
+  image_short wide_mask( x1-x0, y1-y0 );
+  auto_mask( *wide, &wide_mask );
+
+  for(unsigned y = 0; y != _win_yw; ++y)
+    for(unsigned x = 0; x != _win_xw; ++x)
+      mask->pixel(x, y) = wide_mask(x + _win_x0 - x0, y + _win_y0 - y0);
+}
+
 // handy template to load an image
 template<class T> void program::load_image(const string& filename, double *exposure,
 					   T** image)
@@ -237,7 +757,17 @@ template<class T> void program::load_image(const string& filename, double *expos
       dataset.readKey("EXPOSURE", exposure, &defval);
     }
   
-  dataset.readImage(image);
+  read_image(dataset, image);
+}
+
+// read the whole image, or only the window when binning or merging
+// shards
+template<class T> void program::read_image(FITSFile& dataset, T** image)
+{
+  if( _win_xw != 0 )
+    dataset.readImageSection(image, _win_x0, _win_y0, _win_xw, _win_yw);
+  else
+    dataset.readImage(image);
 }
 
 // write an image with some sensible headers
@@ -249,8 +779,661 @@ template<class T> void program::save_image(const string& filename, const T& imag
   dataset.writeImage(image);
 
   indataset->copyHeaderTo(dataset);
+  if( _shard >= 0 )
+    write_shard_keys(dataset);
+
+  write_history(&dataset, filename);
+}
+
+template<class T> void program::start_image(FITSFile& dataset,
+					    const string& filename,
+					    const unsigned xw,
+					    const unsigned yw,
+					    FITSFile* indataset)
+{
+  dataset.createImage<T>(xw, yw);
+
+  indataset->copyHeaderTo(dataset);
+  write_history(&dataset, filename);
+}
+
+// write a table with a row for each bin
+void program::save_catalogue(const string& filename,
+			     const bin_summary_vector& summaries)
+{
+  const size_t nrows = summaries.size();
+  vector<long> bin_no(nrows), count(nrows), orig_bin_no(nrows);
+  vector<double> signal(nrows), noise(nrows), sn(nrows);
+  vector<double> x_cen(nrows), y_cen(nrows), exposure(nrows);
+  vector<int> x_min(nrows), y_min(nrows), x_max(nrows), y_max(nrows);
+
+  for(size_t i = 0; i != nrows; ++i)
+    {
+      const bin_summary& s = summaries[i];
+      bin_no[i] = s.bin_no;
+      count[i] = s.count;
+      signal[i] = s.signal;
+      noise[i] = s.noise;
+      sn[i] = s.sn;
+      x_cen[i] = s.x_cen;
+      y_cen[i] = s.y_cen;
+      x_min[i] = s.x_min;
+      y_min[i] = s.y_min;
+      x_max[i] = s.x_max;
+      y_max[i] = s.y_max;
+      exposure[i] = s.exposure;
+      orig_bin_no[i] = s.orig_bin_no;
+    }
+
+  const char* const names[] = {
+    "BIN", "NPIX", "SIGNAL", "NOISE", "SN", "X", "Y",
+    "XMIN", "YMIN", "XMAX", "YMAX", "EXPOSURE", "ORIGBIN" };
+  const char* const formats[] = {
+    "1K", "1K", "1D", "1D", "1D", "1D", "1D",
+    "1J", "1J", "1J", "1J", "1D", "1K" };
+  const char* const units[] = {
+    "", "pixel", "count", "count", "", "pixel", "pixel",
+    "pixel", "pixel", "pixel", "pixel", "", "" };
+  const unsigned nocols = sizeof(names) / sizeof(names[0]);
+
+  vector<string> colnames(names, names+nocols);
+  vector<string> colformats(formats, formats+nocols);
+  vector<string> colunits(units, units+nocols);
+
+  // columns for each band, numbered from 0
+  const char* const band_names[] = { "COUNTS_B", "SIGNAL_B", "NOISE_B", "SN_B" };
+  const char* const band_units[] = { "count", "count", "count", "" };
+  for(size_t b = 0; b != _band_fnames.size(); ++b)
+    for(unsigned c = 0; c != 4; ++c)
+      {
+	ostringstream o;
+	o << band_names[c] << b;
+	colnames.push_back(o.str());
+	colformats.push_back("1D");
+	colunits.push_back(band_units[c]);
+      }
+
+  FITSFile dataset(filename, FITSFile::Create);
+  dataset.createTable("BINS", nrows, colnames, colformats, colunits);
+  dataset.writeColumn(1, bin_no);
+  dataset.writeColumn(2, count);
+  dataset.writeColumn(3, signal);
+  dataset.writeColumn(4, noise);
+  dataset.writeColumn(5, sn);
+  dataset.writeColumn(6, x_cen);
+  dataset.writeColumn(7, y_cen);
+  dataset.writeColumn(8, x_min);
+  dataset.writeColumn(9, y_min);
+  dataset.writeColumn(10, x_max);
+  dataset.writeColumn(11, y_max);
+  dataset.writeColumn(12, exposure);
+  dataset.writeColumn(13, orig_bin_no);
+  dataset.updateKey("BINORDER", _hilbert ? "HILBERT" : "SEED");
+
+  for(size_t b = 0; b != _band_fnames.size(); ++b)
+    {
+      vector<double> counts(nrows), signal(nrows), noise(nrows), sn(nrows);
+      for(size_t i = 0; i != nrows; ++i)
+	{
+	  const bin_summary& s = summaries[i];
+	  counts[i] = s.band_counts[b];
+	  signal[i] = s.band_signal[b];
+	  noise[i] = s.band_noise[b];
+	  sn[i] = s.band_sn[b];
+	}
+
+      const int col = nocols + 4*b + 1;
+      dataset.writeColumn(col, counts);
+      dataset.writeColumn(col+1, signal);
+      dataset.writeColumn(col+2, noise);
+      dataset.writeColumn(col+3, sn);
+
+      ostringstream key;
+      key << "BAND" << b;
+      dataset.updateKey(key.str(), _band_fnames[b]);
+      if( ! _band_bg_fnames.empty() )
+	{
+	  ostringstream bgkey;
+	  bgkey << "BANDBG" << b;
+	  dataset.updateKey(bgkey.str(), _band_bg_fnames[b]);
+	}
+    }
+
+  write_history(&dataset, filename);
+}
+
+// write the tree of bin merges as a table
+void program::save_tree(const string& filename, const merge_tree& tree)
+{
+  FITSFile dataset(filename, FITSFile::Create);
+  tree.write(dataset);
+  write_history(&dataset, filename);
+}
+
+void program::shard_range(const unsigned k, const unsigned xw,
+			  const unsigned yw, const unsigned halo,
+			  unsigned* x0, unsigned* y0,
+			  unsigned* x1, unsigned* y1) const
+{
+  // shards are numbered along rows
+  const unsigned kx = k % _nshard_x;
+  const unsigned ky = k / _nshard_x;
+
+  const unsigned cx0 = (unsigned long long)(xw) * kx / _nshard_x;
+  const unsigned cx1 = (unsigned long long)(xw) * (kx+1) / _nshard_x;
+  const unsigned cy0 = (unsigned long long)(yw) * ky / _nshard_y;
+  const unsigned cy1 = (unsigned long long)(yw) * (ky+1) / _nshard_y;
+
+  *x0 = cx0 > halo ? cx0 - halo : 0;
+  *y0 = cy0 > halo ? cy0 - halo : 0;
+  *x1 = std::min( cx1 + halo, xw );
+  *y1 = std::min( cy1 + halo, yw );
+}
+
+// record where the window of the shard is in the whole image, and
+// move the reference pixels of its coordinate systems to the window
+void program::write_shard_keys(FITSFile& dataset)
+{
+  dataset.updateKey("SHARD", long(_shard));
+  dataset.updateKey("NSHARDX", long(_nshard_x));
+  dataset.updateKey("NSHARDY", long(_nshard_y));
+  dataset.updateKey("SHARDX0", long(_win_x0));
+  dataset.updateKey("SHARDY0", long(_win_y0));
+
+  // CRPIXn of the world coordinates (and alternate ones, such as the
+  // physical coordinates in CRPIXnP), and the IRAF physical offsets
+  // LTVn, count from the first pixel of the image
+  const string alts = " ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  const double missing = std::numeric_limits<double>::quiet_NaN();
+  for(unsigned axis = 1; axis <= 2; ++axis)
+    {
+      const double shift = axis == 1 ? _win_x0 : _win_y0;
+
+      ostringstream ltv;
+      ltv << "LTV" << axis;
+      vector<string> keys( 1, ltv.str() );
+      for(size_t i = 0; i != alts.size(); ++i)
+	{
+	  ostringstream crpix;
+	  crpix << "CRPIX" << axis;
+	  if( alts[i] != ' ' )
+	    crpix << alts[i];
+	  keys.push_back( crpix.str() );
+	}
+
+      for(size_t i = 0; i != keys.size(); ++i)
+	{
+	  double val;
+	  dataset.readKey(keys[i], &val, &missing);
+	  if( ! std::isnan(val) )
+	    dataset.updateKey(keys[i], val - shift);
+	}
+    }
+}
+
+// Combine the binmaps written for each shard into the output binmap,
+// taking each pixel from the shard it is in (without the halo). Bins
+// which reach into the halo of their shard may have been cut off or
+// grown differently by the shard next to it, so they are binned again
+// with the bins around them. Only the window of a shard, or a strip of
+// rows, of each image is read at once.
+void program::merge_shards(FITSFile& indataset)
+{
+  long xw, yw;
+  indataset.readKey("NAXIS1", &xw);
+  indataset.readKey("NAXIS2", &yw);
+  if( xw < long(_nshard_x) || yw < long(_nshard_y) )
+    {
+      std::cerr << "(!) Too many shards for the image size\n";
+      std::exit(1);
+    }
+
+  FITSFile binmap_file(_binmap_fname, FITSFile::Create);
+  start_image<long>(binmap_file, _binmap_fname, xw, yw, &indataset);
+
+  vector<char> crossing;
+  vector<unsigned long> shard_crossing;
+  long next_number = merge_shard_cores(binmap_file, xw, yw, &crossing,
+				       &shard_crossing);
+
+  for(unsigned k = 0; k != shard_crossing.size(); ++k)
+    if( shard_crossing[k] != 0 )
+      rebin_shard_edges(indataset, binmap_file, k, xw, yw, &crossing,
+			&next_number);
+
+  write_merged_outputs(indataset, binmap_file, xw, yw, next_number);
+}
+
+// copy the core of each shard binmap into the output binmap, numbering
+// the bins of each shard after those of the ones before, and return the
+// number of bin numbers used. The bins with pixels outside the core of
+// their shard are set in crossing, and counted for each shard in
+// shard_crossing.
+long program::merge_shard_cores(FITSFile& binmap_file, const unsigned xw,
+				const unsigned yw, vector<char>* crossing,
+				vector<unsigned long>* shard_crossing)
+{
+  const unsigned no_shards = _nshard_x * _nshard_y;
+  shard_crossing->assign( no_shards, 0 );
+
+  long offset = 0;
+  for(unsigned k = 0; k != no_shards; ++k)
+    {
+      const string fname = add_suffix(_binmap_fname, shard_suffix(k));
+      cout << "(i) Loading shard binmap " << fname << '\n';
+
+      FITSFile dataset(fname);
+      delete_ptr<image_long> binmap;
+      dataset.readImage(binmap.pptr());
+      long shard, nx, ny, wx0, wy0;
+      dataset.readKey("SHARD", &shard);
+      dataset.readKey("NSHARDX", &nx);
+      dataset.readKey("NSHARDY", &ny);
+      dataset.readKey("SHARDX0", &wx0);
+      dataset.readKey("SHARDY0", &wy0);
+
+      unsigned cx0, cy0, cx1, cy1;
+      shard_range(k, xw, yw, 0, &cx0, &cy0, &cx1, &cy1);
+
+      const long wx1 = wx0 + long(binmap->xw());
+      const long wy1 = wy0 + long(binmap->yw());
+      if( shard != long(k) || nx != long(_nshard_x) || ny != long(_nshard_y) ||
+	  wx0 > long(cx0) || wy0 > long(cy0) ||
+	  wx1 < long(cx1) || wy1 < long(cy1) ||
+	  wx1 > long(xw) || wy1 > long(yw) )
+	{
+	  std::cerr << "(!) Shard binmap " << fname
+		    << " does not match --shards and the input image\n";
+	  std::exit(1);
+	}
+
+      const long no_bins = std::max( binmap->max() + 1, 0L );
+      crossing->resize( offset + no_bins, 0 );
+      for(unsigned y = 0; y != binmap->yw(); ++y)
+	for(unsigned x = 0; x != binmap->xw(); ++x)
+	  {
+	    const long b = (*binmap)(x, y);
+	    const unsigned ix = x + wx0, iy = y + wy0;
+	    if( b >= 0 && ( ix < cx0 || ix >= cx1 || iy < cy0 || iy >= cy1 ) )
+	      (*crossing)[offset + b] = 1;
+	  }
+      (*shard_crossing)[k] = std::count( crossing->begin() + offset,
+					 crossing->end(), 1 );
+
+      image_long core( cx1 - cx0, cy1 - cy0, -1L );
+      for(unsigned y = cy0; y != cy1; ++y)
+	for(unsigned x = cx0; x != cx1; ++x)
+	  {
+	    const long b = (*binmap)(x - wx0, y - wy0);
+	    if( b >= 0 )
+	      core(x - cx0, y - cy0) = b + offset;
+	  }
+      binmap_file.writeImageSection(core, cx0, cy0);
 
-  dataset.writeDatestamp("contbin");
+      offset += no_bins;
+    }
+
+  cout << "(i) Merged " << no_shards << " shards, rebinning "
+       << std::count( crossing->begin(), crossing->end(), 1 )
+       << " bins which cross their edges\n";
+
+  return offset;
+}
+
+// Rebin the bins of shard k which cross the edges of its core, and the
+// bins next to them, reading only the window of the shard from the
+// images and the output binmap. Bins which touch the edge of the window
+// may carry on outside it, so are kept. New bins take the numbers of
+// the removed bins, then numbers from next_number.
+void program::rebin_shard_edges(FITSFile& indataset, FITSFile& binmap_file,
+				const unsigned k, const unsigned xw,
+				const unsigned yw, vector<char>* crossing,
+				long* next_number)
+{
+  unsigned x1, y1;
+  shard_range(k, xw, yw, _halo, &_win_x0, &_win_y0, &x1, &y1);
+  _win_xw = x1 - _win_x0;
+  _win_yw = y1 - _win_y0;
+  cout << "(i) Rebinning the edges of shard " << k << " (" << _win_xw
+       << "x" << _win_yw << " pixels at " << _win_x0 << "," << _win_y0
+       << ")\n";
+
+  input_images in;
+  load_inputs(indataset, &in, false);
+  delete_ptr<image_long> binmap;
+  binmap_file.readImageSection(binmap.pptr(), _win_x0, _win_y0,
+			       _win_xw, _win_yw);
+
+  vector<char> fixed( std::max( binmap->max() + 1, 0L ), 0 );
+  for(unsigned y = 0; y != _win_yw; ++y)
+    for(unsigned x = 0; x != _win_xw; ++x)
+      {
+	const long b = (*binmap)(x, y);
+	if( b >= 0 &&
+	    ( ( x == 0 && _win_x0 != 0 ) || ( y == 0 && _win_y0 != 0 ) ||
+	      ( x == _win_xw-1 && x1 != xw ) ||
+	      ( y == _win_yw-1 && y1 != yw ) ) )
+	  fixed[b] = 1;
+      }
+
+  // (crossing bins of other shards which are not all in the window are
+  // left for the window of their shard)
+  image_short changed( _win_xw, _win_yw, short(0) );
+  for(unsigned y = 0; y != _win_yw; ++y)
+    for(unsigned x = 0; x != _win_xw; ++x)
+      {
+	const long b = (*binmap)(x, y);
+	if( b >= 0 && (*crossing)[b] && ! fixed[b] )
+	  changed(x, y) = 1;
+      }
+
+  image_short footprint( _win_xw, _win_yw, short(0) );
+  image_short smooth_region( _win_xw, _win_yw, short(0) );
+  binner::find_rebin_footprint( *binmap, changed, &footprint,
+				&smooth_region, &fixed );
+
+  delete_ptr<image_float> smoothed_image;
+  if( ! _smoothed_fname.empty() )
+    load_image( _smoothed_fname, 0, smoothed_image.pptr() );
+  else
+    {
+      flux_estimator fe( in.in_image.ptr(), in.bg_image.ptr(), in.mask.ptr(),
+			 in.expmap.ptr(), in.bg_expmap.ptr(),
+			 in.noisemap.ptr(), _smooth_sn, _threads );
+      fe.set_smooth_mode( parse_smooth_mode(_smooth_mode) );
+      fe.set_pixels( &smooth_region );
+      smoothed_image = new image_float( fe() );
+    }
+
+  // the fixed bins are only partly in the window, so they are hidden
+  // from the binner, to stop them taking pixels when scrubbing
+  image_long window_bins( *binmap );
+  for(unsigned y = 0; y != _win_yw; ++y)
+    for(unsigned x = 0; x != _win_xw; ++x)
+      {
+	const long bn = window_bins(x, y);
+	if( bn >= 0 && fixed[bn] )
+	  window_bins(x, y) = -1;
+      }
+
+  binner b(in.in_image.ptr(), smoothed_image.ptr(), _sn_threshold);
+  setup_binner( b, in, _threads, string() );
+  b.set_verbose( false );
+  b.set_previous_bins( window_bins, footprint, *next_number );
+  do_binning(b);
+  if( ! _noscrub )
+    b.do_scrub();
+  b.number_bins();
+
+  image_long rebinned( b.get_binmap_image() );
+  for(unsigned y = 0; y != _win_yw; ++y)
+    for(unsigned x = 0; x != _win_xw; ++x)
+      {
+	const long ob = (*binmap)(x, y);
+	if( ob >= 0 && fixed[ob] )
+	  rebinned(x, y) = ob;
+      }
+
+  // bins left below the threshold with only hidden neighbours, which
+  // could not be dissolved, go to the fixed bin sharing most of their
+  // edge (which is then kept as it is, as its own window may not hold
+  // the pixels it gains)
+  if( ! _noscrub )
+    {
+      const long no_new = std::max( rebinned.max() + 1, 0L );
+      vector<bin_sums> sums( no_new );
+      bin_helper helper( in.in_image.ptr(), 0, &rebinned, _sn_threshold );
+      helper.set_back( in.bg_image.ptr(), in.expmap.ptr(),
+		       in.bg_expmap.ptr() );
+      helper.set_noisemap( in.noisemap.ptr() );
+      for(unsigned y = 0; y != _win_yw; ++y)
+	for(unsigned x = 0; x != _win_xw; ++x)
+	  if( rebinned(x, y) >= 0 )
+	    sums[ rebinned(x, y) ] += helper.pixel_sums(x, y);
+
+      const bool has_bg = ! _bg_fname.empty();
+      const bool has_noisemap = ! _noisemap_fname.empty();
+      const double thresh_2 = _sn_threshold * _sn_threshold;
+      vector< std::map<long, unsigned> > edges( no_new );
+      vector<char> has_neighbour( no_new, 0 );
+      for(unsigned y = 0; y != _win_yw; ++y)
+	for(unsigned x = 0; x != _win_xw; ++x)
+	  {
+	    const long nb = rebinned(x, y);
+	    if( footprint(x, y) == 0 || nb < 0 ||
+		bin_helper::sn_2( sums[nb], has_bg, has_noisemap ) >= thresh_2 )
+	      continue;
+	    for(unsigned n = 0; n != bin_no_neigh; ++n)
+	      {
+		const int nx = int(x) + bin_neigh_x[n];
+		const int ny = int(y) + bin_neigh_y[n];
+		if( nx < 0 || ny < 0 ||
+		    nx >= int(_win_xw) || ny >= int(_win_yw) )
+		  continue;
+		const long ob = (*binmap)(nx, ny);
+		const long rb = rebinned(nx, ny);
+		if( ob >= 0 && fixed[ob] )
+		  ++edges[nb][ob];
+		else if( rb >= 0 && rb != nb )
+		  has_neighbour[nb] = 1;
+	      }
+	  }
+
+      vector<long> dest( no_new, -1 );
+      for(long nb = 0; nb != no_new; ++nb)
+	{
+	  if( has_neighbour[nb] )
+	    continue;
+	  unsigned most = 0;
+	  for(const auto& e : edges[nb])
+	    if( e.second > most )
+	      {
+		most = e.second;
+		dest[nb] = e.first;
+	      }
+	  if( dest[nb] >= 0 )
+	    (*crossing)[ dest[nb] ] = 0;
+	}
+      for(unsigned y = 0; y != _win_yw; ++y)
+	for(unsigned x = 0; x != _win_xw; ++x)
+	  if( footprint(x, y) != 0 && rebinned(x, y) >= 0 &&
+	      dest[ rebinned(x, y) ] >= 0 )
+	    rebinned(x, y) = dest[ rebinned(x, y) ];
+    }
+
+  // the bins made here no longer cross the edges (new bins may have
+  // taken the numbers of removed bins which did)
+  for(unsigned y = 0; y != _win_yw; ++y)
+    for(unsigned x = 0; x != _win_xw; ++x)
+      {
+	const long nb = rebinned(x, y);
+	if( footprint(x, y) == 0 || nb < 0 ||
+	    ( nb < long(fixed.size()) && fixed[nb] ) )
+	  continue;
+	if( nb >= *next_number )
+	  {
+	    *next_number = nb + 1;
+	    crossing->resize( *next_number, 0 );
+	  }
+	(*crossing)[nb] = 0;
+      }
+
+  binmap_file.writeImageSection(rebinned, _win_x0, _win_y0);
+}
+
+// Sum the pixels of each bin in the output binmap, a strip of rows at a
+// time, then write the catalogue and the output images, with the bins
+// renumbered from 0 in the order of their merged numbers (or along a
+// Hilbert curve). no_numbers is one more than the largest number used.
+void program::write_merged_outputs(FITSFile& indataset,
+				   FITSFile& binmap_file,
+				   const unsigned xw, const unsigned yw,
+				   const long no_numbers)
+{
+  // strips have about the area of a shard
+  const unsigned no_shards = _nshard_x * _nshard_y;
+  const unsigned strip_yw = std::max( 1u, (yw + no_shards - 1) / no_shards );
+  const size_t no_bands = _band_fnames.size();
+
+  cout << "(i) Summing bins in strips of " << strip_yw << " rows\n";
+
+  bin_summary_vector summaries( no_numbers );
+  vector<bin_sums> sums( no_numbers );
+  vector< vector<bin_sums> > band_sums( no_bands,
+					vector<bin_sums>(no_numbers) );
+
+  FITSFile mask_file(_mask_out_fname, FITSFile::Create);
+  start_image<short>(mask_file, _mask_out_fname, xw, yw, &indataset);
+
+  for(unsigned y0 = 0; y0 < yw; y0 += strip_yw)
+    {
+      _win_x0 = 0;
+      _win_y0 = y0;
+      _win_xw = xw;
+      _win_yw = std::min( strip_yw, yw - y0 );
+
+      input_images in;
+      load_inputs(indataset, &in, false);
+      delete_ptr<image_long> binmap;
+      binmap_file.readImageSection(binmap.pptr(), _win_x0, _win_y0,
+				   _win_xw, _win_yw);
+
+      // sum the pixels as they are when growing bins
+      {
+	bin_helper helper( in.in_image.ptr(), 0, binmap.ptr(),
+			   _sn_threshold );
+	helper.set_back( in.bg_image.ptr(), in.expmap.ptr(),
+			 in.bg_expmap.ptr() );
+	helper.set_noisemap( in.noisemap.ptr() );
+
+	for(unsigned y = 0; y != _win_yw; ++y)
+	  for(unsigned x = 0; x != _win_xw; ++x)
+	    {
+	      const long b = (*binmap)(x, y);
+	      if( b < 0 )
+		continue;
+	      sums[b] += helper.pixel_sums(x, y);
+	      summaries[b].add_pixel( x, y + y0 );
+	      summaries[b].exposure += (*in.expmap)(x, y);
+	    }
+      }
+
+      for(size_t i = 0; i != no_bands; ++i)
+	{
+	  bin_helper helper( in.bands[i].get(), 0, binmap.ptr(),
+			     _sn_threshold );
+	  if( in.band_bgs[i] )
+	    helper.set_back( in.band_bgs[i].get(), in.expmap.ptr(),
+			     in.band_bg_expmaps[i] ?
+			     in.band_bg_expmaps[i].get() :
+			     in.bg_expmap.ptr() );
+
+	  for(unsigned y = 0; y != _win_yw; ++y)
+	    for(unsigned x = 0; x != _win_xw; ++x)
+	      {
+		const long b = (*binmap)(x, y);
+		if( b >= 0 )
+		  band_sums[i][b] += helper.pixel_sums(x, y);
+	      }
+	}
+
+      mask_file.writeImageSection(*in.mask, 0, y0);
+    }
+
+  // number the bins, keeping the order before sorting as ORIGBIN
+  vector<long> order;
+  for(long b = 0; b != no_numbers; ++b)
+    if( summaries[b].count != 0 )
+      order.push_back( b );
+  const size_t no_bins = order.size();
+
+  vector<size_t> sorted( no_bins );
+  for(size_t i = 0; i != no_bins; ++i)
+    sorted[i] = i;
+  if( _hilbert )
+    {
+      unsigned n = 1;
+      while( n < xw || n < yw )
+	n *= 2;
+
+      vector<unsigned long long> index( no_bins );
+      for(size_t i = 0; i != no_bins; ++i)
+	{
+	  const bin_summary& s = summaries[ order[i] ];
+	  index[i] = hilbert_index( n, unsigned(s.x_cen / s.count),
+				    unsigned(s.y_cen / s.count) );
+	}
+      std::stable_sort( sorted.begin(), sorted.end(),
+			[&index](size_t a, size_t b)
+			{ return index[a] < index[b]; } );
+    }
+
+  const bool has_bg = ! _bg_fname.empty();
+  const bool has_noisemap = ! _noisemap_fname.empty();
+  vector<long> numbers( no_numbers, -1 );
+  bin_summary_vector catalogue( no_bins );
+  vector<double> signal( no_bins ), sn( no_bins );
+  for(size_t i = 0; i != no_bins; ++i)
+    {
+      const long b = order[ sorted[i] ];
+      numbers[b] = i;
+
+      bin_summary& s = catalogue[i];
+      s = summaries[b];
+      s.bin_no = i;
+      s.orig_bin_no = sorted[i];
+      s.signal = signal[i] = sums[b].signal();
+      s.noise = std::sqrt( bin_helper::noise_2( sums[b], has_bg,
+						has_noisemap ) );
+      s.sn = sn[i] = std::sqrt( bin_helper::sn_2( sums[b], has_bg,
+						  has_noisemap ) );
+      s.x_cen /= s.count;
+      s.y_cen /= s.count;
+      s.exposure /= s.count;
+
+      for(size_t j = 0; j != no_bands; ++j)
+	binner::add_band_summary( &s, band_sums[j][b],
+				  ! _band_bg_fnames.empty() );
+    }
+  cout << "(i) " << no_bins << " bins when finished\n";
+
+  binner::write_histograms( sn, signal, string() );
+  save_catalogue(_cat_fname, catalogue);
+
+  // write the output images, renumbering the binmap
+  FITSFile out_file(_out_fname, FITSFile::Create);
+  start_image<float>(out_file, _out_fname, xw, yw, &indataset);
+  FITSFile sn_file(_sn_fname, FITSFile::Create);
+  start_image<float>(sn_file, _sn_fname, xw, yw, &indataset);
+
+  for(unsigned y0 = 0; y0 < yw; y0 += strip_yw)
+    {
+      const unsigned syw = std::min( strip_yw, yw - y0 );
+      delete_ptr<image_long> binmap;
+      binmap_file.readImageSection(binmap.pptr(), 0, y0, xw, syw);
+
+      image_float out_image( xw, syw, -1.f ), sn_image( xw, syw, -1.f );
+      for(unsigned y = 0; y != syw; ++y)
+	for(unsigned x = 0; x != xw; ++x)
+	  {
+	    long& b = (*binmap)(x, y);
+	    if( b < 0 )
+	      continue;
+	    b = numbers[b];
+	    out_image(x, y) = signal[b] / catalogue[b].count;
+	    sn_image(x, y) = sn[b];
+	  }
+
+      binmap_file.writeImageSection(*binmap, 0, y0);
+      out_file.writeImageSection(out_image, 0, y0);
+      sn_file.writeImageSection(sn_image, 0, y0);
+    }
+}
+
+// write the date and settings as history keywords
+void program::write_history(FITSFile* dataset, const string& filename)
+{
+  dataset->writeDatestamp("contbin");
 
   ostringstream o;
   o << "Generated by contbin (Jeremy Sanders 2014)\n"
@@ -263,70 +1446,169 @@ template<class T> void program::save_image(const string& filename, const T& imag
     << "Back expmap image: " << _bg_expmap_fname << '\n'
     << "Noise map image: " << _noisemap_fname << '\n'
     << "SN threshold: " << _sn_threshold << '\n'
+    << "SN list: " << _sn_list_str << '\n'
     << "Smooth SN: " << _smooth_sn << '\n'
+    << "Smooth mode: " << _smooth_mode << '\n'
     << "Automask: " << _do_automask << '\n'
     << "Constrain fill: " << _constrain_fill << '\n'
     << "Constrain val: " << _constrain_val << '\n'
     << "No scrub: " << _noscrub << '\n'
     << "Bin up: " << _binup << '\n'
-    << "Scrub large: " << _scrub_large << '\n';
+    << "Scrub large: " << _scrub_large << '\n'
+    << "Bulk scrub: " << _bulk_scrub << '\n'
+    << "Parallel scrub: " << _parallel_scrub << '\n'
+    << "Threads: " << _threads << '\n'
+    << "Checkpoint: " << _checkpoint_fname << '\n'
+    << "Checkpoint bins: " << _checkpoint_bins << '\n'
+    << "Checkpoint time: " << _checkpoint_secs << '\n'
+    << "Resume: " << _resume << '\n'
+    << "Previous binmap: " << _prev_binmap_fname << '\n'
+    << "Previous input image: " << _prev_in_fname << '\n'
+    << "Merge tree: " << _tree_fname << '\n'
+    << "Preview: " << _preview << '\n'
+    << "Refine: " << _refine << '\n'
+    << "Engine: " << _engine << '\n'
+    << "Hilbert order: " << _hilbert << '\n'
+    << "Bands: " << _bands_str << '\n'
+    << "Band backgrounds: " << _band_bgs_str << '\n'
+    << "Shards: " << _shards_str << '\n'
+    << "Shard: " << _shard << '\n'
+    << "Halo: " << _halo << '\n'
+    << "Merge shards: " << _merge_shards << '\n';
 
   // split output text and write as lines of history
   vector<string> items = split_string(o.str(), '\n');
   for(vector<string>::const_iterator i = items.begin();
       i != items.end(); ++i)
     {
-      dataset.writeHistory(*i);
+      dataset->writeHistory(*i);
     }
 }
 
-void program::run()
+// bin a copy of the images made smaller by combining blocks of
+// _preview x _preview pixels, returning the binmap at full size. If
+// smoothed_image is not set, the smoothed image is interpolated back
+// to full size from the smaller one.
+image_long* program::preview_binmap(const image_float& in_image,
+				    const image_float* bg_image,
+				    const image_short& mask,
+				    const image_float& expmap,
+				    const image_float& bg_expmap,
+				    const image_float* noisemap,
+				    delete_ptr<image_float>* smoothed_image)
 {
-  /////////////////////////////////////////////////////////////////
-  // load input images
+  const unsigned f = _preview;
+  cout << "(i) Making preview in " << f << 'x' << f << " blocks\n";
 
-  delete_ptr<image_float> in_image;
-  double in_exposure;
+  delete_ptr<image_short> cmask( block_mask(mask, f) );
+  delete_ptr<image_float> cin( block_image(in_image, mask, f, block_sum) );
+  delete_ptr<image_float> cexpmap( block_image(expmap, mask, f, block_mean) );
+  delete_ptr<image_float> cbg_expmap( block_image(bg_expmap, mask, f,
+						  block_mean) );
+  delete_ptr<image_float> cbg, cnoisemap;
+  if( bg_image != 0 )
+    cbg = block_image(*bg_image, mask, f, block_sum);
+  if( noisemap != 0 )
+    cnoisemap = block_image(*noisemap, mask, f, block_quadrature);
 
-  // load in the main dataset
-  // (keep open to copy header)
-  cout << "(i) Loading image " << _in_fname << '\n';
+  // masked blocks have no exposure
+  cexpmap->trim_up(1e-7);
+  cbg_expmap->trim_up(1e-7);
 
-  FITSFile indataset(_in_fname);
+  delete_ptr<image_float> csmoothed;
+  if( smoothed_image->ptr() != 0 )
+    {
+      csmoothed = block_image(**smoothed_image, mask, f, block_mean);
+    }
+  else
+    {
+      cout << "(i) Smoothing preview data (S/N = "
+	   << _smooth_sn << ")\n";
+      flux_estimator fe( cin.ptr(), cbg.ptr(), cmask.ptr(), cexpmap.ptr(),
+			 cbg_expmap.ptr(), cnoisemap.ptr(), _smooth_sn,
+			 _threads );
+      fe.set_smooth_mode( parse_smooth_mode(_smooth_mode) );
+      csmoothed = new image_float( fe() );
+      *smoothed_image = unblock_image( *csmoothed, *cmask, f,
+				       in_image.xw(), in_image.yw() );
+    }
+
+  binner b(cin.ptr(), csmoothed.ptr(), _sn_threshold);
+  b.set_back_image( cbg.ptr(), cexpmap.ptr(), cbg_expmap.ptr() );
+  b.set_noisemap_image( cnoisemap.ptr() );
+  b.set_mask_image( cmask.ptr() );
+  b.set_constrain_fill( _constrain_fill, _constrain_val );
+  b.set_scrub_large_bins( _scrub_large );
+  b.set_bulk_scrub( _bulk_scrub );
+  b.set_threads( _threads );
+  if( _parallel_scrub )
+    b.set_scrub_threads( _threads );
+
+  do_binning(b);
+  if( ! _noscrub )
+    b.do_scrub();
+
+  // each unmasked pixel takes the bin of its block
+  const image_long& cbinmap = b.get_binmap_image();
+  image_long* binmap = new image_long(in_image.xw(), in_image.yw(), -1L);
+  for(unsigned y = 0; y != in_image.yw(); ++y)
+    for(unsigned x = 0; x != in_image.xw(); ++x)
+      if( mask(x, y) >= 1 )
+	(*binmap)(x, y) = cbinmap(x/f, y/f);
+
+  return binmap;
+}
+
+// load the input images, or the window of them if set, where
+// indataset is the input image
+void program::load_inputs(FITSFile& indataset, input_images* in,
+			  const bool verbose)
+{
+  double in_exposure;
   double defval = 1.;
   indataset.readKey("EXPOSURE", &in_exposure, &defval);
-  indataset.readImage(in_image.pptr());
+
+  read_image(indataset, in->in_image.pptr());
+  const image_float& in_image = *in->in_image;
 
   // do automasking (if any)
-  image_short mask(in_image->xw(), in_image->yw(), 1);
+  in->mask = new image_short(in_image.xw(), in_image.yw(), 1);
+  image_short& mask = *in->mask;
   if( _do_automask )
-    auto_mask(*in_image, &mask);
+    {
+      if( _win_xw != 0 )
+	auto_mask_window(indataset, &mask);
+      else
+	auto_mask(in_image, &mask);
+    }
 
   // load mask (if any)
   if( ! _mask_fname.empty() )
     {
-      cout << "(i) Loading masking image " << _mask_fname << '\n';
+      if( verbose )
+	cout << "(i) Loading masking image " << _mask_fname << '\n';
 
       image_short* maskim;
       load_image( _mask_fname, 0, &maskim );
       mask = *maskim;
       delete maskim;
 
-      if(mask.xw() != in_image->xw() || mask.yw() != in_image->yw())
+      if(mask.xw() != in_image.xw() || mask.yw() != in_image.yw())
         {
           std::cerr << "(!) Input image does not match mask shape\n";
           std::exit(1);
         }
     }
 
-  delete_ptr<image_float> expmap;
+  delete_ptr<image_float>& expmap = in->expmap;
   if( ! _expmap_fname.empty() )
     {
-      cout << "(i) Loading foreground exposure map "
-	   << _expmap_fname << '\n';
+      if( verbose )
+	cout << "(i) Loading foreground exposure map "
+	     << _expmap_fname << '\n';
       load_image( _expmap_fname, 0, expmap.pptr() );
 
-      if(expmap->xw() != in_image->xw() || expmap->yw() != in_image->yw())
+      if(expmap->xw() != in_image.xw() || expmap->yw() != in_image.yw())
         {
           std::cerr << "(!) Input image does not match exposure map shape\n";
           std::exit(1);
@@ -344,22 +1626,24 @@ void program::run()
     }
   else
     {
-      cout << "(i) Using blank foreground exposure (exp="
-	   << in_exposure << ")\n";
-      expmap = new image_float( in_image->xw(), in_image->yw(),
+      if( verbose )
+	cout << "(i) Using blank foreground exposure (exp="
+	     << in_exposure << ")\n";
+      expmap = new image_float( in_image.xw(), in_image.yw(),
 				in_exposure );
     }
 
-  delete_ptr<image_float> bg_image;
+  delete_ptr<image_float>& bg_image = in->bg_image;
   double bg_exposure;
       
   // load in background file (if any)
   if( ! _bg_fname.empty() )
     {
-      cout << "(i) Loading background image " << _bg_fname << '\n';
+      if( verbose )
+	cout << "(i) Loading background image " << _bg_fname << '\n';
       load_image( _bg_fname, &bg_exposure, bg_image.pptr() );
 
-      if(bg_image->xw() != in_image->xw() || bg_image->yw() != in_image->yw())
+      if(bg_image->xw() != in_image.xw() || bg_image->yw() != in_image.yw())
         {
           std::cerr << "(!) Input image does not match background shape\n";
           std::exit(1);
@@ -372,14 +1656,15 @@ void program::run()
     }
 
   // load in background exposure map
-  delete_ptr<image_float> bg_expmap;
+  delete_ptr<image_float>& bg_expmap = in->bg_expmap;
   if( ! _bg_expmap_fname.empty() )
     {
-      cout << "(i) Loading background exposure map "
-	   << _bg_expmap_fname << '\n';
+      if( verbose )
+	cout << "(i) Loading background exposure map "
+	     << _bg_expmap_fname << '\n';
       load_image( _bg_expmap_fname, 0, bg_expmap.pptr() );
 
-      if(bg_expmap->xw() != in_image->xw() || bg_expmap->yw() != in_image->yw())
+      if(bg_expmap->xw() != in_image.xw() || bg_expmap->yw() != in_image.yw())
         {
           std::cerr << "(!) Input image does not match background exposure map shape\n";
           std::exit(1);
@@ -387,9 +1672,10 @@ void program::run()
     }
   else
     {
-      cout << "(i) Using blank background exposure (exp="
-	   << bg_exposure << ")\n";
-      bg_expmap = new image_float( in_image->xw(), in_image->yw(),
+      if( verbose )
+	cout << "(i) Using blank background exposure (exp="
+	     << bg_exposure << ")\n";
+      bg_expmap = new image_float( in_image.xw(), in_image.yw(),
 				   bg_exposure );
     }
 
@@ -398,31 +1684,219 @@ void program::run()
   expmap->trim_up(1e-7);
 
   // load in noise map if passed
-  delete_ptr<image_float> noisemap;
+  delete_ptr<image_float>& noisemap = in->noisemap;
   if( ! _noisemap_fname.empty() )
     {
-      cout << "(i) Loading noise map " << _noisemap_fname << '\n';
+      if( verbose )
+	cout << "(i) Loading noise map " << _noisemap_fname << '\n';
       load_image( _noisemap_fname, 0, noisemap.pptr());
 
-      if(noisemap->xw() != in_image->xw() || noisemap->yw() != in_image->yw())
+      if(noisemap->xw() != in_image.xw() || noisemap->yw() != in_image.yw())
         {
           std::cerr << "(!) Input image does not match noise map shape\n";
           std::exit(1);
         }
     }
 
+  // load band images to sum in each bin, with their backgrounds and
+  // background exposure maps
+  for(size_t i = 0; i != _band_fnames.size(); ++i)
+    {
+      if( verbose )
+	cout << "(i) Loading band image " << _band_fnames[i] << '\n';
+      image_float* band;
+      load_image( _band_fnames[i], 0, &band );
+      in->bands.emplace_back( band );
+
+      if(band->xw() != in_image.xw() || band->yw() != in_image.yw())
+        {
+          std::cerr << "(!) Input image does not match band image shape\n";
+          std::exit(1);
+        }
+
+      in->band_bgs.emplace_back();
+      in->band_bg_expmaps.emplace_back();
+      if( _band_bg_fnames.empty() )
+	continue;
+
+      if( verbose )
+	cout << "(i) Loading band background image " << _band_bg_fnames[i]
+	     << '\n';
+      image_float* band_bg;
+      double band_bg_exposure;
+      load_image( _band_bg_fnames[i], &band_bg_exposure, &band_bg );
+      in->band_bgs.back().reset( band_bg );
+
+      if(band_bg->xw() != in_image.xw() || band_bg->yw() != in_image.yw())
+        {
+          std::cerr << "(!) Input image does not match band background shape\n";
+          std::exit(1);
+        }
+
+      // use the background exposure map if given, as for --bg
+      if( _bg_expmap_fname.empty() )
+	{
+	  in->band_bg_expmaps.back().reset
+	    ( new image_float( in_image.xw(), in_image.yw(),
+			       band_bg_exposure ) );
+	  in->band_bg_expmaps.back()->trim_up(1e-7);
+	}
+    }
+}
+
+void program::setup_binner(binner& b, const input_images& in,
+			   const unsigned threads,
+			   const string& checkpoint_fname)
+{
+  b.set_back_image( in.bg_image.ptr(), in.expmap.ptr(), in.bg_expmap.ptr() );
+  b.set_noisemap_image(in.noisemap.ptr());
+  b.set_mask_image(in.mask.ptr());
+  b.set_constrain_fill(_constrain_fill, _constrain_val);
+  b.set_scrub_large_bins(_scrub_large);
+  b.set_bulk_scrub(_bulk_scrub);
+  b.set_hilbert_order(_hilbert);
+  for(size_t i = 0; i != in.bands.size(); ++i)
+    b.add_band( in.bands[i].get(), in.band_bgs[i].get(),
+		in.band_bg_expmaps[i] ? in.band_bg_expmaps[i].get()
+		: in.bg_expmap.ptr() );
+  b.set_threads(threads);
+  if( _parallel_scrub )
+    b.set_scrub_threads( threads );
+  if( ! checkpoint_fname.empty() )
+    b.set_checkpoint( checkpoint_fname,
+		      _checkpoint_bins < 0 ? 0 : _checkpoint_bins,
+		      _checkpoint_secs );
+}
+
+void program::run()
+{
+  /////////////////////////////////////////////////////////////////
+  // load input images
+
+  // load in the main dataset
+  // (keep open to copy header)
+  cout << "(i) Loading image " << _in_fname << '\n';
+
+  FITSFile indataset(_in_fname);
+
+  // merging reads the images a part at a time
+  if( _merge_shards )
+    {
+      merge_shards(indataset);
+      return;
+    }
+
+  // only the window of a shard is read from each image
+  if( _shard >= 0 )
+    {
+      long xw, yw;
+      indataset.readKey("NAXIS1", &xw);
+      indataset.readKey("NAXIS2", &yw);
+
+      unsigned cx0, cy0, cx1, cy1;
+      shard_range(_shard, xw, yw, 0, &cx0, &cy0, &cx1, &cy1);
+      if( cx1 <= cx0 || cy1 <= cy0 )
+	{
+	  std::cerr << "(!) Too many shards for the image size\n";
+	  std::exit(1);
+	}
+
+      unsigned x1, y1;
+      shard_range(_shard, xw, yw, _halo, &_win_x0, &_win_y0, &x1, &y1);
+      _win_xw = x1 - _win_x0;
+      _win_yw = y1 - _win_y0;
+      cout << "(i) Binning shard " << _shard << " (" << _win_xw << "x"
+	   << _win_yw << " pixels at " << _win_x0 << "," << _win_y0 << ")\n";
+    }
+
+  input_images in;
+  load_inputs(indataset, &in);
+  const delete_ptr<image_float>& in_image = in.in_image;
+  image_short& mask = *in.mask;
+  const delete_ptr<image_float>& expmap = in.expmap;
+  const delete_ptr<image_float>& bg_image = in.bg_image;
+  const delete_ptr<image_float>& bg_expmap = in.bg_expmap;
+  const delete_ptr<image_float>& noisemap = in.noisemap;
+
+  // when updating a previous binning, find the pixels to rebin and
+  // those which need smoothing
+  delete_ptr<image_long> prev_binmap;
+  delete_ptr<image_short> footprint, smooth_region;
+  if( ! _prev_binmap_fname.empty() )
+    {
+      cout << "(i) Loading previous binmap " << _prev_binmap_fname << '\n';
+      load_image( _prev_binmap_fname, 0, prev_binmap.pptr() );
+
+      if(prev_binmap->xw() != in_image->xw() || prev_binmap->yw() != in_image->yw())
+        {
+          std::cerr << "(!) Input image does not match previous binmap shape\n";
+          std::exit(1);
+        }
+
+      delete_ptr<image_float> prev_in;
+      if( ! _prev_in_fname.empty() )
+	{
+	  cout << "(i) Loading previous input image " << _prev_in_fname << '\n';
+	  load_image( _prev_in_fname, 0, prev_in.pptr() );
+
+	  if(prev_in->xw() != in_image->xw() || prev_in->yw() != in_image->yw())
+	    {
+	      std::cerr << "(!) Input image does not match previous input image shape\n";
+	      std::exit(1);
+	    }
+	}
+
+      // pixels which have been masked or unmasked, or have new counts
+      image_short changed( in_image->xw(), in_image->yw(), short(0) );
+      unsigned long no_changed = 0;
+      for(unsigned y = 0; y != in_image->yw(); ++y)
+	for(unsigned x = 0; x != in_image->xw(); ++x)
+	  {
+	    const bool used = mask(x, y) >= 1;
+	    if( used != ( (*prev_binmap)(x, y) >= 0 ) ||
+		( used && prev_in.ptr() != 0 &&
+		  (*prev_in)(x, y) != (*in_image)(x, y) ) )
+	      {
+		changed(x, y) = 1;
+		++no_changed;
+	      }
+	  }
+      cout << "(i) " << no_changed << " pixels have changed\n";
+
+      footprint = new image_short( in_image->xw(), in_image->yw(), short(0) );
+      smooth_region = new image_short( in_image->xw(), in_image->yw(),
+				       short(0) );
+      binner::find_rebin_footprint( *prev_binmap, changed,
+				    footprint.ptr(), smooth_region.ptr() );
+    }
+
   // smooth data, or use passed file
   delete_ptr<image_float> smoothed_image;
-  if( _smoothed_fname.empty() )
+  if( _resume )
+    {
+      cout << "(i) Loading smoothed image from checkpoint "
+	   << _checkpoint_fname << '\n';
+      smoothed_image = binner::read_checkpoint_smoothed( _checkpoint_fname );
+
+      if(smoothed_image->xw() != in_image->xw() || smoothed_image->yw() != in_image->yw())
+        {
+          std::cerr << "(!) Input image does not match checkpoint shape\n";
+          std::exit(1);
+        }
+    }
+  else if( _smoothed_fname.empty() && _preview <= 1 )
     {
       cout << "(i) Smoothing data (S/N = "
 	   << _smooth_sn << ")\n";
       // smooth data
       flux_estimator fe( in_image.ptr(), bg_image.ptr(), &mask, expmap.ptr(),
-			 bg_expmap.ptr(), noisemap.ptr(), _smooth_sn );
+			 bg_expmap.ptr(), noisemap.ptr(), _smooth_sn,
+			 _threads );
+      fe.set_smooth_mode( parse_smooth_mode(_smooth_mode) );
+      fe.set_pixels( smooth_region.ptr() );
       smoothed_image = new image_float( fe() );
     }
-  else
+  else if( ! _smoothed_fname.empty() )
     {
       cout << "(i) Loading smoothed image " << _smoothed_fname
 	   << '\n';
@@ -435,28 +1909,125 @@ void program::run()
         }
     }
 
-  {
-    //////////////////////////////////////////////////////////////////
-    // actually do the binning
-    binner the_binner(in_image.ptr(), smoothed_image.ptr(), _sn_threshold);
-    the_binner.set_back_image( bg_image.ptr(), expmap.ptr(), bg_expmap.ptr() );
-    the_binner.set_noisemap_image(noisemap.ptr());
-    the_binner.set_mask_image(&mask);
-    the_binner.set_constrain_fill(_constrain_fill, _constrain_val);
-    the_binner.set_scrub_large_bins(_scrub_large);
-
-    the_binner.do_binning(!_binup);
-    if( ! _noscrub )
-      the_binner.do_scrub();
-    the_binner.calc_outputs();
-
-    ///////////////////////////////////////////////////////////////////
-    // write output images
-    save_image(_out_fname, the_binner.get_output_image(), &indataset);
-    save_image(_sn_fname, the_binner.get_sn_image(), &indataset);
-    save_image(_binmap_fname, the_binner.get_binmap_image(), &indataset);
-    save_image("contbin_mask.fits", mask, &indataset);
-  }
+  // bin at low resolution first when previewing
+  delete_ptr<image_long> preview;
+  if( _preview > 1 )
+    preview = preview_binmap( *in_image, bg_image.ptr(), mask, *expmap,
+			      *bg_expmap, noisemap.ptr(), &smoothed_image );
+
+  if( _sn_list.empty() )
+    {
+      //////////////////////////////////////////////////////////////////
+      // actually do the binning
+      binner the_binner(in_image.ptr(), smoothed_image.ptr(), _sn_threshold);
+      // (a checkpoint would not record the previous or preview bins,
+      // and the tree engine cannot be resumed)
+      const bool no_checkpoint = prev_binmap.ptr() != 0 ||
+	preview.ptr() != 0 || _engine == "tree";
+      setup_binner( the_binner, in, _threads,
+		    no_checkpoint ? string() : _checkpoint_fname );
+      if( _resume )
+	the_binner.resume( _checkpoint_fname );
+      if( prev_binmap.ptr() != 0 )
+	the_binner.set_previous_bins( *prev_binmap, *footprint );
+
+      if( preview.ptr() != 0 )
+	{
+	  // only the bin boundaries are found at full resolution
+	  the_binner.set_binmap( *preview );
+	  the_binner.refine_bins( _refine );
+	}
+      else
+	{
+	  do_binning(the_binner);
+	  if( ! _noscrub )
+	    the_binner.do_scrub();
+	}
+      the_binner.calc_outputs();
+      if( ! _tree_fname.empty() )
+	the_binner.calc_merge_tree();
+
+      ///////////////////////////////////////////////////////////////////
+      // write output images
+      save_image(_out_fname, the_binner.get_output_image(), &indataset);
+      save_image(_sn_fname, the_binner.get_sn_image(), &indataset);
+      save_image(_binmap_fname, the_binner.get_binmap_image(), &indataset);
+      save_image(_mask_out_fname, mask, &indataset);
+      save_catalogue(_cat_fname, the_binner.get_bin_summaries());
+      if( ! _tree_fname.empty() )
+	save_tree(_tree_fname, the_binner.get_merge_tree());
+    }
+  else
+    {
+      //////////////////////////////////////////////////////////////////
+      // bin with each threshold in its own thread, sharing the order
+      // the bins are started in, as this does not depend on threshold
+      const size_t no_sn = _sn_list.size();
+      const unsigned threads_each = std::max( 1, _threads / int(no_sn) );
+
+      std::vector< std::unique_ptr<binner> > binners;
+      for( size_t i = 0; i != no_sn; ++i )
+	{
+	  binners.emplace_back( new binner( in_image.ptr(),
+					    smoothed_image.ptr(),
+					    _sn_list[i] ) );
+	  binner& b = *binners.back();
+	  // (no checkpoints, as they cannot be resumed with --snlist)
+	  setup_binner( b, in, threads_each, string() );
+	  b.set_output_suffix( sn_suffix(i) );
+	  b.set_verbose( false );
+	}
+
+      binners[0]->set_threads( _threads );
+      binners[0]->sort_pixels( !_binup );
+      binners[0]->set_threads( threads_each );
+      for( size_t i = 1; i != no_sn; ++i )
+	binners[i]->share_pixel_order( *binners[0] );
+
+      cout << "(i) Binning with " << no_sn << " thresholds\n";
+      std::mutex output_mutex;
+      std::vector<std::thread> threads;
+      for( size_t i = 0; i != no_sn; ++i )
+	threads.push_back( std::thread( [&, i]()
+	  {
+	    binner& b = *binners[i];
+	    do_binning(b);
+	    if( ! _noscrub )
+	      b.do_scrub();
+	    b.calc_outputs();
+	    if( ! _tree_fname.empty() )
+	      b.calc_merge_tree();
+
+	    std::lock_guard<std::mutex> lock( output_mutex );
+	    cout << "(i)  Done S/N " << _sn_list[i] << " ("
+		 << b.get_bin_summaries().size() << " bins)\n";
+	  } ) );
+      for( auto& t : threads )
+	t.join();
+
+      ///////////////////////////////////////////////////////////////////
+      // write output images, with the threshold in each filename
+      for( size_t i = 0; i != no_sn; ++i )
+	{
+	  const binner& b = *binners[i];
+	  const string suffix = sn_suffix(i);
+
+	  // so the history gives the threshold used
+	  _sn_threshold = _sn_list[i];
+
+	  save_image(add_suffix(_out_fname, suffix),
+		     b.get_output_image(), &indataset);
+	  save_image(add_suffix(_sn_fname, suffix),
+		     b.get_sn_image(), &indataset);
+	  save_image(add_suffix(_binmap_fname, suffix),
+		     b.get_binmap_image(), &indataset);
+	  save_catalogue(add_suffix(_cat_fname, suffix),
+			 b.get_bin_summaries());
+	  if( ! _tree_fname.empty() )
+	    save_tree(add_suffix(_tree_fname, suffix), b.get_merge_tree());
+	}
+      save_image(_mask_out_fname, mask, &indataset);
+    }
 }
 
 int main(int argc, char *argv[])
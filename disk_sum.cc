@@ -0,0 +1,82 @@
+// sums of images over disks, using prefix sums
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "disk_sum.hh"
+
+smooth_mode parse_smooth_mode(const std::string& name)
+{
+  if( name == "annuli" )
+    return smooth_annuli;
+  if( name == "disk" )
+    return smooth_disk;
+  if( name == "box" )
+    return smooth_box;
+
+  std::cerr << "(!) Invalid smoothing mode '" << name
+	    << "' (should be annuli, disk or box)\n";
+  std::exit(1);
+}
+
+disk_sum::disk_sum(const unsigned xw, const unsigned yw,
+		   const shape_type shape)
+  : _xw(xw), _yw(yw), _shape(shape)
+{
+}
+
+void disk_sum::sum_radius2(const int x, const int y, const long rad2,
+			   double* sums) const
+{
+  const unsigned noplanes = _planes.size();
+  for(unsigned p=0; p != noplanes; ++p)
+    sums[p] = 0;
+
+  // largest offset from centre included
+  const int maxd = int( std::sqrt( double(rad2) ) );
+  const int y0 = std::max(y-maxd, 0);
+  const int y1 = std::min(y+maxd, int(_yw)-1);
+  if( y0 > y1 )
+    return;
+
+  const size_t stride = _xw+1;
+
+  if( _shape == box )
+    {
+      const int x0 = std::max(x-maxd, 0);
+      const int x1 = std::min(x+maxd, int(_xw)-1) + 1;
+      if( x0 >= x1 )
+	return;
+
+      const size_t r0 = size_t(y0)*stride;
+      const size_t r1 = size_t(y1+1)*stride;
+      for(unsigned p=0; p != noplanes; ++p)
+	{
+	  const double* sat = &_planes[p][0];
+	  sums[p] = sat[r1+x1] - sat[r1+x0] - sat[r0+x1] + sat[r0+x0];
+	}
+      return;
+    }
+
+  // sum each row of the disk from the prefix sums
+  for(int yp = y0; yp <= y1; ++yp)
+    {
+      const long dy = yp - y;
+      const int halfw = int( std::sqrt( double(rad2 - dy*dy) ) );
+      const int x0 = std::max(x-halfw, 0);
+      const int x1 = std::min(x+halfw, int(_xw)-1) + 1;
+      if( x0 >= x1 )
+	continue;
+
+      const size_t row = size_t(yp)*stride;
+      for(unsigned p=0; p != noplanes; ++p)
+	{
+	  const double* prefix = &_planes[p][row];
+	  sums[p] += prefix[x1] - prefix[x0];
+	}
+    }
+}
@@ -0,0 +1,197 @@
+// sums of images over disks, using prefix sums
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#ifndef DISK_SUM_HH
+#define DISK_SUM_HH
+
+#include <vector>
+#include <string>
+#include <cassert>
+
+// How accumulative smoothers find the radius for each pixel:
+//  annuli: add pixels annulus by annulus (original method)
+//  disk:   search over disks using prefix sums (O(r) per disk)
+//  box:    search over square boxes using a summed-area table (O(1))
+enum smooth_mode { smooth_annuli, smooth_disk, smooth_box };
+
+// convert a name (annuli, disk or box) to a mode, exiting if invalid
+smooth_mode parse_smooth_mode(const std::string& name);
+
+// Keeps prefix sums of several planes (counts, background, etc) so
+// that their sums over a disk (or box) around any pixel can be
+// calculated quickly. Once set up this class is read-only, so can be
+// shared between threads. The sums are differences of double prefix
+// sums, so only equal to direct sums to rounding (exactly for integer
+// counts).
+//
+// Disks are specified by the maximum radius squared of the pixels
+// they include, or by the integerised radius as used for annuli
+// elsewhere (pixels with int(sqrt(dx^2+dy^2)) <= r).
+class disk_sum
+{
+public:
+  enum shape_type { disk, box };
+  static const unsigned max_planes = 8;
+
+  disk_sum(const unsigned xw, const unsigned yw,
+	   const shape_type shape = disk);
+
+  // add a plane to sum, where value(x, y) returns the value of the
+  // plane at the pixel (zero for masked pixels). Returns plane index.
+  template<class F> unsigned add_plane(F value);
+
+  unsigned no_planes() const { return _planes.size(); }
+  shape_type shape() const { return _shape; }
+
+  // sum the planes into sums for pixels within radius squared of x, y
+  void sum_radius2(const int x, const int y, const long rad2,
+		   double* sums) const;
+
+  // sum the planes for pixels with integerised radius <= r
+  void sum_radius(const int x, const int y, const unsigned r,
+		  double* sums) const
+  {
+    sum_radius2(x, y, long(r+1)*long(r+1)-1, sums);
+  }
+
+  // Find the smallest integerised radius <= maxr where done(sums)
+  // returns true, leaving the sums for that radius in sums. If none
+  // are found, maxr is returned. This uses a galloping search, so
+  // assumes that done is false below and true above some radius.
+  template<class P> unsigned find_radius(const int x, const int y,
+					 const unsigned maxr, P done,
+					 double* sums) const
+  {
+    return search(x, y, maxr, true, done, sums);
+  }
+
+  // as find_radius, but search over radius squared
+  template<class P> unsigned find_radius2(const int x, const int y,
+					  const unsigned maxrad2, P done,
+					  double* sums) const
+  {
+    return search(x, y, maxrad2, false, done, sums);
+  }
+
+private:
+  // convert search index to radius squared
+  static long index_rad2(const unsigned idx, const bool is_radius)
+  {
+    return is_radius ? long(idx+1)*long(idx+1)-1 : long(idx);
+  }
+
+  template<class P> unsigned search(const int x, const int y,
+				    const unsigned maxidx,
+				    const bool is_radius, P done,
+				    double* sums) const;
+
+private:
+  const unsigned _xw, _yw;
+  const shape_type _shape;
+
+  // for disks: prefix sums along each row, (xw+1)*yw values
+  // for boxes: summed-area table, (xw+1)*(yw+1) values
+  std::vector< std::vector<double> > _planes;
+};
+
+////////////////////////////////////////////////////////////////////////
+// template implementation
+
+template<class F> unsigned disk_sum::add_plane(F value)
+{
+  assert( _planes.size() < max_planes );
+
+  const unsigned stride = _xw+1;
+  _planes.push_back( std::vector<double>() );
+  std::vector<double>& plane = _planes.back();
+
+  if( _shape == disk )
+    {
+      plane.resize( size_t(stride)*_yw );
+      for(unsigned y=0; y != _yw; ++y)
+	{
+	  double* row = &plane[size_t(y)*stride];
+	  double total = 0;
+	  row[0] = 0;
+	  for(unsigned x=0; x != _xw; ++x)
+	    {
+	      total += value(x, y);
+	      row[x+1] = total;
+	    }
+	}
+    }
+  else
+    {
+      // summed-area table, with a row and column of zeros at start
+      plane.assign( size_t(stride)*(_yw+1), 0. );
+      for(unsigned y=0; y != _yw; ++y)
+	{
+	  const double* prev = &plane[size_t(y)*stride];
+	  double* row = &plane[size_t(y+1)*stride];
+	  double total = 0;
+	  for(unsigned x=0; x != _xw; ++x)
+	    {
+	      total += value(x, y);
+	      row[x+1] = prev[x+1] + total;
+	    }
+	}
+    }
+
+  return _planes.size()-1;
+}
+
+template<class P> unsigned disk_sum::search(const int x, const int y,
+					    const unsigned maxidx,
+					    const bool is_radius, P done,
+					    double* sums) const
+{
+  sum_radius2(x, y, index_rad2(0, is_radius), sums);
+  if( done(sums) || maxidx == 0 )
+    return 0;
+
+  // gallop outwards until done, keeping lo as not done
+  unsigned lo = 0;
+  unsigned hi = 1;
+  for(;;)
+    {
+      if( hi >= maxidx )
+	{
+	  hi = maxidx;
+	  sum_radius2(x, y, index_rad2(hi, is_radius), sums);
+	  if( ! done(sums) )
+	    return maxidx;
+	  break;
+	}
+
+      sum_radius2(x, y, index_rad2(hi, is_radius), sums);
+      if( done(sums) )
+	break;
+
+      lo = hi;
+      hi = hi*2;
+    }
+
+  // binary search between lo (not done) and hi (done), where sums
+  // always holds the values for hi
+  double trial[max_planes];
+  while( hi-lo > 1 )
+    {
+      const unsigned mid = lo + (hi-lo)/2;
+      sum_radius2(x, y, index_rad2(mid, is_radius), trial);
+      if( done(trial) )
+	{
+	  hi = mid;
+	  for(unsigned p=0; p != _planes.size(); ++p)
+	    sums[p] = trial[p];
+	}
+      else
+	{
+	  lo = mid;
+	}
+    }
+
+  return hi;
+}
+
+#endif
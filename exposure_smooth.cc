@@ -9,6 +9,8 @@
 #include "misc.hh"
 
 #include "image_disk_access.hh"
+#include "disk_sum.hh"
+#include "annuli.hh"
 
 // this is a program to accumulatively smooth an X-ray image
 // with an optional background image and exposure map image
@@ -24,32 +26,6 @@ using std::vector;
 using std::sqrt;
 using std::max;
 
-// basic stuct to store integer x, y points
-struct point
-{
-  point(int _x, int _y) : x(_x), y(_y) {};
-
-  int x, y;
-};
-
-typedef vector<point> point_vec;
-typedef vector<point_vec> point_vec_vec;
-
-// get the points as a function of integer radius
-point_vec_vec collectRadii(const int maxrad)
-{
-  point_vec_vec retn(maxrad+1);
-
-  for(int y = -maxrad; y <= maxrad; ++y)
-    for(int x = -maxrad; x <= maxrad; ++x)
-      {
-	int r = int( sqrt(x*x+y*y) );
-        if(r<=maxrad)
-          retn[r].push_back( point(x, y) );
-      }
-  return retn;
-}
-
 // square value
 template<class T> T sqd(T v)
 {
@@ -67,26 +43,80 @@ float SNratio2(float fg, float bg, float invfgtime, float invbgtime)
     (fg*sqd(invfgtime) + bg*sqd(invbgtime));
 }
 
+// smoothing by searching over disks or boxes using prefix sums
+void smoothImageSums(const image_float& inimage, const image_float& bgimage,
+                     const image_float& expmapimage,
+                     float sn2, int maxrad,
+                     float exptimefg, float exptimebg,
+                     image_float& outimage, smooth_mode mode)
+{
+  const int xw = inimage.xw();
+  const int yw = inimage.yw();
+
+  // sum fg, bg and exposure where there is exposure
+  disk_sum sums(xw, yw, mode == smooth_box ? disk_sum::box : disk_sum::disk);
+  sums.add_plane( [&](unsigned x, unsigned y) -> double
+                  { return expmapimage(x, y) > 0 ? inimage(x, y) : 0.f; } );
+  sums.add_plane( [&](unsigned x, unsigned y) -> double
+                  { return expmapimage(x, y) > 0 ? bgimage(x, y) : 0.f; } );
+  sums.add_plane( [&](unsigned x, unsigned y) -> double
+                  { return expmapimage(x, y) > 0 ? expmapimage(x, y) : 0.f; } );
+
+  const float invexptimefg = 1/exptimefg;
+  const float invexptimebg = 1/exptimebg;
+  auto done = [&](const double* s) -> bool
+    {
+      return SNratio2(s[0], s[1], invexptimefg, invexptimebg) >= sn2;
+    };
+
+  for(int y=0; y<yw; ++y)
+    {
+      if(y%20==0)
+        cout << "y=" << y << '/' << yw << '\n';
+
+      for(int x=0; x<xw; ++x)
+        {
+          if(expmapimage(x, y) <= 0)
+            continue;
+
+          double s[disk_sum::max_planes];
+          sums.find_radius(x, y, maxrad, done, s);
+          outimage(x, y) = (s[0] - s[1] * exptimefg / exptimebg) / s[2];
+        }
+    }
+
+  cout << '\n';
+}
+
 // do the actual smoothing
 void smoothImage(const image_float& inimage, const image_float& bgimage,
 		 const image_float& expmapimage,
 		 float sn, int maxrad,
                  float exptimefg, float exptimebg,
-		 image_float& outimage)
+		 image_float& outimage, smooth_mode mode)
 {
   const int xw = inimage.xw();
   const int yw = inimage.yw();
 
   if(maxrad <= 0)
     // use diagonal of image as maximum radius if not specified
-    maxrad = int(std::sqrt(xw*xw+yw*yw))+1;
-
-  point_vec_vec ptsatradii(collectRadii(maxrad));
+    maxrad = int(std::sqrt(double(xw)*xw+double(yw)*yw))+1;
 
   const float invexptimefg = 1/exptimefg;
   const float invexptimebg = 1/exptimebg;
   const float sn2 = sqd(sn);
 
+  if(mode != smooth_annuli)
+    {
+      smoothImageSums(inimage, bgimage, expmapimage, sn2, maxrad,
+                      exptimefg, exptimebg, outimage, mode);
+      return;
+    }
+
+  if(maxrad > int(annuli_table::max_radius))
+    maxrad = annuli_table::max_radius;
+  const annuli_table annuli;
+
   for(int y=0; y<yw; ++y)
     {
       if(y%20==0)
@@ -106,10 +136,10 @@ void smoothImage(const image_float& inimage, const image_float& bgimage,
                 (radius<=maxrad);
                ++radius )
             {
-              for(auto const& p : ptsatradii[radius])
+              annuli.for_each(radius, [&](int dx, int dy)
                 {
-                  const int nx = x + p.x;
-                  const int ny = y + p.y;
+                  const int nx = x + dx;
+                  const int ny = y + dy;
 
                   if(nx >= 0 && ny >= 0 && nx < xw && ny < yw)
                     {
@@ -121,7 +151,7 @@ void smoothImage(const image_float& inimage, const image_float& bgimage,
                           totalbg += bgimage(nx, ny);
                         }
                     }
-                }
+                });
             }
           outimage(x, y) = (totalfg - totalbg * exptimefg / exptimebg) / totalexp;
         }
@@ -134,6 +164,7 @@ int main(int argc, char* argv[])
 {
   double sn = 15;
   int maxrad = -1;
+  string smoothmode = "annuli";
   string back_file, mask_file, expmap_file;
   string out_file = "expsmooth.fits";
 
@@ -162,6 +193,10 @@ int main(int argc, char* argv[])
 				      parammm::pint_opt(&maxrad),
 				      "maximum radius (def -1 or infinite)",
 				      "VAL"));
+  params.add_switch( parammm::pswitch("smoothmode", 0,
+				      parammm::pstring_opt(&smoothmode),
+				      "annuli (def), disk or box",
+				      "MODE"));
 
   params.set_autohelp("Usage: exposure_smooth [OPTIONS] infile.fits\n"
 		      "Accumulative smoothing program with exposure map.\n"
@@ -180,6 +215,7 @@ int main(int argc, char* argv[])
     }
 
   const string in_filename = params.args()[0];
+  const smooth_mode mode = parse_smooth_mode(smoothmode);
 
   // load fg image
   double in_exposure = 1.;
@@ -246,7 +282,7 @@ int main(int argc, char* argv[])
 
   // actually do the work
   smoothImage(*in_image, *bg_image, *expmap_image,
-	      sn, maxrad, in_exposure, bg_exposure, *out_image);
+	      sn, maxrad, in_exposure, bg_exposure, *out_image, mode);
 
   // write output image
   write_image(out_file, *out_image);
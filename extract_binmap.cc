@@ -0,0 +1,169 @@
+// make a binmap for a higher signal to noise threshold, using the
+// merge tree written by contbin --outtree
+
+// Copyright 2025 Jeremy Sanders
+// Released under the GNU Public Licence (GPL)
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <cmath>
+
+#include "parammm/parammm.hh"
+
+#include "misc.hh"
+#include "fitsio_simple.hh"
+#include "merge_tree.hh"
+
+using std::string;
+using std::vector;
+using std::cout;
+
+const char* const c_prog_version = "1.0";
+
+class extractor
+{
+public:
+  extractor(int argc, char **argv);
+
+  void run();
+
+private:
+  void write_history(FITSFile* dataset, const string& filename);
+
+private:
+  string _binmap_fname, _tree_fname;
+  string _out_fname, _sn_fname;
+  double _sn_threshold;
+};
+
+extractor::extractor(int argc, char **argv)
+  : _out_fname("extract_binmap.fits"),
+    _sn_threshold(-1)
+{
+  parammm::param params(argc, argv);
+  params.add_switch( parammm::pswitch("sn", 's',
+				      parammm::pdouble_opt(&_sn_threshold),
+				      "set signal:noise threshold",
+				      "VAL"));
+  params.add_switch( parammm::pswitch("out", 'o',
+				      parammm::pstring_opt(&_out_fname),
+				      "set binmap out file (def extract_binmap.fits)",
+				      "FILE"));
+  params.add_switch( parammm::pswitch("outsn", 'e',
+				      parammm::pstring_opt(&_sn_fname),
+				      "set signal:noise out file (def none)",
+				      "FILE"));
+
+  params.set_autohelp("Usage: extract_binmap [OPTIONS] binmap.fits tree.fits\n"
+		      "Make binmap for higher signal:noise from merge tree\n"
+		      "Written by Jeremy Sanders 2025",
+		      "Report bugs to <jeremy@jeremysanders.net>");
+  params.enable_autohelp();
+  params.enable_autoversion(c_prog_version,
+			    "Jeremy Sanders",
+			    "Licenced under the GPL - see the file COPYING");
+  params.enable_at_expansion();
+
+  params.interpret_and_catch();
+
+  if( params.args().size() != 2 )
+    {
+      params.show_autohelp();
+    }
+  else if( ! (_sn_threshold > 0) )
+    {
+      std::cerr << "(!) A positive threshold must be given with --sn\n";
+      std::exit(1);
+    }
+  else
+    {
+      _binmap_fname = params.args()[0];
+      _tree_fname = params.args()[1];
+    }
+}
+
+void extractor::write_history(FITSFile* dataset, const string& filename)
+{
+  dataset->writeDatestamp("extract_binmap");
+
+  std::ostringstream o;
+  o << "Generated by extract_binmap (Jeremy Sanders 2025)\n"
+    << "This filename: " << filename << '\n'
+    << "Input binmap: " << _binmap_fname << '\n'
+    << "Merge tree: " << _tree_fname << '\n'
+    << "SN threshold: " << _sn_threshold << '\n';
+
+  vector<string> items = split_string(o.str(), '\n');
+  for(vector<string>::const_iterator i = items.begin();
+      i != items.end(); ++i)
+    {
+      dataset->writeHistory(*i);
+    }
+}
+
+void extractor::run()
+{
+  cout << "(i) Loading binmap " << _binmap_fname << '\n';
+  FITSFile indataset(_binmap_fname);
+  delete_ptr<image_long> binmap;
+  indataset.readImage(binmap.pptr());
+
+  cout << "(i) Loading merge tree " << _tree_fname << '\n';
+  merge_tree tree;
+  {
+    FITSFile treedataset(_tree_fname);
+    tree.read(treedataset);
+  }
+
+  if( binmap->max() >= tree.no_bins() )
+    {
+      std::cerr << "(!) Binmap has bins which are not in the merge tree\n";
+      std::exit(1);
+    }
+
+  vector<long> groups;
+  const vector<long> newno = tree.cut(_sn_threshold, &groups);
+  cout << "(i) " << groups.size() << " bins at S/N " << _sn_threshold
+       << " (from " << tree.no_bins() << ")\n";
+
+  // paint the new bin numbers and their signal to noise
+  image_long outmap(binmap->xw(), binmap->yw(), -1L);
+  image_float snmap(binmap->xw(), binmap->yw(), -1.f);
+  for(unsigned y = 0; y != binmap->yw(); ++y)
+    for(unsigned x = 0; x != binmap->xw(); ++x)
+      {
+	const long b = (*binmap)(x, y);
+	if( b < 0 || newno[b] < 0 )
+	  continue;
+
+	const long no = newno[b];
+	const merge_tree::node& nd = tree.nodes()[ groups[no] ];
+	outmap(x, y) = no;
+	snmap(x, y) = nd.noise > 0 ? std::fabs(nd.signal) / nd.noise : 0.;
+      }
+
+  {
+    FITSFile dataset(_out_fname, FITSFile::Create);
+    dataset.writeImage(outmap);
+    indataset.copyHeaderTo(dataset);
+    write_history(&dataset, _out_fname);
+  }
+  if( ! _sn_fname.empty() )
+    {
+      FITSFile dataset(_sn_fname, FITSFile::Create);
+      dataset.writeImage(snmap);
+      indataset.copyHeaderTo(dataset);
+      write_history(&dataset, _sn_fname);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+  extractor prog(argc, argv);
+  prog.run();
+
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <set>
+#include <limits>
+#include <cassert>
 
 #include <unistd.h>
 #include <stdio.h>
@@ -42,6 +44,21 @@ void FITSFile::_checkStatus(const std::string& operation)
     }
 }
 
+void FITSFile::_checkImageSize(const long xw, const long yw)
+{
+  // pixel coordinates are kept as ints, and the number of pixels
+  // must fit in the memory index
+  const long maxw = std::numeric_limits<int>::max() - 1;
+  if( xw <= 0 || yw <= 0 || xw > maxw || yw > maxw ||
+      double(xw)*double(yw) >
+      double(std::numeric_limits<size_t>::max()) )
+    {
+      std::cerr << "(!) Cannot handle image size " << xw << "x" << yw
+		<< " in " << _filename << '\n';
+      exit(1);
+    }
+}
+
 void FITSFile::open(const std::string& filename, OpenMode mode)
 {
   _file = 0;
@@ -223,6 +240,48 @@ void FITSFile::copyHeaderTo(FITSFile& other)
     }
 }
 
+void FITSFile::createTable(const std::string& extname, const long nrows,
+			   const std::vector<std::string>& names,
+			   const std::vector<std::string>& formats,
+			   const std::vector<std::string>& units)
+{
+  const unsigned nocols = names.size();
+  assert( formats.size() == nocols && units.size() == nocols );
+
+  // cfitsio wants arrays of non-const char*
+  std::vector<char*> ttype, tform, tunit;
+  for(unsigned i = 0; i != nocols; ++i)
+    {
+      ttype.push_back( const_cast<char*>(names[i].c_str()) );
+      tform.push_back( const_cast<char*>(formats[i].c_str()) );
+      tunit.push_back( const_cast<char*>(units[i].c_str()) );
+    }
+
+  if(_verbose)
+    std::cout << "Writing table " << extname << " (" << nrows
+	      << " rows)\n";
+
+  fits_create_tbl(_file, BINARY_TBL, nrows, nocols,
+		  &ttype[0], &tform[0], &tunit[0],
+		  const_cast<char*>(extname.c_str()), &_status);
+  _checkStatus("Creating table");
+}
+
+void FITSFile::moveToTable(const std::string& extname)
+{
+  fits_movnam_hdu(_file, BINARY_TBL, const_cast<char*>(extname.c_str()),
+		  0, &_status);
+  _checkStatus("Moving to table " + extname);
+}
+
+long FITSFile::tableRows()
+{
+  long nrows = 0;
+  fits_get_num_rows(_file, &nrows, &_status);
+  _checkStatus("Reading number of table rows");
+  return nrows;
+}
+
 void FITSFile::writeDatestamp(const std::string& program)
 {
   char date[64];
@@ -6,8 +6,10 @@
 #define FITSIO_SIMPLE_JSS__HH
 
 #include <string>
+#include <vector>
 #include <sstream>
 #include <iostream>
+#include <cstdlib>
 //#include <cfitsio/fitsio.h>
 #include <fitsio.h>
 
@@ -61,10 +63,39 @@ public:
 
   // image reading and writing
   template<class T> void readImage(dm::memimage<T>** image);
+  // read the xw x yw part of the image starting at x0, y0 (from 0)
+  template<class T> void readImageSection(dm::memimage<T>** image,
+					  const long x0, const long y0,
+					  const long xw, const long yw);
   template<class T> void writeImage(const dm::memimage<T>& image);
+  // create an empty xw x yw image of type T, to be filled in with
+  // writeImageSection
+  template<class T> void createImage(const long xw, const long yw);
+  // write image into the part of the image starting at x0, y0 (from 0)
+  template<class T> void writeImageSection(const dm::memimage<T>& image,
+					   const long x0, const long y0);
+
+  // binary table writing: create a table extension with columns of
+  // the given names, fitsio formats (e.g. "1D") and units, then fill
+  // each column (numbered from 1) in turn
+  void createTable(const std::string& extname, const long nrows,
+		   const std::vector<std::string>& names,
+		   const std::vector<std::string>& formats,
+		   const std::vector<std::string>& units);
+  template<class T> void writeColumn(const int colno,
+				     const std::vector<T>& vals);
+
+  // binary table reading: move to the table extension, then read
+  // whole columns by name
+  void moveToTable(const std::string& extname);
+  long tableRows();
+  template<class T> void readColumn(const std::string& name,
+				    std::vector<T>* vals);
 
 private:
   void _checkStatus(const std::string& operation);
+  // exit if image dimensions cannot be handled
+  void _checkImageSize(const long xw, const long yw);
 
 private:
   fitsfile* _file;
@@ -161,24 +192,64 @@ template<class T> void FITSFile::readImage(dm::memimage<T>** image)
   const int fits_datatype = _FITSVal_Datatype( static_cast<T*>(0) );
 
   // get axis dimensions and create image
-  int xw, yw; 
+  long xw, yw;
   readKey("NAXIS1", &xw);
   readKey("NAXIS2", &yw);
+  _checkImageSize(xw, yw);
   *image = new dm::memimage<T>(xw, yw);
 
   if(_verbose)
     std::cout << "Reading image (" << xw << "x" << yw << ")\n";
 
   // actually read image
-  fits_read_img(_file, fits_datatype, 1, xw*yw, 0,
+  fits_read_img(_file, fits_datatype, 1, LONGLONG(xw)*LONGLONG(yw), 0,
 		&((*image)->flatdata(0)),
 		0, &_status);
 
   _checkStatus("Read image");
 }
 
+template<class T> void FITSFile::readImageSection(dm::memimage<T>** image,
+						  const long x0, const long y0,
+						  const long xw, const long yw)
+{
+  const int fits_datatype = _FITSVal_Datatype( static_cast<T*>(0) );
+
+  long fullxw, fullyw;
+  readKey("NAXIS1", &fullxw);
+  readKey("NAXIS2", &fullyw);
+  _checkImageSize(xw, yw);
+  if( x0 < 0 || y0 < 0 || x0+xw > fullxw || y0+yw > fullyw )
+    {
+      std::cerr << "(!) Section is outside image (" << fullxw << "x"
+		<< fullyw << ") in " << _filename << '\n';
+      exit(1);
+    }
+  *image = new dm::memimage<T>(xw, yw);
+
+  if(_verbose)
+    std::cout << "Reading image section (" << xw << "x" << yw
+	      << " at " << x0 << "," << y0 << ")\n";
+
+  // fitsio pixels count from 1, and the last pixel is included
+  long fpixel[2] = { x0+1, y0+1 };
+  long lpixel[2] = { x0+xw, y0+yw };
+  long inc[2] = { 1, 1 };
+  fits_read_subset(_file, fits_datatype, fpixel, lpixel, inc, 0,
+		   &((*image)->flatdata(0)), 0, &_status);
+
+  _checkStatus("Read image section");
+}
+
 template<class T> void FITSFile::writeImage(const dm::memimage<T>& image)
 {
+  // the data need to be contiguous
+  if( image.border() != 0 )
+    {
+      writeImage( image.without_border() );
+      return;
+    }
+
   const int fits_imagetype = _FITSImg_Datatype(&image);
   const int fits_datatype = _FITSVal_Datatype( static_cast<T*>(0) );
   long axes[2];
@@ -209,9 +280,88 @@ template<class T> void FITSFile::writeImage(const dm::memimage<T>& image)
   // variable is non-const
   // data are not changed
   dm::memimage<T>* img_no_const = const_cast<dm::memimage<T>*>(&image);
-  fits_write_img(_file, fits_datatype, 1, image.xw()*image.yw(),
+  fits_write_img(_file, fits_datatype, 1, LONGLONG(image.nelem()),
 		 &(img_no_const->flatdata(0)), &_status);
   _checkStatus("Writing image");
 }
 
+template<class T> void FITSFile::createImage(const long xw, const long yw)
+{
+  const int fits_imagetype =
+    _FITSImg_Datatype( static_cast<dm::memimage<T>*>(0) );
+  long axes[2] = { xw, yw };
+  _checkImageSize(xw, yw);
+
+  fits_create_img(_file, fits_imagetype, 2, axes, &_status);
+  _checkStatus("Writing image header");
+}
+
+template<class T> void FITSFile::writeImageSection(const dm::memimage<T>& image,
+						   const long x0, const long y0)
+{
+  if( image.border() != 0 )
+    {
+      writeImageSection( image.without_border(), x0, y0 );
+      return;
+    }
+
+  const int fits_datatype = _FITSVal_Datatype( static_cast<T*>(0) );
+
+  long fullxw, fullyw;
+  readKey("NAXIS1", &fullxw);
+  readKey("NAXIS2", &fullyw);
+  const long xw = image.xw(), yw = image.yw();
+  if( x0 < 0 || y0 < 0 || x0+xw > fullxw || y0+yw > fullyw )
+    {
+      std::cerr << "(!) Section is outside image (" << fullxw << "x"
+		<< fullyw << ") in " << _filename << '\n';
+      exit(1);
+    }
+
+  if(_verbose)
+    std::cout << "Writing image section (" << xw << "x" << yw
+	      << " at " << x0 << "," << y0 << ")\n";
+
+  long fpixel[2] = { x0+1, y0+1 };
+  long lpixel[2] = { x0+xw, y0+yw };
+  dm::memimage<T>* img_no_const = const_cast<dm::memimage<T>*>(&image);
+  fits_write_subset(_file, fits_datatype, fpixel, lpixel,
+		    &(img_no_const->flatdata(0)), &_status);
+
+  _checkStatus("Write image section");
+}
+
+template<class T> void FITSFile::writeColumn(const int colno,
+					     const std::vector<T>& vals)
+{
+  if( vals.empty() )
+    return;
+
+  const int fits_datatype = _FITSVal_Datatype( static_cast<T*>(0) );
+  fits_write_col(_file, fits_datatype, colno, 1, 1, LONGLONG(vals.size()),
+		 const_cast<T*>(&vals[0]), &_status);
+
+  std::ostringstream o;
+  o << "Writing table column " << colno;
+  _checkStatus(o.str());
+}
+
+template<class T> void FITSFile::readColumn(const std::string& name,
+					    std::vector<T>* vals)
+{
+  int colno = 0;
+  fits_get_colnum(_file, CASEINSEN, const_cast<char*>(name.c_str()),
+		  &colno, &_status);
+  _checkStatus("Finding table column " + name);
+
+  vals->resize( tableRows() );
+  if( vals->empty() )
+    return;
+
+  const int fits_datatype = _FITSVal_Datatype( static_cast<T*>(0) );
+  fits_read_col(_file, fits_datatype, colno, 1, 1, LONGLONG(vals->size()),
+		0, &(*vals)[0], 0, &_status);
+  _checkStatus("Reading table column " + name);
+}
+
 #endif
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <algorithm>
 #include <iomanip>
+#include <thread>
 
 #include "flux_estimator.hh"
 
@@ -10,7 +11,7 @@ using namespace std;
 // work out integerised radius
 inline static unsigned unsigned_radius(int x, int y)
 {
-  return unsigned( sqrt( double(x*x + y*y) ) );
+  return unsigned( sqrt( double(x)*x + double(y)*y ) );
 }
 
 // simple squaring function
@@ -35,15 +36,25 @@ flux_estimator::flux_estimator( const image_float* const in_image,
 				const image_float* const bg_expmap_image,
 				const image_float* const noisemap_image,
 				
-				const double minsn = 10  )
+				const double minsn = 10,
+				const unsigned nthreads )
   : _xw( in_image->xw() ), _yw( in_image->yw() ),
     _minsn( minsn ),
+    _nthreads( nthreads < 1 ? 1 : nthreads ),
+    _smooth_mode( smooth_annuli ),
     _in_image(in_image), _back_image(back_image), _mask_image(mask_image),
     _expmap_image(expmap_image), _bg_expmap_image(bg_expmap_image),
     _noisemap_image(noisemap_image),
-    _max_annuli( unsigned_radius(_xw, _yw)+1 ),
-    _annuli_points( _max_annuli ),
+    _pixels( 0 ),
+    _max_annuli( std::min( unsigned_radius(_xw, _yw)+1,
+			   annuli_table::max_radius+1 ) ),
+    _disk_sum( 0 ),
+    _plane_fg( -1 ), _plane_bg( -1 ), _plane_bg_weight( -1 ),
+    _plane_expratio_2( -1 ), _plane_noise_2( -1 ), _plane_count( -1 ),
     _done( false ),
+    _next_row( 0 ),
+    _rows_done( 0 ),
+    _last_percent( -1 ),
     _iteration_image( _xw, _yw ),
     _estimated_errors( _xw, _yw )
 {
@@ -53,25 +64,10 @@ flux_estimator::flux_estimator( const image_float* const in_image,
   assert( mask_image->xw() == _xw && mask_image->yw() == _yw );
 }
 
-void flux_estimator::precalculate_annuli()
-{
-  for(int y=-(_yw-1); y<int(_yw); ++y)
-    {
-      for(int x=-(_xw-1); x<int(_xw); ++x)
-	{
-	  const unsigned r = unsigned_radius(x, y);
-	  
-	  // add pixel to appropriate radius
-	  _annuli_points[r].push_back( _point(x, y) );
-	}
-    }
-}
-
 const image_float& flux_estimator::operator()()
 {
   if( ! _done )
     {
-      precalculate_annuli();
       do_estimation();
       _done = true;
     }
@@ -117,108 +113,262 @@ static inline double _square(const double d)
 
 void flux_estimator::smooth()
 {
-  static int c = 0;
+  // sum the planes we need, if not using annuli
+  delete_ptr<disk_sum> sums;
+  if( _smooth_mode != smooth_annuli )
+    {
+      sums = new disk_sum( _xw, _yw, _smooth_mode == smooth_box
+			   ? disk_sum::box : disk_sum::disk );
+      make_planes( sums.ptr() );
+    }
+  _disk_sum = sums.ptr();
 
-  const double min_sn_2 = _minsn*_minsn;
+  _next_row = 0;
+  _rows_done = 0;
+  _last_percent = -1;
+
+  if( _nthreads == 1 )
+    {
+      smooth_rows();
+    }
+  else
+    {
+      // rows are handed out dynamically, as rows with bright pixels
+      // finish much faster than faint ones
+      std::vector<std::thread> threads;
+      for(unsigned i=0; i != _nthreads; ++i)
+	threads.push_back( std::thread(&flux_estimator::smooth_rows, this) );
+
+      for(auto& t : threads)
+	t.join();
+    }
+
+  std::cout << '\n';
+  _disk_sum = 0;
+}
+
+void flux_estimator::make_planes(disk_sum* sums)
+{
+  const image_short& mask = *_mask_image;
+  const image_float& in = *_in_image;
+
+  _plane_fg = sums->add_plane
+    ( [&](unsigned x, unsigned y) -> double
+      { return mask(x, y) < 1 ? 0. : in(x, y); } );
+  _plane_count = sums->add_plane
+    ( [&](unsigned x, unsigned y) -> double
+      { return mask(x, y) < 1 ? 0. : 1.; } );
+
+  if( _back_image != 0 )
+    {
+      const image_float& back = *_back_image;
+      const image_float& expmap = *_expmap_image;
+      const image_float& bg_expmap = *_bg_expmap_image;
+
+      _plane_bg = sums->add_plane
+	( [&](unsigned x, unsigned y) -> double
+	  { return mask(x, y) < 1 ? 0. : back(x, y); } );
+      _plane_bg_weight = sums->add_plane
+	( [&](unsigned x, unsigned y) -> double
+	  { return mask(x, y) < 1 ? 0. :
+	      double(back(x, y)) * double(expmap(x, y) / bg_expmap(x, y)); } );
+      _plane_expratio_2 = sums->add_plane
+	( [&](unsigned x, unsigned y) -> double
+	  { return mask(x, y) < 1 ? 0. :
+	      square( double(expmap(x, y) / bg_expmap(x, y)) ); } );
+    }
+
+  if( _noisemap_image != 0 )
+    {
+      const image_float& noisemap = *_noisemap_image;
+      _plane_noise_2 = sums->add_plane
+	( [&](unsigned x, unsigned y) -> double
+	  { return mask(x, y) < 1 ? 0. : square( double(noisemap(x, y)) ); } );
+    }
+}
 
-  // iterate over each pixel
-  for(unsigned y=0; y != _yw; ++y)
+void flux_estimator::smooth_rows()
+{
+  for(;;)
     {
-      // write out percentage on each y iteration
-      std::cout << '\r'
-		<< std::setprecision(3)
-		<< std::setw(8)
-		<< std::showpoint
-		<< y * 100. / _yw
-		<< "%";
-      std::cout.flush();
+      const unsigned y = _next_row++;
+      if( y >= _yw )
+	break;
 
       for(unsigned x=0; x != _xw; ++x)
 	{
-	  // skip masked pixels
-	  if( (*_mask_image)(x, y) < 1 )
+	  if( _pixels != 0 && (*_pixels)(x, y) == 0 )
 	    continue;
 
-	  double fg_sum = 0;
-	  double bg_sum = 0;
-	  double bg_sum_weight = 0;
-	  double expratio_sum_2 = 0;
-	  double sn_2 = 0;
-	  double noise_2 = 0;
+	  if( _disk_sum != 0 )
+	    smooth_pixel_disk(x, y);
+	  else
+	    smooth_pixel(x, y);
+	}
+
+      report_row_done();
+    }
+}
+
+// write out percentage when it changes (from any thread)
+void flux_estimator::report_row_done()
+{
+  std::lock_guard<std::mutex> lock(_progress_mutex);
+
+  ++_rows_done;
+  const int percent = int( _rows_done * 100. / _yw );
+  if( percent == _last_percent )
+    return;
+  _last_percent = percent;
+
+  std::cout << '\r'
+	    << std::setw(8)
+	    << percent
+	    << "%";
+  std::cout.flush();
+}
+
+void flux_estimator::smooth_pixel(const unsigned x, const unsigned y)
+{
+  // skip masked pixels
+  if( (*_mask_image)(x, y) < 1 )
+    return;
+
+  const double min_sn_2 = _minsn*_minsn;
+
+  double fg_sum = 0;
+  double bg_sum = 0;
+  double bg_sum_weight = 0;
+  double expratio_sum_2 = 0;
+  double sn_2 = 0;
+  double noise_2 = 0;
+
+  // if a noise map is supplied
+  double noise_2_total = 0.;
+
+  // keep track of number of pixels and radius
+  unsigned count = 0;
+  unsigned radius = 0;
+
+  // add pixel inside image to the sums
+  auto add_pixel = [&](const int xp, const int yp)
+    {
+      // skip masked pixels
+      if( (*_mask_image)(xp, yp) < 1 )
+	return;
+
+      const double in = (*_in_image)(xp, yp);
 
-	  // if a noise map is supplied
-	  double noise_2_total = 0.;
+      // count up background if any
+      if( _back_image != 0 )
+	{
+	  const double bg = (*_back_image)(xp, yp);
+	  const double expratio = (*_expmap_image)(xp, yp) /
+	    (*_bg_expmap_image)(xp, yp);
+	  bg_sum += bg;
+	  bg_sum_weight += bg*expratio;
+	  expratio_sum_2 += expratio*expratio;
+	}
+
+      // add up noise if supplied
+      if( _noisemap_image != 0 )
+	{
+	  noise_2_total += square((*_noisemap_image)(xp, yp));
+	}
 
-	  // keep track of number of pixels and radius
-	  unsigned count = 0;
-	  unsigned radius = 0;
+      fg_sum += in;
+      count++;
+    };
 
-	  // loop over pixels until signal to noise >= _minsn
-	  while ( radius < _max_annuli && sn_2 < min_sn_2 )
+  // loop over pixels until signal to noise >= _minsn
+  while ( radius < _max_annuli && sn_2 < min_sn_2 )
+    {
+      // iterate over points in radius, only checking the pixels are
+      // in the image if the annulus reaches the edge
+      if( radius <= x && radius <= y &&
+	  x + radius < _xw && y + radius < _yw )
+	{
+	  _annuli.for_each(radius, [&](int dx, int dy)
+	    {
+	      add_pixel( int(x) + dx, int(y) + dy );
+	    });
+	}
+      else
+	{
+	  _annuli.for_each(radius, [&](int dx, int dy)
 	    {
-	      // iterate over points in radius
-	      const _point_vec::const_iterator e =
-		_annuli_points[radius].end();
-	      for( _point_vec::const_iterator i =
-		     _annuli_points[radius].begin(); i != e; ++i )
-		{
-		  const int xp = int(x) + i->x;
-		  const int yp = int(y) + i->y;
-		  // skip pixels we don't have
-		  if( xp < 0 || yp < 0 || xp >= int(_xw) || yp >= int(_yw) )
-		    continue;
-		  
-		  // skip masked pixels
-		  if( (*_mask_image)(xp, yp) < 1 )
-		    continue;
-
-		  const double in = (*_in_image)(xp, yp);
-
-		  // count up background if any
-		  if( _back_image != 0 )
-		    {
-		      const double bg = (*_back_image)(xp, yp);
-		      const double expratio = (*_expmap_image)(xp, yp) /
-			(*_bg_expmap_image)(xp, yp);
-		      bg_sum += bg;
-		      bg_sum_weight += bg*expratio;
-		      expratio_sum_2 += expratio*expratio;
-		    }		      
-
-		  // add up noise if supplied
-		  if( _noisemap_image != 0 )
-		    {
-		      noise_2_total += square((*_noisemap_image)(xp, yp));
-		    }
-
-		  fg_sum += in;
-		  count++;
-		}
-	      
-	      // next shell
-
-	      if ( _noisemap_image != 0 )
-		{
-		  // we have a noise map
-		  noise_2 = noise_2_total;
-		}
-	      else
-		{
-		  // calculate noise
-		  noise_2 = error_sqd_est(fg_sum);
-
-		  if( _back_image != 0 )
-		    noise_2 += (expratio_sum_2 / count) * error_sqd_est(bg_sum);
-		}
-
-	      sn_2 = square(fg_sum - bg_sum_weight) / noise_2;
-	      radius++;
-	    }
-	  
-	  _iteration_image(x, y) = (fg_sum - bg_sum_weight)/count;
-	  _estimated_errors(x, y) = sqrt( noise_2 );
+	      const int xp = int(x) + dx;
+	      const int yp = int(y) + dy;
+	      // skip pixels we don't have
+	      if( xp >= 0 && yp >= 0 && xp < int(_xw) && yp < int(_yw) )
+		add_pixel( xp, yp );
+	    });
 	}
+
+      // next shell
+      noise_2 = noise_2_est(fg_sum, bg_sum, expratio_sum_2,
+			    noise_2_total, count);
+      sn_2 = square(fg_sum - bg_sum_weight) / noise_2;
+      radius++;
+    }
+
+  _iteration_image(x, y) = (fg_sum - bg_sum_weight)/count;
+  _estimated_errors(x, y) = sqrt( noise_2 );
+}
+
+void flux_estimator::smooth_pixel_disk(const unsigned x, const unsigned y)
+{
+  // skip masked pixels
+  if( (*_mask_image)(x, y) < 1 )
+    return;
+
+  const double min_sn_2 = _minsn*_minsn;
+
+  // get the sum of a plane (or zero if not summed)
+  auto plane = [](const double* sums, int idx) -> double
+    { return idx < 0 ? 0. : sums[idx]; };
+
+  // work out the signal and noise from the sums
+  double noise_2 = 0;
+  auto done = [&](const double* sums) -> bool
+    {
+      noise_2 = noise_2_est( sums[_plane_fg],
+			     plane(sums, _plane_bg),
+			     plane(sums, _plane_expratio_2),
+			     plane(sums, _plane_noise_2),
+			     unsigned(sums[_plane_count]) );
+      const double signal = sums[_plane_fg] - plane(sums, _plane_bg_weight);
+      return square(signal) / noise_2 >= min_sn_2;
+    };
+
+  double sums[disk_sum::max_planes];
+  _disk_sum->find_radius(x, y, _max_annuli-1, done, sums);
+
+  // the last call of done may not have been for the final radius
+  done(sums);
+
+  _iteration_image(x, y) = ( sums[_plane_fg] -
+			     plane(sums, _plane_bg_weight) ) /
+    sums[_plane_count];
+  _estimated_errors(x, y) = sqrt( noise_2 );
+}
+
+double flux_estimator::noise_2_est(const double fg_sum, const double bg_sum,
+				   const double expratio_sum_2,
+				   const double noise_2_total,
+				   const unsigned count) const
+{
+  if ( _noisemap_image != 0 )
+    {
+      // we have a noise map
+      return noise_2_total;
     }
 
-  std::cout << '\n'; c++;
+  // calculate noise
+  double noise_2 = error_sqd_est(fg_sum);
+
+  if( _back_image != 0 )
+    noise_2 += (expratio_sum_2 / count) * error_sqd_est(bg_sum);
+
+  return noise_2;
 }
@@ -2,7 +2,11 @@
 #define FLUX_ESTIMATOR_HH
 
 #include <vector>
+#include <atomic>
+#include <mutex>
 #include "misc.hh"
+#include "disk_sum.hh"
+#include "annuli.hh"
 
 class flux_estimator
 {
@@ -16,24 +20,35 @@ public:
 
 		 const image_float* const noisemap_image,
 
-		 const double minsn );
+		 const double minsn,
+		 const unsigned nthreads = 1 );
 
-  const image_float& operator()();
+  // how to find the smoothing radius (default annuli)
+  void set_smooth_mode(const smooth_mode mode) { _smooth_mode = mode; }
+
+  // only smooth the pixels which are non-zero in this image (the
+  // others are left at zero)
+  void set_pixels(const image_short* pixels) { _pixels = pixels; }
 
-  struct _point
-  {
-    _point(int xp, int yp) : x(xp), y(yp) {}
-    int x, y;
-  };
-  typedef std::vector<_point> _point_vec;
-  typedef std::vector<_point_vec> _point_vec_vec;
+  const image_float& operator()();
 
 private:
   void do_estimation();
 
-  // work out which points are in which annuli
-  void precalculate_annuli();
   void smooth();
+  // smooth rows handed out by _next_row (run by each thread)
+  void smooth_rows();
+  // add planes to sum for disk or box smoothing
+  void make_planes(disk_sum* sums);
+  void smooth_pixel(const unsigned x, const unsigned y);
+  void smooth_pixel_disk(const unsigned x, const unsigned y);
+  void report_row_done();
+
+  // work out the noise squared for the sums given
+  double noise_2_est(const double fg_sum, const double bg_sum,
+		     const double expratio_sum_2,
+		     const double noise_2_total,
+		     const unsigned count) const;
 
   void bin();
 
@@ -41,6 +56,8 @@ private:
 
   const unsigned _xw, _yw; // dimensions of images
   const double _minsn; // minimum signal:noise
+  const unsigned _nthreads; // number of threads to smooth with
+  smooth_mode _smooth_mode;
 
   const image_float* const _in_image;
   const image_float* const _back_image;
@@ -48,13 +65,26 @@ private:
   const image_float* const _expmap_image;
   const image_float* const _bg_expmap_image;
   const image_float* const _noisemap_image;
+  const image_short* _pixels;
 
-  // precalculated list of which points are in which annuli
+  // list of which points are in which annuli (grown as required)
   const unsigned _max_annuli;
-  _point_vec_vec _annuli_points;
+  annuli_table _annuli;
+
+  // prefix sums used if not smoothing with annuli, and the planes
+  // within them (-1 if not summed)
+  const disk_sum* _disk_sum;
+  int _plane_fg, _plane_bg, _plane_bg_weight, _plane_expratio_2,
+    _plane_noise_2, _plane_count;
 
   bool _done;
 
+  // next row to be smoothed, and progress reporting
+  std::atomic<unsigned> _next_row;
+  std::mutex _progress_mutex;
+  unsigned _rows_done;
+  int _last_percent;
+
   image_float _iteration_image; // output image
   image_float _estimated_errors; // errors on iteration
 };
@@ -7,8 +7,10 @@ template<class T> dm::memimage<T>::memimage(const std::string& filename)
   std::ifstream file(filename.c_str());
 
   file >> m_xw >> m_yw;
+  m_border = 0;
+  m_stride = m_xw;
 
-  m_data.resize(m_xw*m_yw);
+  m_data.resize(nelem());
   if( file )
     {
       for(unsigned y=0; y<m_yw; ++y)
@@ -1,6 +1,7 @@
 #ifndef DM_MEMIMAGE_HH
 #define DM_MEMIMAGE_HH
 
+#include <cstddef>
 #include <valarray>
 #include <string>
 #include <limits>
@@ -13,17 +14,34 @@ namespace dm {
   public:
     // blank image
     memimage(const unsigned xw, const unsigned yw, const T val = 0)
-      : m_xw(xw), m_yw(yw), m_data( val, xw*yw )
+      : m_xw(xw), m_yw(yw), m_border(0), m_stride(xw),
+	m_data( val, size_t(xw)*yw )
     {}
 
+    // Blank image with a border of pixels around it set to border_val.
+    // Pixels in the border can be read using coordinates from -border
+    // (passed as unsigned) to xw+border-1, so the neighbours of pixels
+    // can be looked at without checking they are in the image.
+    // The border is included in data() and flatdata().
+    memimage(const unsigned xw, const unsigned yw, const T val,
+	     const unsigned border, const T border_val)
+      : m_xw(xw), m_yw(yw), m_border(border), m_stride(xw+2*border),
+	m_data( border_val, m_stride*(yw+2*border) )
+    {
+      set_all(val);
+    }
+
     // copy image from another
     memimage(const memimage<T>& other)
-      : m_xw( other.m_xw ), m_yw( other.m_yw ), m_data( other.m_data )
+      : m_xw( other.m_xw ), m_yw( other.m_yw ),
+	m_border( other.m_border ), m_stride( other.m_stride ),
+	m_data( other.m_data )
     {}
 
     // initialise from C-style array
     memimage(const unsigned xw, const unsigned yw, const T* data)
-      : m_xw( xw ), m_yw( yw ), m_data( data, xw*yw )
+      : m_xw( xw ), m_yw( yw ), m_border(0), m_stride(xw),
+	m_data( data, size_t(xw)*yw )
     {}
 
     // initialise from other datatypes
@@ -36,21 +54,41 @@ namespace dm {
     // dump to file
     void dump_to_file(const std::string &filename) const;
 
-    // set all the pixels
-    void set_all(const T val = 0)  { m_data = val; }
+    // set all the pixels (leaving any border alone)
+    void set_all(const T val = 0)
+    {
+      if( m_border == 0 )
+	m_data = val;
+      else
+	for_each_pixel( [val](T& v) { v = val; } );
+    }
+
+    // copy of the image without its border
+    memimage<T> without_border() const
+    {
+      memimage<T> out(m_xw, m_yw);
+      for( unsigned y = 0; y != m_yw; ++y )
+	for( unsigned x = 0; x != m_xw; ++x )
+	  out(x, y) = operator()(x, y);
+      return out;
+    }
 
     // get access to pixels
     T& operator() (const unsigned x, const unsigned y)
-     { return m_data[x+y*m_xw]; }
+     { return m_data[index(x, y)]; }
     T operator() (const unsigned x, const unsigned y) const
-     { return m_data[x+y*m_xw]; }
+     { return m_data[index(x, y)]; }
 
     // get flat access to pixels
-    T& flatdata(const unsigned i)
+    T& flatdata(const size_t i)
     { return m_data[i]; }
-    T flatdata(const unsigned i) const
+    T flatdata(const size_t i) const
     { return m_data[i]; }
 
+    // index of pixel in flat data (64 bit, for very large images)
+    size_t index(const unsigned x, const unsigned y) const
+    { return size_t(x + m_border) + size_t(y + m_border)*m_stride; }
+
     // checked access to pixels
     class out_of_range_exception {};
     T& pixel(const unsigned x, const unsigned y);
@@ -66,9 +104,7 @@ namespace dm {
 	? std::numeric_limits<T>::min()
 	: -std::numeric_limits<T>::max();
 
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	maxval = std::max( maxval, m_data[i] );
+      for_each_pixel( [&maxval](T v) { maxval = std::max( maxval, v ); } );
       return maxval;
     }
 
@@ -77,86 +113,146 @@ namespace dm {
     {
       T minval = std::numeric_limits<T>::max();
 
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	minval = std::min( minval, m_data[i] );
+      for_each_pixel( [&minval](T v) { minval = std::min( minval, v ); } );
       return minval;
     }
 
     T sum() const
     {
       T tot = 0;
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	tot += m_data[i];
+      for_each_pixel( [&tot](T v) { tot += v; } );
       return tot;
     }
 
     // make all values <= upperval
     void trim_down(const T upperval)
     {
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	m_data[i] = std::min( m_data[i], upperval );
+      for_each_pixel( [upperval](T& v) { v = std::min( v, upperval ); } );
     }
 
     // make all values >= lowerval
     void trim_up(const T lowerval)
     {
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	m_data[i] = std::max( m_data[i], lowerval );
+      for_each_pixel( [lowerval](T& v) { v = std::max( v, lowerval ); } );
     }
 
   private:
     void assert_size_other(const memimage<T>& other) const
     {
-      if( m_xw != other.xw() || m_yw != other.yw() )
+      if( m_xw != other.xw() || m_yw != other.yw() ||
+	  m_border != other.border() )
 	throw size_mismatch_exception();
     }
 
+    // call fn on each pixel, a row at a time, skipping the border
+    template<class F> void for_each_pixel(F fn)
+    {
+      for( unsigned y = 0; y != m_yw; ++y )
+	{
+	  T* row = &m_data[index(0, y)];
+	  for( unsigned x = 0; x != m_xw; ++x )
+	    fn(row[x]);
+	}
+    }
+    template<class F> void for_each_pixel(F fn) const
+    {
+      for( unsigned y = 0; y != m_yw; ++y )
+	{
+	  const T* row = &m_data[index(0, y)];
+	  for( unsigned x = 0; x != m_xw; ++x )
+	    fn(row[x]);
+	}
+    }
+
+    // apply fn to each pixel and the pixel of other at the same place
+    template<class F> void for_each_pixel_with(const memimage<T>& other,
+					       F fn)
+    {
+      assert_size_other(other);
+      for( unsigned y = 0; y != m_yw; ++y )
+	{
+	  T* row = &m_data[index(0, y)];
+	  const T* orow = &other.m_data[other.index(0, y)];
+	  for( unsigned x = 0; x != m_xw; ++x )
+	    fn(row[x], orow[x]);
+	}
+    }
+
   public:
-    // various operations with images
+    // various operations with images (leaving any border alone)
     //  multiply image by another
     const memimage<T>& operator *= (const memimage<T>& other)
     {
-      assert_size_other(other); m_data *= other.data(); return *this;
+      if( m_border == 0 )
+	{ assert_size_other(other); m_data *= other.data(); }
+      else
+	for_each_pixel_with( other, [](T& v, T o) { v *= o; } );
+      return *this;
     }
     const memimage<T>& operator /= (const memimage<T>& other)
     {
-      assert_size_other(other); m_data /= other.data(); return *this;
+      if( m_border == 0 )
+	{ assert_size_other(other); m_data /= other.data(); }
+      else
+	for_each_pixel_with( other, [](T& v, T o) { v /= o; } );
+      return *this;
     }
     const memimage<T>& operator -= (const memimage<T>& other)
     {
-      assert_size_other(other); m_data -= other.data(); return *this;
+      if( m_border == 0 )
+	{ assert_size_other(other); m_data -= other.data(); }
+      else
+	for_each_pixel_with( other, [](T& v, T o) { v -= o; } );
+      return *this;
     }
     const memimage<T>& operator += (const memimage<T>& other)
     {
-      assert_size_other(other); m_data += other.data(); return *this;
+      if( m_border == 0 )
+	{ assert_size_other(other); m_data += other.data(); }
+      else
+	for_each_pixel_with( other, [](T& v, T o) { v += o; } );
+      return *this;
     }
     
     // with constants
     const memimage<T>& operator *= (const T other)
     {
-      m_data *= other; return *this;
+      if( m_border == 0 )
+	m_data *= other;
+      else
+	for_each_pixel( [other](T& v) { v *= other; } );
+      return *this;
     }
     const memimage<T>& operator /= (const T other)
     {
-      m_data /= other; return *this;
+      if( m_border == 0 )
+	m_data /= other;
+      else
+	for_each_pixel( [other](T& v) { v /= other; } );
+      return *this;
     }
     const memimage<T>& operator -= (const T other)
     {
-      m_data -= other; return *this;
+      if( m_border == 0 )
+	m_data -= other;
+      else
+	for_each_pixel( [other](T& v) { v -= other; } );
+      return *this;
     }
     const memimage<T>& operator += (const T other)
     {
-      m_data += other; return *this;
+      if( m_border == 0 )
+	m_data += other;
+      else
+	for_each_pixel( [other](T& v) { v += other; } );
+      return *this;
     }
 
     // return information about the image
     unsigned xw() const { return m_xw; }  // return width
     unsigned yw() const { return m_yw; }  // return height
-    unsigned nelem() const { return m_xw*m_yw; } // no elements
+    unsigned border() const { return m_border; }  // width of border
+    size_t nelem() const { return size_t(m_xw)*m_yw; } // no elements
     const std::valarray<T>& data() const { return m_data; } // return data
 
     // these make temporaries
@@ -197,6 +293,8 @@ namespace dm {
     
   private:
     unsigned m_xw, m_yw;
+    unsigned m_border;   // width of border around image
+    size_t m_stride;     // distance between rows
     std::valarray<T> m_data;
   };
 
@@ -209,25 +307,23 @@ namespace dm {
 template<class T> template<class T2>
 dm::memimage<T>::memimage(const unsigned xw, const unsigned yw,
 			  const T2* const data)
-  : m_xw(xw), m_yw(yw),
+  : m_xw(xw), m_yw(yw), m_border(0), m_stride(xw),
     m_data( data, nelem() )
 {
-  const unsigned size = nelem();
-  for(unsigned i=0; i != size; ++i)
+  const size_t size = nelem();
+  for(size_t i=0; i != size; ++i)
     m_data[i] = static_cast<T>( data[i] );
 }
 
 // copy image of different type
 template<class T> template<class T2>
 dm::memimage<T>::memimage(const memimage<T2>& other)
-  : m_xw( other.xw() ), m_yw( other.yw() ),
+  : m_xw( other.xw() ), m_yw( other.yw() ), m_border(0), m_stride(m_xw),
     m_data( static_cast<T>(0), nelem() )
 {
-  const unsigned size = nelem();
-  const std::valarray<T2>& otherdata = other.data();
-
-  for(unsigned i=0; i != size; ++i)
-    m_data[i] = static_cast<T>(otherdata[i]);
+  for(unsigned y=0; y != m_yw; ++y)
+    for(unsigned x=0; x != m_xw; ++x)
+      operator()(x, y) = static_cast<T>( other(x, y) );
 }
 
 #endif
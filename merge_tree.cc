@@ -0,0 +1,330 @@
+// hierarchy of bin merges, for finding coarser binnings
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#include <map>
+#include <queue>
+#include <string>
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+
+#include "merge_tree.hh"
+#include "fitsio_simple.hh"
+
+namespace
+{
+  // pixels next to each other in two bins, and the step in smoothed
+  // value between them
+  struct bin_edge
+  {
+    long a, b;
+    double delta;
+
+    bool operator<(const bin_edge& o) const
+    {
+      if( a != o.a ) return a < o.a;
+      if( b != o.b ) return b < o.b;
+      return delta < o.delta;
+    }
+  };
+
+  // queue order: lowest signal to noise first, then lowest node
+  struct group_entry
+  {
+    double sn_2;
+    long node;
+
+    bool operator<(const group_entry& o) const
+    {
+      if( sn_2 != o.sn_2 ) return sn_2 > o.sn_2;
+      return node > o.node;
+    }
+  };
+
+  // neighbouring groups of a group, with the smallest step to each
+  typedef std::map<long, double> neigh_map;
+}
+
+merge_tree::merge_tree()
+  : _no_bins(0)
+{
+}
+
+void merge_tree::build(const bin_helper& helper, const bin_vector& bins)
+{
+  const image_long& bins_image = *helper.bins_image();
+  const image_float& smoothed_image = *helper.smoothed_image();
+  const unsigned xw = helper.xw();
+  const unsigned yw = helper.yw();
+
+  _no_bins = 0;
+  for( bin_vector::const_iterator b = bins.begin(); b != bins.end(); ++b )
+    _no_bins = std::max( _no_bins, b->bin_no()+1 );
+
+  std::vector<bin_sums> sums( _no_bins );
+  for( bin_vector::const_iterator b = bins.begin(); b != bins.end(); ++b )
+    if( b->bin_no() >= 0 )
+      sums[ b->bin_no() ] = b->sums();
+
+  // look at the pixels to the right and below each pixel (the border
+  // of the bins image is never a bin)
+  std::vector<bin_edge> edges;
+  for( unsigned y = 0; y != yw; ++y )
+    for( unsigned x = 0; x != xw; ++x )
+      {
+	const long a = bins_image(x, y);
+	if( a < 0 )
+	  continue;
+
+	for( unsigned n = 0; n != 2; ++n )
+	  {
+	    const unsigned xp = x + (n == 0 ? 1 : 0);
+	    const unsigned yp = y + (n == 0 ? 0 : 1);
+	    const long b = bins_image(xp, yp);
+	    if( b < 0 || b == a )
+	      continue;
+
+	    bin_edge e;
+	    e.a = std::min(a, b);
+	    e.b = std::max(a, b);
+	    e.delta = std::fabs( smoothed_image(x, y) -
+				 smoothed_image(xp, yp) );
+	    edges.push_back( e );
+	  }
+      }
+
+  // after sorting, the first edge for each pair has the smallest step
+  std::sort( edges.begin(), edges.end() );
+  std::vector<neigh_map> neighs( _no_bins );
+  for( std::vector<bin_edge>::const_iterator e = edges.begin();
+       e != edges.end(); ++e )
+    {
+      neighs[e->a].insert( std::make_pair(e->b, e->delta) );
+      neighs[e->b].insert( std::make_pair(e->a, e->delta) );
+    }
+  std::vector<bin_edge>().swap( edges );
+
+  // the bins are the first nodes
+  _nodes.clear();
+  std::priority_queue<group_entry> queue;
+  for( long i = 0; i != _no_bins; ++i )
+    {
+      const bin_sums& s = sums[i];
+      node nd;
+      nd.left = nd.right = -1;
+      nd.level = 0;
+      nd.signal = s.signal();
+      nd.noise = s.count == 0 ? 0. : std::sqrt( helper.noise_2(s) );
+      nd.count = s.count;
+      _nodes.push_back( nd );
+
+      if( s.count != 0 )
+	{
+	  group_entry ge;
+	  ge.sn_2 = helper.sn_2(s);
+	  ge.node = i;
+	  queue.push( ge );
+	}
+    }
+  std::vector<char> merged( _no_bins, 0 );
+
+  // merge the lowest signal to noise group until none are left which
+  // have neighbours
+  double level = 0;
+  while( ! queue.empty() )
+    {
+      const group_entry low = queue.top();
+      queue.pop();
+      if( merged[low.node] || neighs[low.node].empty() )
+	continue;
+
+      // neighbour with the smallest step (lowest node if equal)
+      long best = -1;
+      double bestdelta = 1e99;
+      for( neigh_map::const_iterator i = neighs[low.node].begin();
+	   i != neighs[low.node].end(); ++i )
+	if( i->second < bestdelta )
+	  {
+	    bestdelta = i->second;
+	    best = i->first;
+	  }
+
+      const long m = _nodes.size();
+      level = std::max( level, std::sqrt(low.sn_2) );
+
+      bin_sums s = sums[low.node];
+      s += sums[best];
+      sums.push_back( s );
+
+      node nd;
+      nd.left = low.node;
+      nd.right = best;
+      nd.level = level;
+      nd.signal = s.signal();
+      nd.noise = std::sqrt( helper.noise_2(s) );
+      nd.count = s.count;
+      _nodes.push_back( nd );
+
+      merged[low.node] = merged[best] = 1;
+      merged.push_back( 0 );
+
+      // neighbours of the new group, adding the shorter list to the
+      // longer one
+      neighs.push_back( neigh_map() );
+      neigh_map& nlow = neighs[low.node];
+      neigh_map& nbest = neighs[best];
+      neigh_map& nm = neighs[m];
+      if( nlow.size() >= nbest.size() )
+	nm.swap( nlow );
+      else
+	nm.swap( nbest );
+      neigh_map& rest = nlow.empty() ? nbest : nlow;
+      for( neigh_map::const_iterator i = rest.begin(); i != rest.end(); ++i )
+	{
+	  std::pair<neigh_map::iterator, bool> r = nm.insert( *i );
+	  if( ! r.second )
+	    r.first->second = std::min( r.first->second, i->second );
+	}
+      neigh_map().swap( rest );
+      nm.erase( low.node );
+      nm.erase( best );
+
+      for( neigh_map::const_iterator i = nm.begin(); i != nm.end(); ++i )
+	{
+	  neigh_map& other = neighs[i->first];
+	  other.erase( low.node );
+	  other.erase( best );
+	  other[m] = i->second;
+	}
+
+      group_entry ge;
+      ge.sn_2 = helper.sn_2(s);
+      ge.node = m;
+      queue.push( ge );
+    }
+}
+
+std::vector<long> merge_tree::cut(const double threshold,
+				  std::vector<long>* groups) const
+{
+  const long no_nodes = _nodes.size();
+
+  std::vector<long> parent( no_nodes, -1 );
+  for( long i = 0; i != no_nodes; ++i )
+    if( _nodes[i].left >= 0 )
+      parent[ _nodes[i].left ] = parent[ _nodes[i].right ] = i;
+
+  // highest merged node above each node (parents come after children)
+  std::vector<long> top( no_nodes );
+  for( long i = no_nodes-1; i >= 0; --i )
+    {
+      const long p = parent[i];
+      top[i] = ( p >= 0 && _nodes[p].level < threshold ) ? top[p] : i;
+    }
+
+  // number the groups in order of their top node
+  std::vector<long> number( no_nodes, -1 );
+  for( long i = 0; i != _no_bins; ++i )
+    if( _nodes[i].count != 0 )
+      number[ top[i] ] = 0;
+
+  if( groups != 0 )
+    groups->clear();
+  long no = 0;
+  for( long i = 0; i != no_nodes; ++i )
+    if( number[i] == 0 )
+      {
+	number[i] = no++;
+	if( groups != 0 )
+	  groups->push_back( i );
+      }
+
+  std::vector<long> newno( _no_bins, -1 );
+  for( long i = 0; i != _no_bins; ++i )
+    if( _nodes[i].count != 0 )
+      newno[i] = number[ top[i] ];
+
+  return newno;
+}
+
+void merge_tree::write(FITSFile& file) const
+{
+  const size_t nrows = _nodes.size();
+  std::vector<long> left(nrows), right(nrows), count(nrows);
+  std::vector<double> level(nrows), signal(nrows), noise(nrows);
+  for( size_t i = 0; i != nrows; ++i )
+    {
+      left[i] = _nodes[i].left;
+      right[i] = _nodes[i].right;
+      level[i] = _nodes[i].level;
+      signal[i] = _nodes[i].signal;
+      noise[i] = _nodes[i].noise;
+      count[i] = _nodes[i].count;
+    }
+
+  const char* const names[] = {
+    "LEFT", "RIGHT", "LEVEL", "SIGNAL", "NOISE", "NPIX" };
+  const char* const formats[] = {
+    "1K", "1K", "1D", "1D", "1D", "1K" };
+  const char* const units[] = {
+    "", "", "", "count", "count", "pixel" };
+  const unsigned nocols = sizeof(names) / sizeof(names[0]);
+
+  file.createTable("TREE", nrows,
+		   std::vector<std::string>(names, names+nocols),
+		   std::vector<std::string>(formats, formats+nocols),
+		   std::vector<std::string>(units, units+nocols));
+  file.updateKey("NBINS", _no_bins);
+  file.writeColumn(1, left);
+  file.writeColumn(2, right);
+  file.writeColumn(3, level);
+  file.writeColumn(4, signal);
+  file.writeColumn(5, noise);
+  file.writeColumn(6, count);
+}
+
+void merge_tree::read(FITSFile& file)
+{
+  file.moveToTable("TREE");
+  file.readKey("NBINS", &_no_bins);
+
+  std::vector<long> left, right, count;
+  std::vector<double> level, signal, noise;
+  file.readColumn("LEFT", &left);
+  file.readColumn("RIGHT", &right);
+  file.readColumn("LEVEL", &level);
+  file.readColumn("SIGNAL", &signal);
+  file.readColumn("NOISE", &noise);
+  file.readColumn("NPIX", &count);
+
+  const long nrows = left.size();
+  if( _no_bins < 0 || _no_bins > nrows )
+    {
+      std::cerr << "(!) Merge tree has an invalid number of bins\n";
+      std::exit(1);
+    }
+
+  _nodes.resize( nrows );
+  for( long i = 0; i != nrows; ++i )
+    {
+      node& nd = _nodes[i];
+      nd.left = left[i];
+      nd.right = right[i];
+      nd.level = level[i];
+      nd.signal = signal[i];
+      nd.noise = noise[i];
+      nd.count = count[i];
+
+      // merged nodes must come before the merge
+      const bool is_bin = i < _no_bins;
+      if( ( is_bin && ( nd.left != -1 || nd.right != -1 ) ) ||
+	  ( ! is_bin && ( nd.left < 0 || nd.right < 0 ||
+			  nd.left >= i || nd.right >= i ) ) )
+	{
+	  std::cerr << "(!) Merge tree has an invalid node " << i << '\n';
+	  std::exit(1);
+	}
+    }
+}
@@ -0,0 +1,60 @@
+// hierarchy of bin merges, for finding coarser binnings
+// Copyright Jeremy Sanders 2025
+// Released under the GNU Public Licence (GPL)
+
+#ifndef MERGE_TREE_HH
+#define MERGE_TREE_HH
+
+#include <vector>
+
+#include "bin.hh"
+
+class FITSFile;
+
+// Records how bins would be merged into larger bins to reach higher
+// signal to noise thresholds. Starting from the bins, the group with
+// the lowest signal to noise is repeatedly merged with the
+// neighbouring group it has the smallest step in smoothed value to,
+// as when scrubbing whole bins. Each merge makes a new node.
+//
+// The first nodes are the bins, numbered as in the binmap (unused
+// numbers are empty nodes). The level of a merge is the largest signal
+// to noise merged so far, so the merges made for a threshold are those
+// with a level below it.
+class merge_tree
+{
+public:
+  struct node
+  {
+    long left, right;     // nodes merged (-1 for a bin)
+    double level;         // merged if threshold > level (0 for a bin)
+    double signal, noise;
+    unsigned long count;  // number of pixels
+  };
+  typedef std::vector<node> node_vector;
+
+  merge_tree();
+
+  // make the tree from the bins, whose pixels are in the bins image
+  void build(const bin_helper& helper, const bin_vector& bins);
+
+  // number of bins (the first nodes)
+  long no_bins() const { return _no_bins; }
+  const node_vector& nodes() const { return _nodes; }
+
+  // For a threshold, get the new number of each bin (numbered from 0
+  // in order of the lowest node). If groups is given, it is set to the
+  // node of each new number.
+  std::vector<long> cut(const double threshold,
+			std::vector<long>* groups = 0) const;
+
+  // write or read as a TREE binary table extension
+  void write(FITSFile& file) const;
+  void read(FITSFile& file);
+
+private:
+  long _no_bins;
+  node_vector _nodes;
+};
+
+#endif
@@ -10,6 +10,7 @@
 typedef dm::memimage<double> image_dbl;
 typedef dm::memimage<float> image_float;
 typedef dm::memimage<long> image_long;
+typedef dm::memimage<int> image_int;
 typedef dm::memimage<short> image_short;
 typedef dm::memimage<bool> image_bool;
 
@@ -55,4 +56,30 @@ private:
   T* _ptr;
 };
 
+// distance along a Hilbert curve filling an n x n square (n a power
+// of two) to x, y
+inline unsigned long long hilbert_index(const unsigned n, unsigned x,
+					unsigned y)
+{
+  unsigned long long d = 0;
+  for( unsigned s = n/2; s > 0; s /= 2 )
+    {
+      const unsigned rx = (x & s) != 0;
+      const unsigned ry = (y & s) != 0;
+      d += (unsigned long long)(s) * s * ((3*rx) ^ ry);
+
+      // rotate the quadrant so the curve joins up
+      if( ry == 0 )
+	{
+	  if( rx == 1 )
+	    {
+	      x = n-1 - x;
+	      y = n-1 - y;
+	    }
+	  std::swap(x, y);
+	}
+    }
+  return d;
+}
+
 #endif
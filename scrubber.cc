@@ -2,6 +2,10 @@
 #include <algorithm>
 #include <cassert>
 #include <iomanip>
+#include <queue>
+#include <cmath>
+#include <atomic>
+#include <thread>
 
 #include "scrubber.hh"
 
@@ -26,177 +30,575 @@ scrubber::scrubber( bin_helper& helper, bin_vector& bins )
 {
 }
 
-void scrubber::find_best_neighbour(bin* thebin, bool allow_unconstrained,
-				   int* bestx, int* besty,
-				   int* bestbin )
+// add candidate for moving edge pixel x,y of the bin into the bin of
+// its neighbour n
+void scrubber::add_candidate(const bin* thebin, const int x, const int y,
+			     const unsigned n, candidate_vector& cands)
+{
+  const int xp = x + bin_neigh_x[n];
+  const int yp = y + bin_neigh_y[n];
+
+  // if the neighbour is a real and different bin
+  // (unbinned pixels and the border are negative)
+  const long nbin = (*_helper.bins_image())(xp, yp);
+  if( nbin < 0 || nbin == thebin->bin_no() )
+    return;
+
+  const image_float& smoothed_image = *_helper.smoothed_image();
+
+  candidate c;
+  c.delta = fabs( smoothed_image(x, y) - smoothed_image(xp, yp) );
+  c.order = thebin->edge_order(x, y);
+  c.n = n;
+  c.x = x; c.y = y;
+  c.nbin = nbin;
+
+  if( c.delta < 1e99 )
+    {
+      cands.push_back(c);
+      std::push_heap( cands.begin(), cands.end(), candidate_later );
+    }
+}
+
+// find the best pixel to move, and the bin to move it to. Candidates
+// are taken in the order of the old scan over the edge points, so the
+// first passing the constraint is chosen, or if none pass, the first.
+bool scrubber::find_best_neighbour(const bin* thebin,
+				   candidate_vector& cands,
+				   candidate* best)
+{
+  const image_long& bins_image = * _helper.bins_image();
+  const long binno = thebin->bin_no();
+  const bool constrain_fill = _helper.constrain_fill();
+
+  candidate_vector failed;
+  bool found = false;
+
+  while( ! cands.empty() )
+    {
+      std::pop_heap( cands.begin(), cands.end(), candidate_later );
+      const candidate c = cands.back();
+      cands.pop_back();
+
+      // skip if the pixel has moved since it was added
+      if( bins_image(c.x, c.y) != binno )
+	continue;
+
+      // we skip neighbours with too long a constraint if reqstd
+      if( constrain_fill &&
+	  ! _bins[c.nbin].check_constraint( c.x + bin_neigh_x[c.n],
+					    c.y + bin_neigh_y[c.n] ) )
+	{
+	  failed.push_back(c);
+	  continue;
+	}
+
+      *best = c;
+      found = true;
+      break;
+    }
+
+  // if none, then ignore constraints
+  if( ! found && ! failed.empty() )
+    {
+      *best = failed.front();
+      found = true;
+    }
+
+  // put back the ones which failed, as they may pass later
+  for( candidate_vector::const_iterator i = failed.begin();
+       i != failed.end(); ++i )
+    {
+      cands.push_back(*i);
+      std::push_heap( cands.begin(), cands.end(), candidate_later );
+    }
+
+  return found;
+}
+
+bool scrubber::dissolve_bin( bin* thebin, std::vector<int>* receivers )
+{
+  const image_long& bins_image = * _helper.bins_image();
+  const long binno = thebin->bin_no();
+  thebin->expand();
+
+  // remove edge pixels without any neighbours in other bins, then
+  // make the list of places pixels could move to
+  candidate_vector cands;
+  {
+    const bin::_Pt_container& edgepoints = thebin->get_edge_points();
+    for( size_t pt = 0; pt != edgepoints.size(); ++pt )
+      {
+	// skip removed edge points
+	if( bin::is_edge_hole(edgepoints[pt]) )
+	  continue;
+
+	const int x = edgepoints[pt].x();
+	const int y = edgepoints[pt].y();
+
+	const size_t oldsize = cands.size();
+	for( unsigned n = 0; n != bin_no_neigh; ++n )
+	  add_candidate( thebin, x, y, n, cands );
+
+	if( cands.size() == oldsize )
+	  thebin->remove_edge_point(pt);
+      }
+  }
+
+  // loop until no pixels remaining
+  while( thebin->count() != 0 )
+    {
+      candidate best;
+
+      // stop dissolving bin if we have no neigbours for our remaining
+      // pixels
+      if( ! find_best_neighbour( thebin, cands, &best ) )
+	return false;
+
+      // reassign pixel
+      thebin->remove_point(best.x, best.y);
+      _bins[ best.nbin ].expand();
+      _bins[ best.nbin ].add_point(best.x, best.y);
+      if( receivers != 0 )
+	receivers->push_back(best.nbin);
+
+      // pixels next to the moved one can now move into its bin
+      for( unsigned n = 0; n != bin_no_neigh; ++n )
+	{
+	  const int xp = best.x + bin_neigh_x[n];
+	  const int yp = best.y + bin_neigh_y[n];
+	  if( bins_image(xp, yp) != binno )
+	    continue;
+
+	  // find neighbour of this pixel which is the moved pixel
+	  for( unsigned m = 0; m != bin_no_neigh; ++m )
+	    {
+	      if( xp + bin_neigh_x[m] == best.x &&
+		  yp + bin_neigh_y[m] == best.y )
+		add_candidate( thebin, xp, yp, m, cands );
+	    }
+	}
+    }
+
+  return true;
+}
+
+bool scrubber::dissolve_bin_bulk( bin* thebin, std::vector<int>* receivers )
 {
   const image_float& smoothed_image = *_helper.smoothed_image();
   const image_long& bins_image = * _helper.bins_image();
+  const image_int& point_slots = * _helper.point_slots();
   const long binno = thebin->bin_no();
+  thebin->expand();
+
+  // bin to move each point to, indexed by slot
+  const bin::_Pt_container& points = thebin->get_all_points();
+  std::vector<long> dest( points.size(), -1 );
+
+  // pixels on the boundary go to the neighbouring bin closest in value
+  bin::_Pt_container fill;
+  fill.reserve( points.size() );
+  for( size_t i = 0; i != points.size(); ++i )
+    {
+      const int x = points[i].x();
+      const int y = points[i].y();
+
+      double bestdelta = 1e99;
+      for( unsigned n = 0; n != bin_no_neigh; ++n )
+	{
+	  const int xp = x + bin_neigh_x[n];
+	  const int yp = y + bin_neigh_y[n];
 
-  double bestdelta = 1e99;
+	  const long nbin = bins_image(xp, yp);
+	  if( nbin < 0 || nbin == binno )
+	    continue;
+
+	  const double delta = fabs( smoothed_image(x, y) -
+				     smoothed_image(xp, yp) );
+	  if( delta < bestdelta )
+	    {
+	      bestdelta = delta;
+	      dest[i] = nbin;
+	    }
+	}
 
-  bin::_Pt_container& edgepoints = thebin->get_edge_points();
+      if( dest[i] != -1 )
+	fill.push_back( points[i] );
+    }
 
-  size_t pt = 0;
-  while( pt < edgepoints.size() )
+  // flood fill the rest of the bin from the boundary
+  for( size_t f = 0; f != fill.size(); ++f )
     {
-      const int x = edgepoints[pt].x();
-      const int y = edgepoints[pt].y();
-      const double v = smoothed_image(x, y);
+      const int x = fill[f].x();
+      const int y = fill[f].y();
+      const long d = dest[ point_slots(x, y) ];
 
-      // loop over neighbours of edge point
-      bool anyneighbours = false;
-      for( size_t n = 0; n != bin_no_neigh; ++n )
+      for( unsigned n = 0; n != bin_no_neigh; ++n )
 	{
 	  const int xp = x + bin_neigh_x[n];
 	  const int yp = y + bin_neigh_y[n];
+	  if( bins_image(xp, yp) != binno )
+	    continue;
 
-	  // select pixels in neighbouring bins
-	  if( xp >= 0 && yp >= 0 && xp < int(_xw) && yp < int(_yw) )
+	  long& nd = dest[ point_slots(xp, yp) ];
+	  if( nd == -1 )
 	    {
-	      // if the neighbour is a real and different bin
-	      const long nbin = bins_image(xp, yp);
-	      if( nbin != -1 && nbin != binno )
-		{
-		  anyneighbours = true;
-
-		  // we skip neighbours with too long a constraint if reqstd
-		  if( _helper.constrain_fill() &&
-		      ! allow_unconstrained &&
-		      ! _bins[nbin].check_constraint(xp, yp) )
-		    continue;
-
-		  const double delta = fabs( v - smoothed_image(xp, yp) );
-		  if( delta < bestdelta )
-		    {
-		      bestdelta = delta;
-		      *bestx = x;
-		      *besty = y;
-		      *bestbin = bins_image(xp, yp);
-		    }
-		} // valid neighbour
-	    } // in image range
-	} // loop over neighbours
-
-      // remove edge pixels without any neighbours
-      if( ! anyneighbours )
-        edgepoints.erase(edgepoints.begin() + pt);
-      else
-	++pt;
+	      nd = d;
+	      fill.emplace_back(xp, yp);
+	    }
+	}
     }
 
+  if( fill.empty() )
+    return false;
+
+  // some pixels can't be reached, so move pixel by pixel
+  if( fill.size() != points.size() )
+    return dissolve_bin( thebin, receivers );
+
+  // now move the pixels
+  thebin->drop_bin();
+  for( bin::_Pt_container::const_iterator p = fill.begin();
+       p != fill.end(); ++p )
+    {
+      const long d = dest[ point_slots(p->x(), p->y()) ];
+      _bins[d].expand();
+      _bins[d].add_point( p->x(), p->y() );
+      if( receivers != 0 )
+	receivers->push_back(d);
+    }
+
+  return true;
 }
 
-void scrubber::dissolve_bin( bin* thebin )
+namespace
 {
-  // loop until no pixels remaining
-  while( thebin->count() != 0 )
+  // bin waiting to be scrubbed, with its S/N when added to the queue
+  struct scrub_entry
+  {
+    double sn_2;
+    unsigned index;
+    unsigned version;
+  };
+
+  // order queue by lowest S/N, then lowest bin number
+  struct scrub_later
+  {
+    bool operator()(const scrub_entry& a, const scrub_entry& b) const
     {
-      int bestx = -1;
-      int besty = -1;
-      int bestbin = -1;
+      return a.sn_2 > b.sn_2 || ( a.sn_2 == b.sn_2 && a.index > b.index );
+    }
+  };
+}
 
-      // find best neighbour within constraints
-      find_best_neighbour( thebin, false, &bestx, &besty, &bestbin );
+// add link between two bins to graph, if not already present
+static void link_bins( std::vector< std::vector<unsigned> >& graph,
+		       const unsigned a, const unsigned b )
+{
+  std::vector<unsigned>& na = graph[a];
+  if( std::find( na.begin(), na.end(), b ) == na.end() )
+    {
+      na.push_back(b);
+      graph[b].push_back(a);
+    }
+}
 
-      // if none, then ignore constraints
-      if( bestx == -1 && _helper.constrain_fill() )
-	find_best_neighbour( thebin, true, &bestx, &besty, &bestbin );
+void scrubber::make_bin_graph( bin_graph& graph ) const
+{
+  const image_long& bins_image = * _helper.bins_image();
 
-      // stop dissolving bin if we have no neigbours for our remaining
-      // pixels
-      if( bestbin == -1 )
+  graph.assign( _no_bins, std::vector<unsigned>() );
+  for( unsigned y = 0; y != _yw; ++y )
+    for( unsigned x = 0; x != _xw; ++x )
+      {
+	const long b = bins_image(x, y);
+	if( b < 0 )
+	  continue;
+
+	// only need to look right and up, as links go both ways
+	// (the border is negative)
+	const long right = bins_image(x+1, y);
+	if( right >= 0 && right != b )
+	  link_bins( graph, b, right );
+	const long up = bins_image(x, y+1);
+	if( up >= 0 && up != b )
+	  link_bins( graph, b, up );
+      }
+}
+
+void scrubber::update_bin_graph( bin_graph& graph, const unsigned binno,
+				 const bin::_Pt_container& oldpoints ) const
+{
+  const image_long& bins_image = * _helper.bins_image();
+
+  // remove bin if it has gone
+  if( _bins[binno].count() == 0 )
+    {
+      for( std::vector<unsigned>::const_iterator n = graph[binno].begin();
+	   n != graph[binno].end(); ++n )
 	{
-	  const long binno = thebin->bin_no();
-	  cout << "WARNING: Could not dissolve bin "
-	       << binno << " into surroundings\n";
-	  _cannot_dissolve[ binno ] = true;
-	  return;
+	  std::vector<unsigned>& nn = graph[*n];
+	  nn.erase( std::find( nn.begin(), nn.end(), binno ) );
 	}
-
-      // reassign pixel
-      thebin->remove_point(bestx, besty);
-      _bins[ bestbin ].add_point(bestx, besty);
+      graph[binno].clear();
     }
+
+  // the moved pixels may now join bins which did not touch before
+  auto link_pixel = [&](const int x, const int y)
+    {
+      const long b = bins_image(x, y);
+      for( unsigned n = 0; n != bin_no_neigh; ++n )
+	{
+	  const long nb = bins_image( x + bin_neigh_x[n],
+				      y + bin_neigh_y[n] );
+	  if( nb >= 0 && nb != b )
+	    link_bins( graph, b, nb );
+	}
+    };
+
+  // (the store keeps the pixels the bin had until it is compacted)
+  const long entry = _bins[binno].store_index();
+  if( entry >= 0 )
+    _helper.store()->for_each_point( entry, link_pixel );
+  else
+    for( bin::_Pt_container::const_iterator p = oldpoints.begin();
+	 p != oldpoints.end(); ++p )
+      link_pixel( p->x(), p->y() );
 }
 
 void scrubber::scrub()
 {
-  std::cout << "(i) Starting scrubbing...\n";
-
-  // put bins into a pointer array so we can discard them quickly when
-  // we don't need to consider them
-  typedef std::vector<bin*> BPV;
-  BPV bin_ptrs;
-  bin_ptrs.reserve( _no_bins );
+  const bool verbose = _helper.verbose();
+  if( verbose )
+    std::cout << "(i) Starting scrubbing...\n";
+
+  // Bins below the threshold are kept in a queue ordered by their S/N,
+  // so the lowest can be found quickly. When a bin's S/N changes, it
+  // is added again with a new version, and old entries are skipped.
+  // Bins are dropped once their S/N goes above the threshold, even
+  // if it later falls again.
+  typedef std::priority_queue<scrub_entry, std::vector<scrub_entry>,
+			      scrub_later> queue_type;
+  queue_type queue;
+  std::vector<unsigned> version( _no_bins, 0 );
+  std::vector<bool> waiting( _no_bins, false );
+  size_t no_waiting = 0;
+
+  // add bin to queue with its current S/N
+  auto push_bin = [&](const unsigned i)
+    {
+      scrub_entry e;
+      e.sn_2 = _bins[i].sn_2();
+      e.index = i;
+      e.version = ++version[i];
+      // bins with an undefined S/N are never picked
+      if( ! std::isnan(e.sn_2) )
+	queue.push(e);
+    };
+
+  // remove entries for bins no longer waiting, or with old S/N
+  auto skip_old = [&]()
+    {
+      while( ! queue.empty() &&
+	     ( ! waiting[queue.top().index] ||
+	       version[queue.top().index] != queue.top().version ) )
+	queue.pop();
+    };
+
+  // (when resuming, the bins waiting are those in the checkpoint)
+  const bool resuming = ! _resume_waiting.empty();
+  assert( ! resuming || _resume_waiting.size() == _no_bins );
   for( unsigned i = 0; i != _no_bins; ++i )
     {
-      if( _bins[i].sn_2() < _scrub_sn_2 )
-	bin_ptrs.push_back( &_bins[i] );
+      if( resuming ? bool(_resume_waiting[i])
+	  : _bins[i].sn_2() < _scrub_sn_2 )
+	{
+	  waiting[i] = true;
+	  ++no_waiting;
+	  push_bin(i);
+	}
     }
 
+  // When scrubbing in batches, a bin only changes itself and its
+  // neighbours when dissolved. Bins which share no neighbours can
+  // therefore be dissolved at the same time, giving the same result
+  // as dissolving them one after the other.
+  const unsigned nthreads = _helper.scrub_threads();
+  bin_graph graph;
+  std::vector<char> claimed;
+  if( nthreads != 0 )
+    {
+      make_bin_graph( graph );
+      claimed.assign( _no_bins, 0 );
+    }
+
+  // mark bin and its neighbours as used in this batch
+  auto claim_bin = [&](const unsigned i, const char val)
+    {
+      claimed[i] = val;
+      for( std::vector<unsigned>::const_iterator n = graph[i].begin();
+	   n != graph[i].end(); ++n )
+	claimed[*n] = val;
+    };
+  // does bin or its neighbours overlap with the batch
+  auto is_claimed = [&](const unsigned i)
+    {
+      if( claimed[i] )
+	return true;
+      for( std::vector<unsigned>::const_iterator n = graph[i].begin();
+	   n != graph[i].end(); ++n )
+	if( claimed[*n] )
+	  return true;
+      return false;
+    };
+
+  std::vector<unsigned> batch;
+  std::vector<char> dissolved;
+  std::vector< std::vector<int> > receivers;
+  std::vector<bin::_Pt_container> oldpoints;
+
+  // dissolve item i of the batch
+  auto dissolve_item = [&](const size_t i)
+    {
+      bin* thebin = &_bins[ batch[i] ];
+      if( nthreads != 0 && thebin->store_index() < 0 )
+	oldpoints[i] = thebin->get_all_points();
+      receivers[i].clear();
+      if( _helper.bulk_scrub() )
+	dissolved[i] = dissolve_bin_bulk( thebin, &receivers[i] );
+      else
+	dissolved[i] = dissolve_bin( thebin, &receivers[i] );
+    };
+
   // we keep looping until the lowest S/N bin is removed
   for( ;; )
     {
-      double lowest_SN_2 = 1e99;
+      // find the lowest S/N bin still waiting
+      skip_old();
 
-      // iterate over bins, find those with the lowest S/N
+      // exit if no more bins remaining
+      if( queue.empty() )
+	break;
+
+      // Take the lowest S/N bin. If scrubbing in batches, keep taking
+      // the next lowest until one is found which touches the batch.
+      batch.clear();
+      for( ;; )
+	{
+	  const unsigned lowest = queue.top().index;
+	  queue.pop();
+	  batch.push_back( lowest );
+
+	  if( nthreads == 0 )
+	    break;
+	  claim_bin( lowest, 1 );
+	  skip_old();
+	  if( queue.empty() || is_claimed( queue.top().index ) )
+	    break;
+	}
 
-      BPV::iterator i = bin_ptrs.begin();
-      BPV::iterator lowest_bin = i-1;
-      while( i != bin_ptrs.end() )
+      if( receivers.size() < batch.size() )
 	{
-	  const double SN_2 = (*i)->sn_2();
-	  // if this bin has a larger S/N than threshold, remove it
-	  // iterators below this one should still be valid
-	  if( SN_2 >= _scrub_sn_2 )
+	  dissolved.resize( batch.size() );
+	  receivers.resize( batch.size() );
+	  oldpoints.resize( batch.size() );
+	}
+
+      // get rid of the bins (if they cannot be disolved, it doesn't matter)
+      const size_t nthreads_batch = std::min( size_t(nthreads), batch.size() );
+      if( nthreads_batch <= 1 )
+	{
+	  for( size_t i = 0; i != batch.size(); ++i )
+	    dissolve_item(i);
+	}
+      else
+	{
+	  std::atomic<size_t> next(0);
+	  auto worker = [&]()
 	    {
-	      i = bin_ptrs.erase(i);
+	      for( size_t i = next++; i < batch.size(); i = next++ )
+		dissolve_item(i);
+	    };
+
+	  std::vector<std::thread> threads;
+	  for( size_t t = 0; t != nthreads_batch; ++t )
+	    threads.push_back( std::thread(worker) );
+	  for( auto& t : threads )
+	    t.join();
+	}
+
+      if( nthreads != 0 )
+	for( size_t i = 0; i != batch.size(); ++i )
+	  claim_bin( batch[i], 0 );
+
+      // update the state in the order the bins were taken
+      for( size_t i = 0; i != batch.size(); ++i )
+	{
+	  const unsigned binno = batch[i];
+	  if( ! dissolved[i] )
+	    {
+	      cout << "WARNING: Could not dissolve bin "
+		   << binno << " into surroundings\n";
+	      _cannot_dissolve[ binno ] = true;
 	    }
-	  else
+	  waiting[binno] = false;
+	  --no_waiting;
+
+	  // show progress to user
+	  if( verbose && no_waiting % 10 == 0 )
 	    {
-	      // if this is lower than before, store it
-	      if( SN_2 < lowest_SN_2 )
+	      std::cout << std::setw(5) << no_waiting << ' ';
+	      std::cout.flush();
+	      if( no_waiting % 100 == 0 )
+		std::cout << '\n';
+	    }
+
+	  // update the bins which have gained pixels
+	  std::vector<int>& recv = receivers[i];
+	  std::sort( recv.begin(), recv.end() );
+	  recv.erase( std::unique( recv.begin(), recv.end() ), recv.end() );
+	  for( std::vector<int>::const_iterator r = recv.begin();
+	       r != recv.end(); ++r )
+	    {
+	      _bins[*r].compact();
+	      if( ! waiting[*r] )
+		continue;
+
+	      if( _bins[*r].sn_2() >= _scrub_sn_2 )
 		{
-		  lowest_SN_2 = SN_2;
-		  lowest_bin = i;
+		  waiting[*r] = false;
+		  --no_waiting;
+		}
+	      else
+		{
+		  push_bin(*r);
 		}
-	      ++i;
 	    }
-	} // loop over bins
 
-      // exit if no more bins remaining
-      if( lowest_bin < bin_ptrs.begin() || lowest_SN_2 >= _scrub_sn_2 )
-	break;
-
-      // get rid of that bin (if it cannot be disolved, it doesn't matter
-      dissolve_bin( *lowest_bin );
-      bin_ptrs.erase( lowest_bin );
+	  if( nthreads != 0 )
+	    update_bin_graph( graph, binno, oldpoints[i] );
+	  _bins[binno].compact();
+	}
 
-      // show progress to user
-      if( bin_ptrs.size() % 10 == 0 )
-        {
-          std::cout << std::setw(5) << bin_ptrs.size() << ' ';
-          std::cout.flush();
-          if( bin_ptrs.size() % 100 == 0 )
-            std::cout << '\n';
-        }
+      if( _checkpoint )
+	_checkpoint( batch.size(), waiting );
     }
 
-  std::cout << "(i) Done\n";
+  if( verbose )
+    std::cout << "(i) Done\n";
 }
 
 void scrubber::scrub_large_bins(double fraction)
 {
-  std::cout << "(i) Scrubbing bins with fraction of area > "
-	    << fraction << "...\n";
+  if( _helper.verbose() )
+    std::cout << "(i) Scrubbing bins with fraction of area > "
+	      << fraction << "...\n";
 
   typedef bin_vector::iterator BI;
   const BI e = _bins.end();
 
   // get total number of pixels in bins
-  unsigned totct = 0;
+  unsigned long totct = 0;
   for( BI i = _bins.begin(); i != e; ++i )
     totct += i->count();
 
@@ -206,17 +608,19 @@ void scrubber::scrub_large_bins(double fraction)
       const double thisfrac = double(i->count()) / totct;
       if( thisfrac >= fraction )
 	{
-	  std::cout << " Scrubbing bin " << i->bin_no()
-		    << '\n';
+	  if( _helper.verbose() )
+	    std::cout << " Scrubbing bin " << i->bin_no()
+		      << '\n';
 
 	  i->drop_bin();
 	}
     }
 }
 
-void scrubber::renumber()
+void scrubber::renumber( std::vector<long>* orig_numbers )
 {
-  std::cout << "(i) Starting renumbering...\n";
+  if( _helper.verbose() )
+    std::cout << "(i) Starting renumbering...\n";
 
   {
     // split bins into those with counts and those without
@@ -225,6 +629,46 @@ void scrubber::renumber()
     _bins.erase(e, _bins.end());
   }
 
+  const size_t no_bins = _bins.size();
+  std::vector<size_t> order( no_bins );
+  for( size_t i = 0; i != no_bins; ++i )
+    order[i] = i;
+
+  if( _helper.hilbert_order() )
+    {
+      unsigned n = 1;
+      while( n < _xw || n < _yw )
+	n *= 2;
+
+      // position of the mean pixel of each bin along the curve
+      std::vector<unsigned long long> index( no_bins );
+      for( size_t i = 0; i != no_bins; ++i )
+	{
+	  double sx = 0, sy = 0;
+	  _bins[i].for_each_point( [&sx, &sy](int x, int y)
+				   {
+				     sx += x;
+				     sy += y;
+				   } );
+	  const double count = _bins[i].count();
+	  index[i] = hilbert_index( n, unsigned(sx / count),
+				    unsigned(sy / count) );
+	}
+
+      std::stable_sort( order.begin(), order.end(),
+			[&index](size_t a, size_t b)
+			{ return index[a] < index[b]; } );
+
+      bin_vector sorted;
+      sorted.reserve( no_bins );
+      for( size_t i = 0; i != no_bins; ++i )
+	sorted.push_back( std::move(_bins[order[i]]) );
+      _bins.swap( sorted );
+    }
+
+  if( orig_numbers != 0 )
+    orig_numbers->assign( order.begin(), order.end() );
+
   // now clear bin image, and repaint everything (doing renumber)
   _helper.bins_image()->set_all( -1 );
 
@@ -238,6 +682,7 @@ void scrubber::renumber()
       number++;
     }
 
-  std::cout << "(i)  " << number << " bins when finished\n"
-	    << "(i) Done\n";
+  if( _helper.verbose() )
+    std::cout << "(i)  " << number << " bins when finished\n"
+	      << "(i) Done\n";
 }
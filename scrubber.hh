@@ -1,6 +1,9 @@
 #ifndef SCRUBBER_HH
 #define SCRUBBER_HH
 
+#include <vector>
+#include <functional>
+
 #include "bin.hh"
 
 // go over image assigning stray bins to other bins
@@ -12,16 +15,70 @@ public:
 
   void scrub();
 
+  // called during scrub() with the number of bins just dissolved and
+  // which bins are still waiting to be scrubbed, to save the state
+  typedef std::function<void (unsigned long,
+			      const std::vector<bool>&)> checkpoint_fn;
+  void set_checkpoint( checkpoint_fn fn ) { _checkpoint = fn; }
+
+  // carry on scrubbing from a checkpoint, where only these bins are
+  // still waiting to be scrubbed
+  void set_waiting( const std::vector<bool>& waiting )
+  {
+    _resume_waiting = waiting;
+  }
+
   // renumber bins, throwing away bins with zero counts
-  void renumber();
+  // If the helper is set to, the bins are put in Hilbert curve order of
+  // their mean position. If orig_numbers is given, it is set to the
+  // number each bin would have otherwise.
+  void renumber( std::vector<long>* orig_numbers = 0 );
 
   // get rid of bins with fraction of pixels >= fraction
   void scrub_large_bins( double fraction );
 
 private:
-  void dissolve_bin( bin* diss_bin );
-  void find_best_neighbour(bin* thebin, bool allow_unconstrained,
-			   int* bestx, int* besty, int* bestbin);
+  // dissolve bin into neighbours, adding the numbers of the bins
+  // which receive pixels to receivers if set
+  // returns false if some pixels could not be moved
+  bool dissolve_bin( bin* diss_bin, std::vector<int>* receivers = 0 );
+  // dissolve bin in one step, by flood filling from its boundary
+  bool dissolve_bin_bulk( bin* diss_bin, std::vector<int>* receivers = 0 );
+
+  // list of neighbouring bins for each bin
+  typedef std::vector< std::vector<unsigned> > bin_graph;
+
+  // make the graph of which bins touch each other
+  void make_bin_graph( bin_graph& graph ) const;
+  // update graph after bin has been dissolved, before it is compacted
+  // again (its old pixels are in the store, or are oldpoints if it has
+  // no entry there)
+  void update_bin_graph( bin_graph& graph, const unsigned binno,
+			 const bin::_Pt_container& oldpoints ) const;
+
+  // possible move of edge pixel x,y of a dissolving bin into nbin,
+  // the bin of its neighbour n
+  struct candidate
+  {
+    double delta;
+    unsigned order, n;
+    int x, y;
+    long nbin;
+  };
+  typedef std::vector<candidate> candidate_vector;
+
+  // heap order: smallest delta first, then in order of edge scan
+  static bool candidate_later(const candidate& a, const candidate& b)
+  {
+    if( a.delta != b.delta ) return a.delta > b.delta;
+    if( a.order != b.order ) return a.order > b.order;
+    return a.n > b.n;
+  }
+
+  void add_candidate(const bin* thebin, const int x, const int y,
+		     const unsigned n, candidate_vector& cands);
+  bool find_best_neighbour(const bin* thebin, candidate_vector& cands,
+			   candidate* best);
 
 private:
   bin_helper& _helper;
@@ -32,6 +89,9 @@ private:
 
   std::vector<bool> _cannot_dissolve; // set if cannot dissolve a bin
 
+  checkpoint_fn _checkpoint;
+  std::vector<bool> _resume_waiting;
+
   const unsigned _xw, _yw;
 };
 